@@ -1,6 +1,9 @@
 #pragma once
 #include "FastMutex.h"
 #include "AutoLock.h"
+#include "Slab.h"
+#include "Magazine.h"
+#include "AllocStats.h"
 
 
 
@@ -20,12 +23,33 @@
 	deallocated. Always use Free or FreeAll to free any allocations made with Alloc. 
 	If you call ExFreePool your self with something you allocated with Alloc,
 	a system crash will happen when FreeAll tries to Free the same memory.
+
+	Small POOL_FLAG_PAGED / POOL_FLAG_NON_PAGED requests (up to Slab::_maxBlock bytes)
+	are served from a slab (see Slab.h) and never reach the pool manager once the slab
+	has pages. Those blocks are tracked by their slab page instead of the registry,
+	Free and FreeAll treat them exactly like pool allocations. Define ALLOC_NO_SLAB
+	before including this file to send every request to ExAllocatePool2.
+
+	Freed slab blocks first go to per-CPU magazines (see Magazine.h) and are handed
+	out again from there, so in steady state small Alloc/Free calls never take _mutex.
+	The mutex still guards the registry and the slab pages themselves.
+
+	Every Alloc/Free is counted per pool tag (see AllocStats.h), AllocSnapshot
+	copies the counters out, e.g. into an IOCTL output buffer.
+*/
+
+/*
+	The registry is an open-addressing hash set keyed by pointer (linear probing,
+	backward-shift deletion so no tombstones are left behind). The table is a power
+	of two in size, doubles when it gets 3/4 full and halves when it drops below 1/8,
+	so Alloc and Free are amortized O(1) and a workload hovering around a resize
+	boundary does not rehash on every call.
 */
 
 class _ALLOC_
 {
 private:
-	void Init(int newSize);
+	void Init(int newCapacity);
 	PVOID Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag);
 
 	bool Free(auto& p);
@@ -35,14 +59,38 @@ private:
 	auto offset(LONG64 val)
 	{ int i{ 0 }; while (val != 1) { val >>= 1; ++i; } return i; }
 
+	// Registry
+	struct Entry
+	{
+		ULONG_PTR Ptr;		// NULL marks an empty slot
+		SIZE_T Bytes;
+		UCHAR Tag;			// AllocStats index
+	};
+
+	constexpr int slot(ULONG_PTR p) const
+	{ return int(((p >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (_capacity - 1); }
+	int find(ULONG_PTR p) const;
+	bool insert(const Entry& e);
+	void erase(int index);
+
+	// Slab for PoolFlag, nullptr if the request has to go to the pool
+	Slab* slab(ULONG64 PoolFlag, size_t NumberOfBytes);
+
 private:
 	FastMutex _mutex{};
-	ULONG_PTR* _alloc{ nullptr };
+	Entry* _alloc{ nullptr };
+
+	// [0] paged, [1] non-paged
+	Slab _slab[2]{};
+	Magazines _magazines{};
+	AllocStats _stats{};
 
 	int _size{ 0 };
 	int _capacity{ 0 };
 	int _bytes{ 0 };
 
+	static constexpr int _minCapacity{ 16 };
+
 	// Mutex initialized?
 	bool _initialized{ false };
 	// Memory allocated?
@@ -52,44 +100,60 @@ private:
 	friend PVOID Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag);
 	friend bool Free(auto& p);
 	friend void FreeAll();
+	friend ULONG AllocSnapshot(AllocTagStats* Buffer, ULONG Count);
+
+};
 
-}_alloc_;
+// inline so every translation unit including this shares one registry
+inline _ALLOC_ _alloc_;
 
 
 
-void _ALLOC_::Init(int newCapacity)
+inline void _ALLOC_::Init(int newCapacity)
 {
 	if (newCapacity == _capacity || newCapacity < _size)
 		return;
 
-	_bytes = newCapacity * sizeof(ULONG_PTR);
-
-	// MmAllocateNonCachedMemory allocates atleast a PAGE_SIZE of physical memory.
-	//auto tmp = (ULONG_PTR*)MmAllocateNonCachedMemory(PAGE_SIZE);
-	
 	// ExAllocatePool2 will be a better choice since we can just allocate more space
 	// when needed and waste as little physical memory as possible.
-	auto tmp = (ULONG_PTR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _bytes, 'looP');
+	auto tmp = (Entry*)ExAllocatePool2(POOL_FLAG_NON_PAGED, newCapacity * sizeof(Entry), 'looP');
 	if (tmp)
 	{
-		// Memory is zero initialized unless POOL_FLAG_UNINITIALIZED is specified.
-		//RtlZeroMemory(tmp, newCapacity * sizeof(ULONG_PTR));
-		if (_alloc)
+		// First table, or the first one after FreeAll
+		if (!_allocated)
 		{
-			RtlCopyMemory(tmp, _alloc, _size * sizeof(ULONG_PTR));
-			ExFreePool(_alloc);
-			_alloc = tmp;
-			_capacity = newCapacity;
+			_magazines.Init();
+			_stats.Init();
 		}
-		else
+
+		// Memory is zero initialized unless POOL_FLAG_UNINITIALIZED is specified,
+		// and NULL marks an empty slot.
+		auto old = _alloc;
+		auto oldCapacity = _capacity;
+
+		_alloc = tmp;
+		_capacity = newCapacity;
+		_bytes = newCapacity * sizeof(Entry);
+		_size = 0;
+
+		if (old)
 		{
-			_alloc = tmp;
-			_capacity = newCapacity;
+			// Slots depend on the capacity, so every entry has to be rehashed
+			for (int i = 0; i < oldCapacity; ++i)
+			{
+				if (old[i].Ptr != NULL)
+					insert(old[i]);
+			}
+			ExFreePool(old);
 		}
 		DbgMsg("SIZE: %d\nCAPACITY: %d\nBYTES: %d\n", _size, _capacity, _bytes);
 
 		if (!_initialized)
+		{
 			_mutex.Init();
+			_slab[0].Init(POOL_FLAG_PAGED);
+			_slab[1].Init(POOL_FLAG_NON_PAGED);
+		}
 
 		_initialized = true;
 		_allocated = true;
@@ -97,77 +161,139 @@ void _ALLOC_::Init(int newCapacity)
 }
 
 
-PVOID _ALLOC_::Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag)
+inline PVOID _ALLOC_::Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag)
 {
 	auto flag = (LONG64)PoolFlag;
 	if (_bittest64(&flag, offset(POOL_FLAG_PAGED)))
 		ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 	else
 		ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-	
-	if (_capacity == 0)
-		Init(8);
-	else if (_size == _capacity)
-		Init(_capacity + 8);
 
-	if (is_active() && _size < _capacity)
+	if (!_initialized)
+		Init(_minCapacity);
+	if (!_initialized)
+		return nullptr;
+
+	// After FreeAll the registry, magazines and stats are gone, a slab block
+	// handed out now could never be freed
+	if (!_allocated)
 	{
-		auto ptr = ExAllocatePool2(PoolFlag, NumberOfBytes, Tag);
+		AutoLock lock(_mutex);
+		if (!_allocated)
+			Init(_minCapacity);
+	}
+	if (!_allocated)
+		return nullptr;
+
+	auto tag = _stats.Index(Tag);
+
+	if (auto cache = slab(PoolFlag, NumberOfBytes))
+	{
+		auto ptr = _magazines.Alloc(int(cache - _slab), Slab::ClassOf(NumberOfBytes));
 		if (ptr)
+		{
+			Slab::Acquire(ptr, tag);
+			// Same guarantee as ExAllocatePool2 without POOL_FLAG_UNINITIALIZED
+			RtlZeroMemory(ptr, Slab::BlockSize(ptr));
+		}
+		else
 		{
 			AutoLock lock(_mutex);
-			_alloc[_size++] = (ULONG_PTR)ptr;
-			// Memory is zero initialized unless POOL_FLAG_UNINITIALIZED is specified.
-			//RtlZeroMemory(ptr, NumberOfBytes);
+			ptr = cache->Alloc(NumberOfBytes, tag);
+		}
+
+		if (ptr)
+		{
+			_stats.OnAlloc(tag, NumberOfBytes, Slab::BlockSize(ptr));
 			return ptr;
 		}
-		else
+		// Out of slab pages, try the pool directly
+	}
+
+	auto ptr = ExAllocatePool2(PoolFlag, NumberOfBytes, Tag);
+	if (!ptr)
+	{
+		DbgMsg("(PVOID Alloc) -> Ptr = ExAllocatePool2(PoolFlag, NumberOfBytes, Tag) returned NULL\n");
+		return nullptr;
+	}
+
+	{
+		AutoLock lock(_mutex);
+		if (!_allocated)
+			Init(_minCapacity);
+		else if ((_size + 1) * 4 > _capacity * 3)
+			Init(_capacity * 2);
+
+		// Memory is zero initialized unless POOL_FLAG_UNINITIALIZED is specified.
+		if (is_active() && insert({ (ULONG_PTR)ptr, NumberOfBytes, tag }))
 		{
-			DbgMsg("(PVOID Alloc) -> Ptr = ExAllocatePool2(PoolFlag, NumberOfBytes, Tag) returned NULL\n");
-			return nullptr;
+			_stats.OnAlloc(tag, NumberOfBytes, NumberOfBytes);
+			return ptr;
 		}
 	}
 
+	DbgMsg("(PVOID Alloc) -> failed to track %p, registry is full\n", ptr);
+	ExFreePool(ptr);
 	return nullptr;
 }
 
 
-bool _ALLOC_::Free(auto& p)
+inline bool _ALLOC_::Free(auto& p)
 {
 	ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
-	if (_size == 0 || p == nullptr || !is_active())
+	if (p == nullptr || !is_active())
 		return false;
 
-	if (_size < (_capacity / 2) && ((_capacity / 2) % 8) == 0)
-		Init(_capacity / 2);
-	else if (_size < (_capacity / 2) && ((_capacity - 8) % 8) == 0)
-		Init(_capacity - 8);
-
-	for (int i = 0; i < _size; ++i)
+#ifndef ALLOC_NO_SLAB
+	auto owner = _slab[0].Owns(p) ? &_slab[0] : _slab[1].Owns(p) ? &_slab[1] : nullptr;
+	if (owner)
 	{
-		if (_alloc[i] == (ULONG_PTR)p)
+		if (!Slab::Release(p))
+			return false;
+
+		_stats.OnFree(Slab::TagOf(p), Slab::BlockSize(p));
+
+		auto kind = int(owner - _slab);
+		auto cls = Slab::ClassOf(p);
+		if (!_magazines.Free(kind, cls, p))
 		{
 			AutoLock lock(_mutex);
-			if (i == _size - 1)
-				_alloc[--_size] = NULL;
-			else
-			{
-				_alloc[i] = _alloc[_size - 1];
-				_alloc[--_size] = NULL;
-			}
-
-			DbgMsg("ExFreePool(%p) called\n", p);
-			ExFreePool(p);
-			p = nullptr;
-			return true;
+			owner->Return(p);
 		}
+		else if (_magazines.Overfull(kind, cls))
+		{
+			AutoLock lock(_mutex);
+			_magazines.Trim(kind, cls, [owner](PVOID block) { owner->Return(block); });
+		}
+
+		p = nullptr;
+		return true;
 	}
-	return false;
+#endif // !ALLOC_NO_SLAB
+
+	AutoLock lock(_mutex);
+	if (_size == 0)
+		return false;
+
+	auto index = find((ULONG_PTR)p);
+	if (index < 0)
+		return false;
+
+	_stats.OnFree(_alloc[index].Tag, _alloc[index].Bytes);
+	erase(index);
+	DbgMsg("ExFreePool(%p) called\n", p);
+	ExFreePool(p);
+	p = nullptr;
+
+	if (_capacity > _minCapacity && _size * 8 < _capacity)
+		Init(_capacity / 2);
+
+	return true;
 }
 
 
-void _ALLOC_::FreeAll()
+inline void _ALLOC_::FreeAll()
 {
 	ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
 
@@ -175,40 +301,129 @@ void _ALLOC_::FreeAll()
 	{
 		{
 			AutoLock lock(_mutex);
-			while (_size > 0)
+			for (int i = 0; i < _capacity && _size > 0; ++i)
 			{
-				auto p = (PVOID)_alloc[--_size];
-				DbgMsg("ExFreePool(%p) called\n", p);
-				ExFreePool(p);
+				if (_alloc[i].Ptr != NULL)
+				{
+					auto p = (PVOID)_alloc[i].Ptr;
+					_alloc[i] = {};
+					--_size;
+					DbgMsg("ExFreePool(%p) called\n", p);
+					ExFreePool(p);
+				}
 			}
+
+			_magazines.FreeAll();
+			_slab[0].FreeAll();
+			_slab[1].FreeAll();
+			_stats.Free();
 		}
 
 		ExFreePool(_alloc);
 		_alloc = nullptr;
-		_bytes = _capacity = 0;
+		_size = _bytes = _capacity = 0;
 		_allocated = false;
 	}
 }
 
 
+inline int _ALLOC_::find(ULONG_PTR p) const
+{
+	auto mask = _capacity - 1;
+	for (auto i = slot(p); _alloc[i].Ptr != NULL; i = (i + 1) & mask)
+	{
+		if (_alloc[i].Ptr == p)
+			return i;
+	}
+	return -1;
+}
+
+
+inline bool _ALLOC_::insert(const Entry& e)
+{
+	if (e.Ptr == NULL || _size == _capacity)
+		return false;
+
+	auto mask = _capacity - 1;
+	auto i = slot(e.Ptr);
+	while (_alloc[i].Ptr != NULL)
+	{
+		if (_alloc[i].Ptr == e.Ptr)
+			return true;
+		i = (i + 1) & mask;
+	}
+
+	_alloc[i] = e;
+	++_size;
+	return true;
+}
+
+
+inline Slab* _ALLOC_::slab(ULONG64 PoolFlag, size_t NumberOfBytes)
+{
+#ifndef ALLOC_NO_SLAB
+	if (Slab::Fits(NumberOfBytes))
+	{
+		if (PoolFlag == POOL_FLAG_PAGED)
+			return &_slab[0];
+		if (PoolFlag == POOL_FLAG_NON_PAGED)
+			return &_slab[1];
+	}
+#else
+	UNREFERENCED_PARAMETER(PoolFlag);
+	UNREFERENCED_PARAMETER(NumberOfBytes);
+#endif // !ALLOC_NO_SLAB
+	return nullptr;
+}
+
+
+inline void _ALLOC_::erase(int index)
+{
+	// Backward-shift deletion: pull every following entry of the probe run
+	// that is allowed to live in the hole back into it, so lookups never
+	// need tombstones to find entries placed behind a removed one.
+	auto mask = _capacity - 1;
+	for (auto i = (index + 1) & mask; _alloc[i].Ptr != NULL; i = (i + 1) & mask)
+	{
+		auto home = slot(_alloc[i].Ptr);
+		if (((i - home) & mask) >= ((i - index) & mask))
+		{
+			_alloc[index] = _alloc[i];
+			index = i;
+		}
+	}
+
+	_alloc[index] = {};
+	--_size;
+}
+
+
 
 // Free functions
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
-PVOID Alloc(size_t NumberOfBytes, ULONG64 PoolFlag = POOL_FLAG_PAGED, ULONG Tag = ' ')
+inline PVOID Alloc(size_t NumberOfBytes, ULONG64 PoolFlag = POOL_FLAG_PAGED, ULONG Tag = ' ')
 {
 	return _alloc_.Alloc(NumberOfBytes, PoolFlag, Tag);
 }
 
 
-bool Free(auto& p)
+inline bool Free(auto& p)
 {
 	return _alloc_.Free(p);
 }
 
 
-void FreeAll()
+inline void FreeAll()
 {
 	_alloc_.FreeAll();
 }
+
+
+// Per-tag counters of the tracked allocations, returns the number of tags
+// in use and fills at most Count of them.
+inline ULONG AllocSnapshot(AllocTagStats* Buffer, ULONG Count)
+{
+	return _alloc_._stats.Snapshot(Buffer, Count);
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,244 @@
+#pragma once
+
+
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Live allocation statistics for Alloc(), kept per pool tag.
+
+	The first _maxTags tags seen get their own counters, anything after that is
+	summed up under Tag 0. Counters live in per-CPU, cache-line aligned storage and
+	are updated with interlocked ops on the current processor's line, so a thread
+	that migrates mid-update is still counted correctly and CPUs never share a line.
+
+	The high-water mark needs one global number, so each CPU folds its live byte
+	delta into the tag's shared total once it moves by more than _foldBytes. The
+	mark can therefore lag the true peak by at most _foldBytes per processor,
+	Snapshot tops it up with the exact live total it just summed.
+
+	Snapshot fills an array of plain AllocTagStats, so the result can be copied
+	straight into an IOCTL output buffer.
+*/
+
+struct AllocTagStats
+{
+	static constexpr int _buckets{ 24 };
+
+	ULONG Tag;
+	ULONG Reserved;
+	LONG64 LiveBytes;
+	LONG64 LiveBlocks;
+	ULONG64 Allocs;
+	ULONG64 Frees;
+	LONG64 HighWaterBytes;
+	// Allocation count by requested size, bucket i is [2^i, 2^(i+1)) bytes,
+	// the last bucket takes everything bigger
+	ULONG64 Histogram[_buckets];
+};
+
+
+class AllocStats
+{
+public:
+	static constexpr int _maxTags{ 16 };
+	// Index used for tags that didn't fit in the table
+	static constexpr UCHAR _otherTag{ _maxTags };
+	static constexpr LONG64 _foldBytes{ 64 * 1024 };
+
+	bool Init();
+	void Free();
+
+	UCHAR Index(ULONG Tag);
+	void OnAlloc(UCHAR index, size_t NumberOfBytes, size_t BlockBytes);
+	void OnFree(UCHAR index, size_t BlockBytes);
+
+	// Returns the number of tags in use, fills at most Count of them
+	ULONG Snapshot(AllocTagStats* Buffer, ULONG Count);
+
+private:
+	struct DECLSPEC_CACHEALIGN Counters
+	{
+		LONG64 LiveBytes;
+		LONG64 LiveBlocks;
+		LONG64 Allocs;
+		LONG64 Frees;
+		LONG64 Unfolded;
+		LONG64 Histogram[AllocTagStats::_buckets];
+	};
+
+	struct DECLSPEC_CACHEALIGN Global
+	{
+		LONG64 LiveBytes;
+		LONG64 volatile HighWaterBytes;
+	};
+
+	static int bucket(size_t NumberOfBytes)
+	{
+		ULONG i{ 0 };
+		_BitScanReverse64(&i, NumberOfBytes | 1);
+		return i < AllocTagStats::_buckets ? int(i) : AllocTagStats::_buckets - 1;
+	}
+	Counters& local(UCHAR index) { return _cpus[KeGetCurrentProcessorNumberEx(nullptr) * (_maxTags + 1) + index]; }
+	void fold(UCHAR index, LONG64 delta);
+	static void raise(LONG64 volatile* high, LONG64 value);
+
+private:
+	Counters* _cpus{ nullptr };
+	ULONG _cpuCount{ 0 };
+	// 0 is a free slot, filled once with InterlockedCompareExchange
+	LONG volatile _tags[_maxTags]{};
+	Global _global[_maxTags + 1]{};
+};
+
+
+
+inline bool AllocStats::Init()
+{
+	if (_cpus)
+		return true;
+
+	_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	_cpus = (Counters*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+		_cpuCount * (_maxTags + 1) * sizeof(Counters), 'tatS');
+	if (!_cpus)
+	{
+		DbgMsg("(AllocStats::Init) -> failed allocation, statistics disabled\n");
+		_cpuCount = 0;
+		return false;
+	}
+	return true;
+}
+
+
+inline void AllocStats::Free()
+{
+	if (_cpus)
+	{
+		ExFreePool(_cpus);
+		_cpus = nullptr;
+		_cpuCount = 0;
+	}
+
+	RtlZeroMemory((PVOID)_tags, sizeof(_tags));
+	RtlZeroMemory(_global, sizeof(_global));
+}
+
+
+inline UCHAR AllocStats::Index(ULONG Tag)
+{
+	if (Tag == 0)
+		return _otherTag;
+
+	for (int i = 0; i < _maxTags; ++i)
+	{
+		auto cur = (ULONG)ReadNoFence(&_tags[i]);
+		if (cur == Tag)
+			return (UCHAR)i;
+
+		if (cur == 0)
+		{
+			cur = (ULONG)InterlockedCompareExchange(&_tags[i], (LONG)Tag, 0);
+			if (cur == 0 || cur == Tag)
+				return (UCHAR)i;
+		}
+	}
+	return _otherTag;
+}
+
+
+inline void AllocStats::OnAlloc(UCHAR index, size_t NumberOfBytes, size_t BlockBytes)
+{
+	if (!_cpus)
+		return;
+
+	auto& c = local(index);
+	InterlockedAdd64(&c.LiveBytes, (LONG64)BlockBytes);
+	InterlockedIncrement64(&c.LiveBlocks);
+	InterlockedIncrement64(&c.Allocs);
+	InterlockedIncrement64(&c.Histogram[bucket(NumberOfBytes)]);
+
+	auto unfolded = InterlockedAdd64(&c.Unfolded, (LONG64)BlockBytes);
+	if (unfolded >= _foldBytes)
+		fold(index, InterlockedExchange64(&c.Unfolded, 0));
+}
+
+
+inline void AllocStats::OnFree(UCHAR index, size_t BlockBytes)
+{
+	if (!_cpus)
+		return;
+
+	auto& c = local(index);
+	InterlockedAdd64(&c.LiveBytes, -(LONG64)BlockBytes);
+	InterlockedDecrement64(&c.LiveBlocks);
+	InterlockedIncrement64(&c.Frees);
+
+	auto unfolded = InterlockedAdd64(&c.Unfolded, -(LONG64)BlockBytes);
+	if (unfolded <= -_foldBytes)
+		fold(index, InterlockedExchange64(&c.Unfolded, 0));
+}
+
+
+inline void AllocStats::fold(UCHAR index, LONG64 delta)
+{
+	auto& g = _global[index];
+	raise(&g.HighWaterBytes, InterlockedAdd64(&g.LiveBytes, delta));
+}
+
+
+inline void AllocStats::raise(LONG64 volatile* high, LONG64 value)
+{
+	auto cur = ReadNoFence64(high);
+	while (value > cur)
+	{
+		auto prev = InterlockedCompareExchange64(high, value, cur);
+		if (prev == cur)
+			break;
+		cur = prev;
+	}
+}
+
+
+inline ULONG AllocStats::Snapshot(AllocTagStats* Buffer, ULONG Count)
+{
+	if (!_cpus)
+		return 0;
+
+	ULONG used{ 0 };
+	for (int i = 0; i <= _maxTags; ++i)
+	{
+		ULONG tag = i < _maxTags ? (ULONG)ReadNoFence(&_tags[i]) : 0;
+		if (i < _maxTags && tag == 0)
+			continue;
+
+		AllocTagStats s{};
+		s.Tag = tag;
+		for (ULONG cpu = 0; cpu < _cpuCount; ++cpu)
+		{
+			auto& c = _cpus[cpu * (_maxTags + 1) + i];
+			s.LiveBytes += ReadNoFence64(&c.LiveBytes);
+			s.LiveBlocks += ReadNoFence64(&c.LiveBlocks);
+			s.Allocs += ReadNoFence64(&c.Allocs);
+			s.Frees += ReadNoFence64(&c.Frees);
+			for (int b = 0; b < AllocTagStats::_buckets; ++b)
+				s.Histogram[b] += ReadNoFence64(&c.Histogram[b]);
+		}
+
+		// The "other" bucket only shows up once something landed in it
+		if (i == _maxTags && s.Allocs == 0)
+			continue;
+
+		raise(&_global[i].HighWaterBytes, s.LiveBytes);
+		s.HighWaterBytes = ReadNoFence64(&_global[i].HighWaterBytes);
+
+		if (used < Count && Buffer)
+			Buffer[used] = s;
+		++used;
+	}
+	return used;
+}
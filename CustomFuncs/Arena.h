@@ -0,0 +1,217 @@
+#pragma once
+
+
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Region allocator for memory that dies all at once, like an IOCTL response
+	or everything built during one process walk.
+
+	Alloc bumps a pointer inside the newest chunk and chains a new chunk (at least
+	a page) when it runs out, nothing is ever freed on its own. Free gives every
+	chunk back to the pool in one call, Reset does the same but keeps the newest
+	chunk for the next round. Save/Rewind release only what was allocated after
+	the mark, ArenaScope does that automatically at the end of a scope:
+
+		Arena arena;
+		arena.Init(POOL_FLAG_PAGED);
+		{
+			ArenaScope scope(arena);
+			auto info = (ProcessInfo*)arena.Alloc(sizeof(ProcessInfo));
+			...
+		}	// everything allocated in the scope is gone
+		arena.Free();
+
+	Memory is zeroed like ExAllocatePool2 does. Reset and Free invalidate every
+	Mark saved before them. An Arena is not synchronized, use one per request or
+	guard it with a lock.
+*/
+
+class Arena
+{
+public:
+	struct Mark
+	{
+		PVOID Chunk;
+		size_t Used;
+	};
+
+	void Init(ULONG64 PoolFlag = POOL_FLAG_PAGED, ULONG Tag = 'anrA');
+	PVOID Alloc(size_t NumberOfBytes, size_t Alignment = MEMORY_ALLOCATION_ALIGNMENT);
+
+	Mark Save() const { return { _chunk, _chunk ? _chunk->Used : 0 }; }
+	void Rewind(const Mark& mark);
+
+	void Reset();
+	void Free();
+
+	// Total bytes held from the pool
+	constexpr auto Reserved() const { return _reserved; }
+
+private:
+	struct Chunk
+	{
+		Chunk* Prev;
+		size_t Size;		// usable bytes after the header
+		size_t Used;
+	};
+
+	static constexpr size_t _header{ (sizeof(Chunk) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1) };
+	static auto data(Chunk* chunk) { return (UCHAR*)chunk + _header; }
+
+	Chunk* NewChunk(size_t NumberOfBytes);
+	void Release(Chunk* chunk);
+
+private:
+	Chunk* _chunk{ nullptr };
+	size_t _reserved{ 0 };
+	ULONG64 _poolFlag{ POOL_FLAG_PAGED };
+	ULONG _tag{ 'anrA' };
+};
+
+
+class ArenaScope
+{
+public:
+	ArenaScope(Arena& arena) : _arena{ arena }, _mark{ arena.Save() }
+	{
+	}
+	~ArenaScope()
+	{
+		_arena.Rewind(_mark);
+	}
+
+private:
+	Arena& _arena;
+	Arena::Mark _mark;
+};
+
+
+// Container memory policy (PoolPolicy.h) for a global arena, not synchronized
+// either. Free does nothing, a container's old buffers stay until the arena is
+// reset, so it's for containers that don't outlive one round of work
+template <Arena& A>
+struct ArenaPolicy
+{
+	static PVOID Allocate(size_t NumberOfBytes, ULONG Tag)
+	{
+		UNREFERENCED_PARAMETER(Tag);
+		return A.Alloc(NumberOfBytes);
+	}
+
+	static void Free(PVOID p, size_t NumberOfBytes)
+	{
+		UNREFERENCED_PARAMETER(p);
+		UNREFERENCED_PARAMETER(NumberOfBytes);
+	}
+};
+
+
+
+inline void Arena::Init(ULONG64 PoolFlag, ULONG Tag)
+{
+	_poolFlag = PoolFlag;
+	_tag = Tag;
+}
+
+
+inline PVOID Arena::Alloc(size_t NumberOfBytes, size_t Alignment)
+{
+	// Alignment has to be a power of two
+	ASSERT(Alignment && (Alignment & (Alignment - 1)) == 0);
+
+	if (NumberOfBytes == 0)
+		return nullptr;
+
+	auto fits = [&](Chunk* chunk, size_t& offset)
+	{
+		auto base = (ULONG_PTR)data(chunk);
+		offset = ((base + chunk->Used + Alignment - 1) & ~(Alignment - 1)) - base;
+		return offset <= chunk->Size && chunk->Size - offset >= NumberOfBytes;
+	};
+
+	size_t offset{ 0 };
+	if (!_chunk || !fits(_chunk, offset))
+	{
+		auto chunk = NewChunk(NumberOfBytes + Alignment);
+		if (!chunk)
+			return nullptr;
+
+		chunk->Prev = _chunk;
+		_chunk = chunk;
+		fits(_chunk, offset);
+	}
+
+	auto ptr = data(_chunk) + offset;
+	_chunk->Used = offset + NumberOfBytes;
+	RtlZeroMemory(ptr, NumberOfBytes);
+	return ptr;
+}
+
+
+inline void Arena::Rewind(const Mark& mark)
+{
+	while (_chunk && _chunk != mark.Chunk)
+	{
+		auto prev = _chunk->Prev;
+		Release(_chunk);
+		_chunk = prev;
+	}
+
+	if (_chunk)
+		_chunk->Used = mark.Used;
+}
+
+
+inline void Arena::Reset()
+{
+	if (!_chunk)
+		return;
+
+	while (_chunk->Prev)
+	{
+		auto prev = _chunk->Prev;
+		_chunk->Prev = prev->Prev;
+		Release(prev);
+	}
+	_chunk->Used = 0;
+}
+
+
+inline void Arena::Free()
+{
+	Rewind({ nullptr, 0 });
+}
+
+
+inline Arena::Chunk* Arena::NewChunk(size_t NumberOfBytes)
+{
+	auto bytes = _header + NumberOfBytes;
+	bytes = bytes < PAGE_SIZE ? PAGE_SIZE : (bytes + PAGE_SIZE - 1) & ~size_t(PAGE_SIZE - 1);
+
+	// Alloc zeroes what it hands out, no need for the pool to do it as well
+	auto chunk = (Chunk*)ExAllocatePool2(_poolFlag | POOL_FLAG_UNINITIALIZED, bytes, _tag);
+	if (!chunk)
+	{
+		DbgMsg("(Arena::NewChunk) -> ExAllocatePool2(%llu) returned NULL\n", (ULONG64)bytes);
+		return nullptr;
+	}
+
+	chunk->Prev = nullptr;
+	chunk->Size = bytes - _header;
+	chunk->Used = 0;
+	_reserved += bytes;
+	return chunk;
+}
+
+
+inline void Arena::Release(Chunk* chunk)
+{
+	_reserved -= _header + chunk->Size;
+	ExFreePool(chunk);
+}
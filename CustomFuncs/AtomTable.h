@@ -0,0 +1,274 @@
+#pragma once
+#include <ntddk.h>
+#include "HashMap.h"
+#include "SegmentedVector.h"
+#include "Search.h"
+#include "FastMutex.h"
+#include "AutoLock.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Interned names, each one stored once and known by a 32 bit Atom.
+
+		auto svchost = atoms.Add("svchost.exe");
+		...
+		if (atoms.Find(name, len) == svchost)
+
+	Add returns the same atom for the same name for as long as anyone holds it,
+	so comparing two names is comparing two ULONGs. Names are matched ignoring
+	ASCII case like Windows does with file names, the spelling that was added
+	first is the one that's kept.
+
+	Every atom is reference counted: Add and AddRef take a reference, Release
+	drops one and the name is freed with the last. Find doesn't take one, its
+	atom is only good for comparing while somebody else holds the name. The
+	hash is worked out once per Add/Find and kept with the name, rehashing the
+	index never touches the characters again.
+
+	Add/Find/Release(last) take a fast mutex (<= APC_LEVEL). AddRef, Release of
+	a name that's still held elsewhere and Name() are lock free, names never
+	move while they're held. 0 is never an atom, Add returns it when the pool is
+	out.
+
+	The names, the index and the atom slots all come from Policy, a table only
+	used below DISPATCH_LEVEL can be a BasicAtomTable<PagedPolicy>.
+*/
+
+typedef ULONG Atom;
+
+
+// Key of the index, points at the interned characters (or the caller's, for a lookup)
+struct AtomKey
+{
+	ULONG64 Hash;
+	const CHAR* Name;
+	USHORT Length;
+};
+
+template <>
+struct Hasher<AtomKey>
+{
+	ULONG64 operator()(const AtomKey& key) const { return key.Hash; }
+};
+
+template <>
+struct EqualTo<AtomKey>
+{
+	bool operator()(const AtomKey& a, const AtomKey& b) const
+	{
+		return a.Hash == b.Hash && a.Length == b.Length && AsciiEquals(a.Name, b.Name, a.Length);
+	}
+};
+
+
+template <typename Policy = NonPagedPolicy>
+class BasicAtomTable
+{
+public:
+	bool Init(ULONG Capacity = 64, ULONG Tag = 'motA');
+
+	Atom Add(const CHAR* name, size_t len);
+	Atom Add(const CHAR* name) { return Add(name, strlen(name)); }
+	// 0 if the name isn't in the table, no reference is taken
+	Atom Find(const CHAR* name, size_t len);
+	Atom Find(const CHAR* name) { return Find(name, strlen(name)); }
+
+	// Only for an atom the caller already holds
+	void AddRef(Atom atom);
+	void Release(Atom atom);
+
+	// Zero terminated, valid while the atom is held
+	const CHAR* Name(Atom atom) const { return entry(atom)->Name; }
+	USHORT Length(Atom atom) const { return entry(atom)->Length; }
+	ULONG64 Hash(Atom atom) const { return entry(atom)->Hash; }
+
+	ULONG Size() const { return _size; }
+
+	// Frees every name, held or not
+	void Free();
+
+private:
+	struct Entry
+	{
+		ULONG64 Hash;
+		LONG volatile Refs;
+		USHORT Length;
+		CHAR Name[1];
+	};
+
+	static ULONG64 hash(const CHAR* name, size_t len);
+	static size_t bytes(size_t len) { return FIELD_OFFSET(Entry, Name) + len + 1; }
+	Entry* entry(Atom atom) const;
+
+private:
+	HashMap<AtomKey, Atom, Hasher<AtomKey>, EqualTo<AtomKey>, Policy> _index;
+	// Entry of atom n at n - 1. A free slot holds (next free slot << 1) | 1
+	segmented_vector<Entry*, Policy> _entries;
+	LONG _freeSlot{ -1 };
+	ULONG _size{ 0 };
+	ULONG _tag{ 'motA' };
+	FastMutex _mutex;
+};
+
+typedef BasicAtomTable<> AtomTable;
+
+
+template <typename Policy>
+bool BasicAtomTable<Policy>::Init(ULONG Capacity, ULONG Tag)
+{
+	_mutex.Init();
+	_tag = Tag;
+	return _index.Init(Capacity, Tag);
+}
+
+
+template <typename Policy>
+Atom BasicAtomTable<Policy>::Add(const CHAR* name, size_t len)
+{
+	if (len > MAXUSHORT)
+		return 0;
+
+	AtomKey key{ hash(name, len), name, USHORT(len) };
+
+	AutoLock lock(_mutex);
+	if (auto atom = _index.Find(key))
+	{
+		InterlockedIncrement(&entry(*atom)->Refs);
+		return *atom;
+	}
+
+	auto e = (Entry*)Policy::Allocate(bytes(len), _tag);
+	if (!e)
+	{
+		DbgMsg("(AtomTable::Add) -> failed allocation\n");
+		return 0;
+	}
+
+	e->Hash = key.Hash;
+	e->Refs = 1;
+	e->Length = USHORT(len);
+	RtlCopyMemory(e->Name, name, len);
+	e->Name[len] = NULL;
+
+	LONG slot = _freeSlot;
+	if (slot >= 0)
+		_freeSlot = LONG((LONG_PTR)_entries[slot] >> 1);
+	else if (_entries.push_back(nullptr))
+		slot = _entries.size() - 1;
+	else
+	{
+		Policy::Free(e, bytes(len));
+		return 0;
+	}
+
+	// The index keeps pointing at the interned copy, not the caller's buffer
+	key.Name = e->Name;
+	Atom atom = slot + 1;
+	if (!_index.Insert(key, atom))
+	{
+		_entries[slot] = (Entry*)(((LONG_PTR)_freeSlot << 1) | 1);
+		_freeSlot = slot;
+		Policy::Free(e, bytes(len));
+		return 0;
+	}
+
+	_entries[slot] = e;
+	++_size;
+	return atom;
+}
+
+
+template <typename Policy>
+Atom BasicAtomTable<Policy>::Find(const CHAR* name, size_t len)
+{
+	if (len > MAXUSHORT)
+		return 0;
+
+	AtomKey key{ hash(name, len), name, USHORT(len) };
+
+	AutoLock lock(_mutex);
+	auto atom = _index.Find(key);
+	return atom ? *atom : 0;
+}
+
+
+template <typename Policy>
+void BasicAtomTable<Policy>::AddRef(Atom atom)
+{
+	InterlockedIncrement(&entry(atom)->Refs);
+}
+
+
+template <typename Policy>
+void BasicAtomTable<Policy>::Release(Atom atom)
+{
+	auto e = entry(atom);
+
+	// Anything but the last reference goes without the lock
+	for (LONG refs = e->Refs; refs > 1; refs = e->Refs)
+	{
+		if (InterlockedCompareExchange(&e->Refs, refs - 1, refs) == refs)
+			return;
+	}
+
+	// Add may have found it again in the meantime, then it stays
+	AutoLock lock(_mutex);
+	if (InterlockedDecrement(&e->Refs))
+		return;
+
+	_index.Erase({ e->Hash, e->Name, e->Length });
+
+	auto slot = LONG(atom - 1);
+	_entries[slot] = (Entry*)(((LONG_PTR)_freeSlot << 1) | 1);
+	_freeSlot = slot;
+	--_size;
+	Policy::Free(e, bytes(e->Length));
+}
+
+
+template <typename Policy>
+void BasicAtomTable<Policy>::Free()
+{
+	{
+		AutoLock lock(_mutex);
+		_entries.for_each([](Entry*& e)
+			{
+				if (!((ULONG_PTR)e & 1))
+					Policy::Free(e, bytes(e->Length));
+			});
+
+		if (_size)
+			DbgMsg("(AtomTable::Free) -> %u names freed\n", _size);
+	}
+
+	_entries.free();
+	_index.Free();
+	_freeSlot = -1;
+	_size = 0;
+}
+
+
+// FNV-1a over the lower case characters, so the case doesn't change the hash
+template <typename Policy>
+ULONG64 BasicAtomTable<Policy>::hash(const CHAR* name, size_t len)
+{
+	ULONG64 h{ 0xcbf29ce484222325 };
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (UCHAR)AsciiLower(name[i])) * 0x100000001b3;
+	return h;
+}
+
+
+template <typename Policy>
+typename BasicAtomTable<Policy>::Entry* BasicAtomTable<Policy>::entry(Atom atom) const
+{
+	ASSERT(atom && int(atom) <= _entries.size());
+	auto e = _entries[int(atom - 1)];
+	ASSERT(!((ULONG_PTR)e & 1));
+	return e;
+}
@@ -18,4 +18,42 @@ public:
 
 private:
 	TLock& _lock;
-};
\ No newline at end of file
+};
+
+
+// Same as AutoLock, for when it should be obvious a reader-writer lock is
+// taken exclusively
+template <typename TLock>
+class ExclusiveLock
+{
+public:
+	ExclusiveLock(TLock& lock) : _lock{ lock }
+	{
+		_lock.Lock();
+	}
+	~ExclusiveLock()
+	{
+		_lock.Unlock();
+	}
+
+private:
+	TLock& _lock;
+};
+
+
+template <typename TLock>
+class SharedLock
+{
+public:
+	SharedLock(TLock& lock) : _lock{ lock }
+	{
+		_lock.LockShared();
+	}
+	~SharedLock()
+	{
+		_lock.UnlockShared();
+	}
+
+private:
+	TLock& _lock;
+};
@@ -0,0 +1,421 @@
+#pragma once
+#include <ntddk.h>
+#include "New.h"
+#include "PoolPolicy.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Open addressing hash map with Robin Hood probing.
+
+	Every slot remembers how far it is from its home slot (1 = at home, 0 = empty).
+	Insert lets the new key take the slot of any entry that is closer to home than
+	it is, so probe lengths stay short and even, and a lookup can stop as soon as
+	it meets an entry closer to home than the key would be. Erase pulls the rest
+	of the run back one slot (backward shift), so there are no tombstones and
+	lookups don't get slower after lots of erases.
+
+	Hash and Eq are pluggable, Hasher/EqualTo below handle integers, pointers and
+	C strings (by content, the map keeps the pointer, not a copy). The hash is
+	spread once more with the Fibonacci multiply, so a weak hash is fine as long
+	as it's different for different keys. Keys whose hashes are equal pile up in
+	one run, past _maxDist of them Insert gives up and returns nullptr.
+
+	The table is one allocation from Policy (NonPagedPolicy by default, a map that
+	only lives at PASSIVE_LEVEL can use PagedPolicy), Tag comes from Init. It
+	doubles at 3/4 load. Insert returns nullptr when Policy can't grow it, the
+	map is left as it was. Not synchronized.
+*/
+
+template <typename K>
+struct Hasher
+{
+	ULONG64 operator()(const K& key) const { return (ULONG64)key; }
+};
+
+// FNV-1a over the characters
+template <>
+struct Hasher<const char*>
+{
+	ULONG64 operator()(const char* key) const
+	{
+		ULONG64 h{ 0xcbf29ce484222325 };
+		while (*key)
+			h = (h ^ (UCHAR)*key++) * 0x100000001b3;
+		return h;
+	}
+};
+
+template <>
+struct Hasher<const WCHAR*>
+{
+	ULONG64 operator()(const WCHAR* key) const
+	{
+		ULONG64 h{ 0xcbf29ce484222325 };
+		while (*key)
+			h = (h ^ (USHORT)*key++) * 0x100000001b3;
+		return h;
+	}
+};
+
+
+template <typename K>
+struct EqualTo
+{
+	bool operator()(const K& a, const K& b) const { return a == b; }
+};
+
+template <>
+struct EqualTo<const char*>
+{
+	bool operator()(const char* a, const char* b) const { return strcmp(a, b) == 0; }
+};
+
+template <>
+struct EqualTo<const WCHAR*>
+{
+	bool operator()(const WCHAR* a, const WCHAR* b) const { return wcscmp(a, b) == 0; }
+};
+
+
+
+template <typename K, typename V, typename Hash = Hasher<K>, typename Eq = EqualTo<K>, typename Policy = NonPagedPolicy>
+class HashMap
+{
+public:
+	bool Init(ULONG Capacity = _minCapacity, ULONG Tag = 'paMH');
+
+	V* Find(const K& key);
+	bool Contains(const K& key) { return Find(key) != nullptr; }
+	// Inserts the key or overwrites its value, nullptr when out of memory
+	V* Insert(const K& key, const V& value);
+	bool Erase(const K& key);
+
+	// Calls f(const K&, V&) for every entry, in no particular order
+	template <typename F>
+	void ForEach(F&& f);
+
+	constexpr ULONG Size() const { return _size; }
+	constexpr ULONG Capacity() const { return _capacity; }
+
+	void Clear();
+	void Free();
+
+private:
+	struct Entry
+	{
+		K Key;
+		V Value;
+	};
+
+	static constexpr ULONG _minCapacity{ 16 };
+	// Farthest an entry may sit from home, distances are kept in a byte
+	static constexpr ULONG _maxDist{ 255 };
+	static constexpr bool _trivial{ __is_trivially_copyable(Entry) };
+
+	static_assert(alignof(Entry) <= MEMORY_ALLOCATION_ALIGNMENT, "HashMap only supports keys and values aligned up to MEMORY_ALLOCATION_ALIGNMENT");
+
+	static size_t bytes(ULONG capacity) { return capacity * (sizeof(Entry) + 1); }
+	static ULONG home(const K& key, int shift) { return ULONG((Hash{}(key) * 0x9E3779B97F4A7C15) >> shift); }
+
+	bool probe(const K& key, ULONG& slot, ULONG& dist) const;
+	static bool room(const UCHAR* dist, ULONG mask, ULONG slot, ULONG d, ULONG& empty);
+	static void shiftUp(Entry* entries, UCHAR* dist, ULONG mask, ULONG slot, ULONG empty);
+	static void move(Entry* dst, Entry* src);
+	bool Rehash(ULONG capacity);
+
+private:
+	Entry* _entries{ nullptr };
+	// Distance from home + 1 per slot, 0 is empty. Right behind _entries
+	UCHAR* _dist{ nullptr };
+	ULONG _capacity{ 0 };
+	ULONG _size{ 0 };
+	int _shift{ 64 };
+	ULONG _tag{ 'paMH' };
+};
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+bool HashMap<K, V, Hash, Eq, Policy>::Init(ULONG Capacity, ULONG Tag)
+{
+	_tag = Tag;
+
+	// Room for Capacity keys below the 3/4 load limit
+	ULONG capacity{ _minCapacity };
+	while (capacity / 4 * 3 < Capacity)
+		capacity *= 2;
+
+	return capacity <= _capacity || Rehash(capacity);
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+V* HashMap<K, V, Hash, Eq, Policy>::Find(const K& key)
+{
+	ULONG slot, d;
+	return _size && probe(key, slot, d) ? &_entries[slot].Value : nullptr;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+V* HashMap<K, V, Hash, Eq, Policy>::Insert(const K& key, const V& value)
+{
+	if (!_entries && !Rehash(_minCapacity))
+		return nullptr;
+
+	// One doubling is enough for the load, if the run is still too long after it
+	// the keys collide for real
+	for (auto grown = false;; grown = true)
+	{
+		ULONG slot, d, empty;
+		if (probe(key, slot, d))
+		{
+			_entries[slot].Value = value;
+			return &_entries[slot].Value;
+		}
+
+		if ((_size + 1) * 4 <= _capacity * 3 && room(_dist, _capacity - 1, slot, d, empty))
+		{
+			shiftUp(_entries, _dist, _capacity - 1, slot, empty);
+			new (&_entries[slot]) Entry{ key, value };
+			_dist[slot] = UCHAR(d);
+			++_size;
+			return &_entries[slot].Value;
+		}
+
+		if (grown)
+			DbgMsg("(HashMap::Insert) -> probe run too long, key not inserted\n");
+		if (grown || !Rehash(_capacity * 2))
+			return nullptr;
+	}
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+bool HashMap<K, V, Hash, Eq, Policy>::Erase(const K& key)
+{
+	ULONG slot, d;
+	if (!_size || !probe(key, slot, d))
+		return false;
+
+	if constexpr (!__is_trivially_destructible(Entry))
+		_entries[slot].~Entry();
+
+	// Pull the rest of the run one slot closer to home
+	auto mask = _capacity - 1;
+	auto next = (slot + 1) & mask;
+	while (_dist[next] > 1)
+	{
+		move(&_entries[slot], &_entries[next]);
+		_dist[slot] = _dist[next] - 1;
+		slot = next;
+		next = (next + 1) & mask;
+	}
+	_dist[slot] = 0;
+	--_size;
+	return true;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+template <typename F>
+void HashMap<K, V, Hash, Eq, Policy>::ForEach(F&& f)
+{
+	for (ULONG i = 0; i < _capacity; ++i)
+	{
+		if (_dist[i])
+			f(static_cast<const K&>(_entries[i].Key), _entries[i].Value);
+	}
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+void HashMap<K, V, Hash, Eq, Policy>::Clear()
+{
+	if constexpr (!__is_trivially_destructible(Entry))
+	{
+		for (ULONG i = 0; i < _capacity; ++i)
+		{
+			if (_dist[i])
+				_entries[i].~Entry();
+		}
+	}
+
+	if (_dist)
+		RtlZeroMemory(_dist, _capacity);
+	_size = 0;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+void HashMap<K, V, Hash, Eq, Policy>::Free()
+{
+	Clear();
+	if (_entries)
+	{
+		Policy::Free(_entries, bytes(_capacity));
+		DbgMsg("(HashMap::Free) -> Policy::Free(%u slots) called\n", _capacity);
+	}
+
+	_entries = nullptr;
+	_dist = nullptr;
+	_capacity = 0;
+	_shift = 64;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+bool HashMap<K, V, Hash, Eq, Policy>::probe(const K& key, ULONG& slot, ULONG& d) const
+{
+	slot = home(key, _shift);
+	d = 1;
+
+	// An entry closer to home than we'd be means the key isn't in the table,
+	// slot/d is then where it would go
+	while (_dist[slot] >= d)
+	{
+		if (_dist[slot] == d && Eq{}(_entries[slot].Key, key))
+			return true;
+
+		slot = (slot + 1) & (_capacity - 1);
+		++d;
+	}
+	return false;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+bool HashMap<K, V, Hash, Eq, Policy>::room(const UCHAR* dist, ULONG mask, ULONG slot, ULONG d, ULONG& empty)
+{
+	if (d > _maxDist)
+		return false;
+
+	// Everything up to the next empty slot moves one further from home
+	empty = slot;
+	while (dist[empty])
+	{
+		if (dist[empty] == _maxDist)
+			return false;
+		empty = (empty + 1) & mask;
+	}
+	return true;
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+void HashMap<K, V, Hash, Eq, Policy>::shiftUp(Entry* entries, UCHAR* dist, ULONG mask, ULONG slot, ULONG empty)
+{
+	while (empty != slot)
+	{
+		auto prev = (empty - 1) & mask;
+		if (entries)
+			move(&entries[empty], &entries[prev]);
+		dist[empty] = dist[prev] + 1;
+		empty = prev;
+	}
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+void HashMap<K, V, Hash, Eq, Policy>::move(Entry* dst, Entry* src)
+{
+	if constexpr (_trivial)
+		RtlCopyMemory(dst, src, sizeof(Entry));
+	else
+	{
+		new (dst) Entry(static_cast<Entry&&>(*src));
+		src->~Entry();
+	}
+}
+
+
+template <typename K, typename V, typename Hash, typename Eq, typename Policy>
+bool HashMap<K, V, Hash, Eq, Policy>::Rehash(ULONG capacity)
+{
+	Entry* entries{ nullptr };
+	UCHAR* dist{ nullptr };
+	int shift{ 64 };
+
+	// Try the layout on the distances first, a bad hash can pile up more than
+	// _maxDist keys in one run. A bigger table only helps if the hashes differ,
+	// so give up after two extra doublings
+	for (auto limit = capacity * 4;; capacity *= 2)
+	{
+		if (capacity > limit || capacity > 0x40000000)
+		{
+			DbgMsg("(HashMap::Rehash) -> too many colliding keys\n");
+			return false;
+		}
+
+		ULONG bits{ 0 };
+		_BitScanReverse(&bits, capacity);
+		shift = 64 - int(bits);
+
+		// Memory is zero initialized, so every slot starts empty
+		entries = (Entry*)Policy::Allocate(bytes(capacity), _tag);
+		if (!entries)
+		{
+			DbgMsg("(HashMap::Rehash) -> failed allocation of %u slots\n", capacity);
+			return false;
+		}
+		dist = (UCHAR*)(entries + capacity);
+
+		auto fits = true;
+		for (ULONG i = 0; i < _capacity && fits; ++i)
+		{
+			if (!_dist[i])
+				continue;
+
+			ULONG slot{ home(_entries[i].Key, shift) }, d{ 1 }, empty;
+			while (dist[slot] >= d)
+			{
+				slot = (slot + 1) & (capacity - 1);
+				++d;
+			}
+
+			fits = room(dist, capacity - 1, slot, d, empty);
+			if (fits)
+			{
+				shiftUp(nullptr, dist, capacity - 1, slot, empty);
+				dist[slot] = UCHAR(d);
+			}
+		}
+
+		if (fits)
+			break;
+		Policy::Free(entries, bytes(capacity));
+	}
+
+	// Same order as the dry run, so the same slots
+	RtlZeroMemory(dist, capacity);
+	for (ULONG i = 0; i < _capacity; ++i)
+	{
+		if (!_dist[i])
+			continue;
+
+		ULONG slot{ home(_entries[i].Key, shift) }, d{ 1 }, empty;
+		while (dist[slot] >= d)
+		{
+			slot = (slot + 1) & (capacity - 1);
+			++d;
+		}
+
+		room(dist, capacity - 1, slot, d, empty);
+		shiftUp(entries, dist, capacity - 1, slot, empty);
+		move(&entries[slot], &_entries[i]);
+		dist[slot] = UCHAR(d);
+	}
+
+	if (_entries)
+		Policy::Free(_entries, bytes(_capacity));
+
+	_entries = entries;
+	_dist = dist;
+	_capacity = capacity;
+	_shift = shift;
+	return true;
+}
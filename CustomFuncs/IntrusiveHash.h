@@ -0,0 +1,240 @@
+#pragma once
+#include "HashMap.h"
+#include "IntrusiveList.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Chained hash index over a LIST_ENTRY that lives inside T.
+
+	Key is either a data member pointer or a function taking const T&, the key
+	type is whatever that gives back. Don't key on a CHAR array member directly,
+	it decays and gets hashed as a C string, which runs off the end of a full
+	CHAR Name[15]. Go through a function returning a bounded StringView instead.
+	Give an object one hook per index and it can be found by several keys, with
+	no node allocated for any of them:
+
+		struct Proc
+		{
+			LIST_ENTRY PidHook;
+			LIST_ENTRY NameHook;
+			ULONG Pid;
+			CHAR Name[15];
+		};
+		StringView NameOf(const Proc& proc) { return StringView::bounded(proc.Name, sizeof(proc.Name)); }
+
+		IntrusiveHash<Proc, &Proc::PidHook, &Proc::Pid> byPid;
+		IntrusiveHash<Proc, &Proc::NameHook, NameOf> byName;
+
+	Only the bucket heads are allocated (from Policy, Tag from Init). The
+	bucket count doubles when there are more items than buckets, relinking the
+	items as it goes. If that allocation fails the index keeps working with
+	longer chains. Remove is O(1), the key of an indexed object must not change.
+	Duplicate keys are allowed, Find returns one of them. Not synchronized.
+*/
+
+template <typename T, auto Key>
+auto IntrusiveKeyOf(const T* item)
+{
+	if constexpr (requires { item->*Key; })
+		return item->*Key;
+	else
+		return Key(*item);
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key,
+	typename Hash = Hasher<decltype(IntrusiveKeyOf<T, Key>(nullptr))>,
+	typename Eq = EqualTo<decltype(IntrusiveKeyOf<T, Key>(nullptr))>,
+	typename Policy = NonPagedPolicy>
+class IntrusiveHash
+{
+public:
+	using KeyType = decltype(IntrusiveKeyOf<T, Key>(nullptr));
+
+	bool Init(ULONG Buckets = _minBuckets, ULONG Tag = 'hsHI');
+
+	// Only fails if there are no buckets and Init can't allocate them
+	bool Insert(T* item);
+	// The item has to be in this index
+	void Remove(T* item);
+	T* Find(const KeyType& key);
+
+	// Calls f(T*) for every item with this key, f may Remove the item it was given
+	template <typename F>
+	void ForEachMatch(const KeyType& key, F&& f);
+	template <typename F>
+	void ForEach(F&& f);
+
+	ULONG Size() const { return _size; }
+
+	// Unlinks every item and gives the buckets back, the items themselves stay
+	void Free();
+
+private:
+	static constexpr ULONG _minBuckets{ 16 };
+
+	static T* From(LIST_ENTRY* entry) { return IntrusiveList<T, Hook>::From(entry); }
+	static KeyType key(const T* item) { return IntrusiveKeyOf<T, Key>(item); }
+	static LIST_ENTRY* bucket(LIST_ENTRY* buckets, int shift, const KeyType& key)
+	{
+		return &buckets[(Hash{}(key) * 0x9E3779B97F4A7C15) >> shift];
+	}
+
+	bool Rehash(ULONG count);
+
+private:
+	LIST_ENTRY* _buckets{ nullptr };
+	ULONG _count{ 0 };
+	ULONG _size{ 0 };
+	int _shift{ 64 };
+	ULONG _tag{ 'hsHI' };
+};
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+bool IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Init(ULONG Buckets, ULONG Tag)
+{
+	_tag = Tag;
+
+	ULONG count{ _minBuckets };
+	while (count < Buckets)
+		count *= 2;
+
+	return count <= _count || Rehash(count);
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+bool IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Insert(T* item)
+{
+	if (!_buckets && !Rehash(_minBuckets))
+		return false;
+
+	InsertHeadList(bucket(_buckets, _shift, key(item)), &(item->*Hook));
+	if (++_size > _count)
+		Rehash(_count * 2);
+	return true;
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+void IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Remove(T* item)
+{
+	auto entry = &(item->*Hook);
+	RemoveEntryList(entry);
+	InitializeListHead(entry);
+	--_size;
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+T* IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Find(const KeyType& key)
+{
+	if (!_size)
+		return nullptr;
+
+	auto head = bucket(_buckets, _shift, key);
+	for (auto entry = head->Flink; entry != head; entry = entry->Flink)
+	{
+		auto item = From(entry);
+		if (Eq{}(this->key(item), key))
+			return item;
+	}
+	return nullptr;
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+template <typename F>
+void IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::ForEachMatch(const KeyType& key, F&& f)
+{
+	if (!_size)
+		return;
+
+	auto head = bucket(_buckets, _shift, key);
+	for (auto entry = head->Flink; entry != head;)
+	{
+		auto next = entry->Flink;
+		auto item = From(entry);
+		if (Eq{}(this->key(item), key))
+			f(item);
+		entry = next;
+	}
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+template <typename F>
+void IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::ForEach(F&& f)
+{
+	for (ULONG i = 0; i < _count; ++i)
+	{
+		auto head = &_buckets[i];
+		for (auto entry = head->Flink; entry != head;)
+		{
+			auto next = entry->Flink;
+			f(From(entry));
+			entry = next;
+		}
+	}
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+void IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Free()
+{
+	ForEach([this](T* item) { Remove(item); });
+
+	if (_buckets)
+	{
+		Policy::Free(_buckets, _count * sizeof(LIST_ENTRY));
+		DbgMsg("(IntrusiveHash::Free) -> Policy::Free(%u buckets) called\n", _count);
+	}
+
+	_buckets = nullptr;
+	_count = 0;
+	_size = 0;
+	_shift = 64;
+}
+
+
+template <typename T, LIST_ENTRY T::*Hook, auto Key, typename Hash, typename Eq, typename Policy>
+bool IntrusiveHash<T, Hook, Key, Hash, Eq, Policy>::Rehash(ULONG count)
+{
+	auto buckets = (LIST_ENTRY*)Policy::Allocate(count * sizeof(LIST_ENTRY), _tag);
+	if (!buckets)
+	{
+		DbgMsg("(IntrusiveHash::Rehash) -> failed allocation of %u buckets\n", count);
+		return false;
+	}
+
+	ULONG bits{ 0 };
+	_BitScanReverse(&bits, count);
+	auto shift = 64 - int(bits);
+
+	for (ULONG i = 0; i < count; ++i)
+		InitializeListHead(&buckets[i]);
+
+	// Relink, the items don't move
+	for (ULONG i = 0; i < _count; ++i)
+	{
+		while (!IsListEmpty(&_buckets[i]))
+		{
+			auto entry = RemoveHeadList(&_buckets[i]);
+			InsertHeadList(bucket(buckets, shift, key(From(entry))), entry);
+		}
+	}
+
+	if (_buckets)
+		Policy::Free(_buckets, _count * sizeof(LIST_ENTRY));
+
+	_buckets = buckets;
+	_count = count;
+	_shift = shift;
+	return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <ntddk.h>
+
+
+
+/*
+	Doubly linked list over a LIST_ENTRY that lives inside T.
+
+	Nothing is allocated, the list only links objects through their Hook member,
+	so an object can be in as many lists at the same time as it has hooks:
+
+		struct Proc
+		{
+			LIST_ENTRY QueueHook;
+			LIST_ENTRY PidHook;
+			ULONG Pid;
+		};
+		IntrusiveList<Proc, &Proc::QueueHook> queue;
+
+	The CONTAINING_RECORD arithmetic is done once in here, callers only see T*.
+	Remove unlinks in O(1) from anywhere in the list. The list doesn't own its
+	objects and doesn't synchronize, an object must be removed before it's freed.
+
+	There is no constructor so a list can be a global, call Init before use.
+*/
+
+template <typename T, LIST_ENTRY T::*Hook>
+class IntrusiveList
+{
+public:
+	void Init() { InitializeListHead(&_head); _size = 0; }
+
+	bool Empty() const { return _size == 0; }
+	ULONG Size() const { return _size; }
+
+	T* Front() { return Empty() ? nullptr : From(_head.Flink); }
+	T* Back() { return Empty() ? nullptr : From(_head.Blink); }
+
+	void PushBack(T* item) { InsertTailList(&_head, &(item->*Hook)); ++_size; }
+	void PushFront(T* item) { InsertHeadList(&_head, &(item->*Hook)); ++_size; }
+	T* PopFront() { return Empty() ? nullptr : Unlink(From(_head.Flink)); }
+	T* PopBack() { return Empty() ? nullptr : Unlink(From(_head.Blink)); }
+
+	// The item has to be in this list
+	void Remove(T* item) { Unlink(item); }
+
+	// Calls f(T*) front to back, f may Remove the item it was given
+	template <typename F>
+	void ForEach(F&& f);
+
+	static T* From(LIST_ENTRY* entry) { return (T*)((UCHAR*)entry - offset()); }
+
+private:
+	static ULONG_PTR offset() { return (ULONG_PTR)&(((T*)nullptr)->*Hook); }
+
+	T* Unlink(T* item)
+	{
+		auto entry = &(item->*Hook);
+		RemoveEntryList(entry);
+		// Don't leave the hook pointing into the list
+		InitializeListHead(entry);
+		--_size;
+		return item;
+	}
+
+private:
+	LIST_ENTRY _head;
+	ULONG _size;
+};
+
+
+template <typename T, LIST_ENTRY T::*Hook>
+template <typename F>
+void IntrusiveList<T, Hook>::ForEach(F&& f)
+{
+	for (auto entry = _head.Flink; entry != &_head;)
+	{
+		auto next = entry->Flink;
+		f(From(entry));
+		entry = next;
+	}
+}
@@ -0,0 +1,269 @@
+#pragma once
+#include "Slab.h"
+
+
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Per-CPU magazine caches in front of the slabs.
+
+	Every processor keeps two magazines (a loaded and a previous one) of recently
+	freed blocks per slab and size class. Alloc pops from the loaded magazine and Free
+	pushes to it, only when both magazines are empty (Alloc) or full (Free) does the
+	CPU go to the shared depot and swap a whole magazine under the depot spin lock.
+	So the depot lock is taken at most once every _rounds operations, and the slab
+	lock (the FastMutex in _ALLOC_) is only needed when the depot runs dry.
+
+	The CPU is pinned by raising to DISPATCH_LEVEL while its magazines are touched,
+	magazines only hold the block addresses so paged blocks are never dereferenced
+	at that IRQL. When the depot holds more than _depotLimit full magazines the caller
+	drains the surplus back to the slab with Trim.
+*/
+
+class Magazines
+{
+public:
+	static constexpr int _rounds{ 30 };
+	static constexpr int _depotLimit{ 8 };
+	static constexpr int _kinds{ 2 };
+
+	bool Init();
+	PVOID Alloc(int kind, int cls);
+	bool Free(int kind, int cls, PVOID p);
+
+	bool Overfull(int kind, int cls) const { return _depots[kind][cls].FullCount > _depotLimit; }
+	template <typename TReturn>
+	void Trim(int kind, int cls, TReturn&& Return);
+
+	// Drops every magazine, the blocks in them go away with their slab pages
+	void FreeAll();
+
+private:
+	struct Magazine
+	{
+		Magazine* Next;
+		LONG Rounds;
+		PVOID Round[_rounds];
+	};
+
+	struct DECLSPEC_CACHEALIGN Cpu
+	{
+		Magazine* Loaded[_kinds][Slab::_classCount];
+		Magazine* Previous[_kinds][Slab::_classCount];
+	};
+
+	struct DECLSPEC_CACHEALIGN Depot
+	{
+		KSPIN_LOCK Lock;
+		Magazine* Full;
+		Magazine* Empty;
+		LONG FullCount;
+		LONG EmptyCount;
+	};
+
+	static void Swap(Magazine*& a, Magazine*& b) { auto tmp = a; a = b; b = tmp; }
+	static void Push(Magazine*& head, LONG& count, Magazine* mag) { mag->Next = head; head = mag; ++count; }
+	static Magazine* Pop(Magazine*& head, LONG& count);
+
+private:
+	Cpu* _cpus{ nullptr };
+	ULONG _cpuCount{ 0 };
+	Depot _depots[_kinds][Slab::_classCount]{};
+};
+
+
+
+inline bool Magazines::Init()
+{
+	if (_cpus)
+		return true;
+
+	for (auto& kind : _depots)
+	{
+		for (auto& depot : kind)
+			KeInitializeSpinLock(&depot.Lock);
+	}
+
+	_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	_cpus = (Cpu*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, _cpuCount * sizeof(Cpu), 'gaMS');
+	if (!_cpus)
+	{
+		DbgMsg("(Magazines::Init) -> failed allocation, every block goes through the slab\n");
+		_cpuCount = 0;
+		return false;
+	}
+
+	DbgMsg("(Magazines::Init) -> %u processors\n", _cpuCount);
+	return true;
+}
+
+
+inline PVOID Magazines::Alloc(int kind, int cls)
+{
+	if (!_cpus)
+		return nullptr;
+
+	PVOID p{ nullptr };
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	{
+		auto& cpu = _cpus[KeGetCurrentProcessorNumberEx(nullptr)];
+		auto& loaded = cpu.Loaded[kind][cls];
+		auto& previous = cpu.Previous[kind][cls];
+
+		if (!loaded || loaded->Rounds == 0)
+		{
+			if (previous && previous->Rounds > 0)
+				Swap(loaded, previous);
+			else
+			{
+				auto& depot = _depots[kind][cls];
+				KeAcquireSpinLockAtDpcLevel(&depot.Lock);
+				if (auto full = Pop(depot.Full, depot.FullCount))
+				{
+					if (previous)
+						Push(depot.Empty, depot.EmptyCount, previous);
+					previous = loaded;
+					loaded = full;
+				}
+				KeReleaseSpinLockFromDpcLevel(&depot.Lock);
+			}
+		}
+
+		if (loaded && loaded->Rounds > 0)
+			p = loaded->Round[--loaded->Rounds];
+	}
+	KeLowerIrql(irql);
+
+	return p;
+}
+
+
+inline bool Magazines::Free(int kind, int cls, PVOID p)
+{
+	if (!_cpus)
+		return false;
+
+	auto cached = false;
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	{
+		auto& cpu = _cpus[KeGetCurrentProcessorNumberEx(nullptr)];
+		auto& loaded = cpu.Loaded[kind][cls];
+		auto& previous = cpu.Previous[kind][cls];
+
+		if (!loaded || loaded->Rounds == _rounds)
+		{
+			if (previous && previous->Rounds < _rounds)
+				Swap(loaded, previous);
+			else
+			{
+				auto& depot = _depots[kind][cls];
+				KeAcquireSpinLockAtDpcLevel(&depot.Lock);
+				auto empty = Pop(depot.Empty, depot.EmptyCount);
+				if (previous)
+					Push(depot.Full, depot.FullCount, previous);
+				KeReleaseSpinLockFromDpcLevel(&depot.Lock);
+
+				// Non-paged, so fine at DISPATCH_LEVEL
+				if (!empty)
+					empty = (Magazine*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(Magazine), 'gaMS');
+
+				previous = loaded;
+				loaded = empty;
+			}
+		}
+
+		if (loaded && loaded->Rounds < _rounds)
+		{
+			loaded->Round[loaded->Rounds++] = p;
+			cached = true;
+		}
+	}
+	KeLowerIrql(irql);
+
+	return cached;
+}
+
+
+template <typename TReturn>
+void Magazines::Trim(int kind, int cls, TReturn&& Return)
+{
+	auto& depot = _depots[kind][cls];
+	Magazine* surplus{ nullptr };
+	LONG count{ 0 };
+
+	// Trim down to half the limit so a CPU sitting on the edge doesn't trim every time
+	KIRQL irql;
+	KeAcquireSpinLock(&depot.Lock, &irql);
+	while (depot.FullCount > _depotLimit / 2)
+		Push(surplus, count, Pop(depot.Full, depot.FullCount));
+	KeReleaseSpinLock(&depot.Lock, irql);
+
+	while (auto mag = Pop(surplus, count))
+	{
+		while (mag->Rounds > 0)
+			Return(mag->Round[--mag->Rounds]);
+		ExFreePool(mag);
+	}
+}
+
+
+inline void Magazines::FreeAll()
+{
+	auto release = [](Magazine*& head)
+	{
+		LONG count{ 0 };
+		while (auto mag = Pop(head, count))
+			ExFreePool(mag);
+	};
+
+	for (auto& kind : _depots)
+	{
+		for (auto& depot : kind)
+		{
+			release(depot.Full);
+			release(depot.Empty);
+			depot.FullCount = depot.EmptyCount = 0;
+		}
+	}
+
+	if (_cpus)
+	{
+		for (ULONG i = 0; i < _cpuCount; ++i)
+		{
+			for (int kind = 0; kind < _kinds; ++kind)
+			{
+				for (int cls = 0; cls < Slab::_classCount; ++cls)
+				{
+					if (_cpus[i].Loaded[kind][cls])
+						ExFreePool(_cpus[i].Loaded[kind][cls]);
+					if (_cpus[i].Previous[kind][cls])
+						ExFreePool(_cpus[i].Previous[kind][cls]);
+				}
+			}
+		}
+
+		ExFreePool(_cpus);
+		_cpus = nullptr;
+		_cpuCount = 0;
+	}
+}
+
+
+inline Magazines::Magazine* Magazines::Pop(Magazine*& head, LONG& count)
+{
+	auto mag = head;
+	if (mag)
+	{
+		head = mag->Next;
+		mag->Next = nullptr;
+		--count;
+	}
+	return mag;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+
+
+// Placement new/delete for constructing objects in memory we allocated our self.
+// Guarded the same way vcruntime_new.h is, so it doesn't clash if <new> is around.
+#ifndef __PLACEMENT_NEW_INLINE
+#define __PLACEMENT_NEW_INLINE
+inline void* operator new(size_t, void* where) noexcept { return where; }
+inline void operator delete(void*, void*) noexcept {}
+#endif // !__PLACEMENT_NEW_INLINE
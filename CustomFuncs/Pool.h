@@ -0,0 +1,210 @@
+#pragma once
+#include "New.h"
+#include "PoolPolicy.h"
+
+
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Typed object pool for fixed-size structs (ProcessInfo, FullItem<...> etc.).
+
+	Objects live in chunks allocated up front, free slots sit on an interlocked
+	SLIST, so Acquire and Release are lock-free and never touch the pool manager
+	as long as the prewarmed slots last. When the list runs dry another chunk of
+	_growBy slots is allocated from Policy, chunks are only given back by Free.
+
+	Acquire constructs T in place with the given arguments, Release runs ~T and
+	puts the slot back. Make returns a PoolPtr that releases the object when it
+	goes out of scope.
+
+		Pool<ProcessInfo> pool;
+		pool.Init(256);
+		auto info = pool.Make();
+		...
+		pool.Free();	// after every object was released
+
+	With NonPagedPolicy (default) Acquire/Release work up to DISPATCH_LEVEL, with
+	PagedPolicy up to APC_LEVEL.
+*/
+
+template <typename T, typename Policy = NonPagedPolicy>
+class PoolPtr;
+
+
+template <typename T, typename Policy = NonPagedPolicy>
+class Pool
+{
+public:
+	bool Init(ULONG Prewarm = 64, ULONG Tag = 'loPT');
+
+	template <typename... Args>
+	T* Acquire(Args&&... args);
+	void Release(T* p);
+
+	template <typename... Args>
+	PoolPtr<T, Policy> Make(Args&&... args) { return PoolPtr<T, Policy>(*this, Acquire(static_cast<Args&&>(args)...)); }
+
+	// Gives every chunk back, all objects must have been released
+	void Free();
+
+private:
+	struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) Node
+	{
+		union
+		{
+			SLIST_ENTRY Entry;
+			UCHAR Storage[sizeof(T)];
+		};
+	};
+
+	struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) Chunk
+	{
+		SLIST_ENTRY Entry;
+		ULONG Count;
+	};
+
+	static_assert(alignof(T) <= MEMORY_ALLOCATION_ALIGNMENT, "Pool<T> only supports T aligned up to MEMORY_ALLOCATION_ALIGNMENT");
+
+	static size_t bytes(ULONG count) { return sizeof(Chunk) + count * sizeof(Node); }
+	bool Grow(ULONG count);
+
+private:
+	SLIST_HEADER _free;
+	SLIST_HEADER _chunks;
+	ULONG _tag{ 'loPT' };
+	ULONG _growBy{ 64 };
+	bool _initialized{ false };
+};
+
+
+template <typename T, typename Policy>
+class PoolPtr
+{
+public:
+	PoolPtr() = default;
+	PoolPtr(Pool<T, Policy>& pool, T* p) : _pool{ &pool }, _ptr{ p } {}
+	PoolPtr(PoolPtr&& rhs) noexcept : _pool{ rhs._pool }, _ptr{ rhs.release() } {}
+	~PoolPtr() { reset(); }
+
+	PoolPtr(const PoolPtr&) = delete;
+	PoolPtr& operator=(const PoolPtr&) = delete;
+	PoolPtr& operator=(PoolPtr&& rhs) noexcept
+	{
+		if (this != &rhs)
+		{
+			reset();
+			_pool = rhs._pool;
+			_ptr = rhs.release();
+		}
+		return *this;
+	}
+
+	operator bool() const { return _ptr != nullptr; }
+	T* operator->() const { return _ptr; }
+	T& operator*() const { return *_ptr; }
+	T* get() const { return _ptr; }
+
+	// Gives up ownership, the caller has to Release it
+	T* release() { auto p = _ptr; _ptr = nullptr; return p; }
+	void reset() { if (_ptr) _pool->Release(_ptr); _ptr = nullptr; }
+
+private:
+	Pool<T, Policy>* _pool{ nullptr };
+	T* _ptr{ nullptr };
+};
+
+
+
+template <typename T, typename Policy>
+bool Pool<T, Policy>::Init(ULONG Prewarm, ULONG Tag)
+{
+	if (!_initialized)
+	{
+		InitializeSListHead(&_free);
+		InitializeSListHead(&_chunks);
+		_tag = Tag;
+		_initialized = true;
+	}
+
+	if (Prewarm > _growBy)
+		_growBy = Prewarm;
+
+	return Prewarm == 0 || Grow(Prewarm);
+}
+
+
+template <typename T, typename Policy>
+template <typename... Args>
+T* Pool<T, Policy>::Acquire(Args&&... args)
+{
+	ASSERT(_initialized);
+
+	auto entry = InterlockedPopEntrySList(&_free);
+	if (!entry && Grow(_growBy))
+		entry = InterlockedPopEntrySList(&_free);
+
+	if (!entry)
+	{
+		DbgMsg("(Pool<T, Policy>::Acquire) -> out of memory\n");
+		return nullptr;
+	}
+
+	auto node = CONTAINING_RECORD(entry, Node, Entry);
+	return new (node->Storage) T(static_cast<Args&&>(args)...);
+}
+
+
+template <typename T, typename Policy>
+void Pool<T, Policy>::Release(T* p)
+{
+	if (!p)
+		return;
+
+	p->~T();
+	auto node = (Node*)p;
+	InterlockedPushEntrySList(&_free, &node->Entry);
+}
+
+
+template <typename T, typename Policy>
+void Pool<T, Policy>::Free()
+{
+	if (!_initialized)
+		return;
+
+	InterlockedFlushSList(&_free);
+
+	auto entry = InterlockedFlushSList(&_chunks);
+	while (entry)
+	{
+		auto chunk = CONTAINING_RECORD(entry, Chunk, Entry);
+		entry = entry->Next;
+		DbgMsg("(Pool<T, Policy>::Free) -> Policy::Free(%p) called, %u objects\n", chunk, chunk->Count);
+		Policy::Free(chunk, bytes(chunk->Count));
+	}
+}
+
+
+template <typename T, typename Policy>
+bool Pool<T, Policy>::Grow(ULONG count)
+{
+	auto chunk = (Chunk*)Policy::Allocate(bytes(count), _tag);
+	if (!chunk)
+	{
+		DbgMsg("(Pool<T, Policy>::Grow) -> failed allocation of %u objects\n", count);
+		return false;
+	}
+
+	chunk->Count = count;
+	auto nodes = (Node*)(chunk + 1);
+	for (ULONG i = 0; i < count; ++i)
+		InterlockedPushEntrySList(&_free, &nodes[i].Entry);
+
+	InterlockedPushEntrySList(&_chunks, &chunk->Entry);
+	return true;
+}
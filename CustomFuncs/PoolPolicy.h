@@ -0,0 +1,162 @@
+#pragma once
+#include <ntddk.h>
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Where a container's memory comes from, picked at compile time.
+
+		vector<ULONG, PagedPolicy> pids;					// only touched at PASSIVE_LEVEL
+		slot_map<ProcessInfo, NonPagedPolicy> procs;		// used from a callback at DISPATCH
+		BasicWString<LookasidePolicy<64, POOL_FLAG_PAGED>> name;
+		segmented_vector<Entry*, ArenaPolicy<scratch>> tmp;	// thrown away with the arena
+
+	A policy is any type with
+
+		static PVOID Allocate(size_t NumberOfBytes, ULONG Tag);
+		static void Free(PVOID p, size_t NumberOfBytes);
+
+	Allocate returns zeroed memory like ExAllocatePool2 (the containers count on
+	that) or nullptr. Free gets back the same size that was allocated, which is
+	what lets a policy hand out blocks from somewhere that isn't the pool.
+	Everything is static, so a container pays nothing for carrying its policy
+	around, and the IRQL rules are the ones of the memory the policy hands out:
+
+	PoolPolicy<PoolFlag>		ExAllocatePool2 with PoolFlag. PagedPolicy and
+								NonPagedPolicy are the two usual ones.
+	NonCachedPolicy				MmAllocateNonCachedMemory, whole pages, what
+								Vector2.0.h always used.
+	LookasidePolicy<Bytes, ...>	Requests up to Bytes come from one LOOKASIDE_LIST_EX
+								of Bytes sized blocks, bigger ones from the pool.
+								Init() in DriverEntry, Delete() in Unload.
+	ArenaPolicy<arena>			Arena.h, Free does nothing, the memory goes away
+								with the arena.
+
+	The default everywhere is NonPagedPolicy, which is what the containers always
+	allocated before. Paged memory is fine for anything only used at < DISPATCH_LEVEL,
+	and non-paged pool is the one that runs out first.
+*/
+
+template <ULONG64 PoolFlag>
+struct PoolPolicy
+{
+	static PVOID Allocate(size_t NumberOfBytes, ULONG Tag)
+	{
+		return ExAllocatePool2(PoolFlag, NumberOfBytes, Tag);
+	}
+
+	static void Free(PVOID p, size_t NumberOfBytes)
+	{
+		UNREFERENCED_PARAMETER(NumberOfBytes);
+		ExFreePool(p);
+	}
+};
+
+typedef PoolPolicy<POOL_FLAG_PAGED> PagedPolicy;
+typedef PoolPolicy<POOL_FLAG_NON_PAGED> NonPagedPolicy;
+
+
+struct NonCachedPolicy
+{
+	static PVOID Allocate(size_t NumberOfBytes, ULONG Tag)
+	{
+		UNREFERENCED_PARAMETER(Tag);
+		auto p = MmAllocateNonCachedMemory(NumberOfBytes);
+		if (p)
+			RtlZeroMemory(p, NumberOfBytes);
+		return p;
+	}
+
+	static void Free(PVOID p, size_t NumberOfBytes)
+	{
+		MmFreeNonCachedMemory(p, NumberOfBytes);
+	}
+};
+
+
+/*
+	One lookaside list per instantiation, shared by every container using it.
+	Blocks come back on the list when they're freed, so a container that keeps
+	growing to the same size and being freed again (a per-IRP name, a scratch
+	vector) stops going to the pool at all. The list's depth is tuned by the
+	system. Until Init (or after Delete) every request goes to the pool, but
+	small ones still get a whole Bytes block, so a block allocated before Init
+	can go on the list when it's freed afterwards (and the list's blocks are
+	pool blocks, so freeing one after Delete is fine too).
+*/
+
+template <size_t Bytes, ULONG64 PoolFlag = POOL_FLAG_NON_PAGED, ULONG ListTag = 'tsLL'>
+struct LookasidePolicy
+{
+	// PASSIVE_LEVEL
+	static NTSTATUS Init();
+	// After every block was freed
+	static void Delete();
+
+	static PVOID Allocate(size_t NumberOfBytes, ULONG Tag);
+	static void Free(PVOID p, size_t NumberOfBytes);
+
+private:
+	static inline LOOKASIDE_LIST_EX _list{};
+	static inline bool _initialized{ false };
+};
+
+
+template <size_t Bytes, ULONG64 PoolFlag, ULONG ListTag>
+NTSTATUS LookasidePolicy<Bytes, PoolFlag, ListTag>::Init()
+{
+	if (_initialized)
+		return STATUS_SUCCESS;
+
+	auto status = ExInitializeLookasideListEx(&_list, nullptr, nullptr,
+		PoolFlag & POOL_FLAG_PAGED ? PagedPool : NonPagedPoolNx, 0, Bytes, ListTag, 0);
+	if (!NT_SUCCESS(status))
+	{
+		DbgMsg("(LookasidePolicy::Init) -> ExInitializeLookasideListEx failed (0x%X)\n", status);
+		return status;
+	}
+
+	_initialized = true;
+	return status;
+}
+
+
+template <size_t Bytes, ULONG64 PoolFlag, ULONG ListTag>
+void LookasidePolicy<Bytes, PoolFlag, ListTag>::Delete()
+{
+	if (_initialized)
+	{
+		_initialized = false;
+		ExDeleteLookasideListEx(&_list);
+	}
+}
+
+
+template <size_t Bytes, ULONG64 PoolFlag, ULONG ListTag>
+PVOID LookasidePolicy<Bytes, PoolFlag, ListTag>::Allocate(size_t NumberOfBytes, ULONG Tag)
+{
+	if (NumberOfBytes > Bytes)
+		return ExAllocatePool2(PoolFlag, NumberOfBytes, Tag);
+	if (!_initialized)
+		return ExAllocatePool2(PoolFlag, Bytes, Tag);
+
+	// Blocks off the list are whatever their last user left in them
+	auto p = ExAllocateFromLookasideListEx(&_list);
+	if (p)
+		RtlZeroMemory(p, NumberOfBytes);
+	return p;
+}
+
+
+template <size_t Bytes, ULONG64 PoolFlag, ULONG ListTag>
+void LookasidePolicy<Bytes, PoolFlag, ListTag>::Free(PVOID p, size_t NumberOfBytes)
+{
+	if (!_initialized || NumberOfBytes > Bytes)
+		ExFreePool(p);
+	else
+		ExFreeToLookasideListEx(&_list, p);
+}
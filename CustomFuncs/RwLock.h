@@ -0,0 +1,78 @@
+#pragma once
+
+
+
+/*
+	Reader-writer lock on an EX_PUSH_LOCK, for data that's read a lot more often
+	than it's changed. Any number of SharedLock holders get in at once, an
+	ExclusiveLock (or AutoLock, Lock/Unlock are the exclusive side) waits for
+	them and keeps everyone else out.
+
+		RwLock lock;
+		lock.Init();
+		...
+		{
+			SharedLock shared(lock);
+			...read...
+		}
+
+	Same IRQL rules as FastMutex, <= APC_LEVEL. Push locks must be taken with
+	normal kernel APCs disabled, the functions below enter and leave the
+	critical region themselves. Not recursive, a thread holding it shared must
+	not ask for it again (a waiting writer would block it), and a shared holder
+	can't be upgraded to exclusive.
+
+	The exclusive owner is remembered, so code that expects its caller to hold
+	the lock can ASSERT(lock.Owned()). Shared holders aren't tracked.
+*/
+
+class RwLock
+{
+public:
+	void Init();
+
+	// Exclusive
+	void Lock();
+	void Unlock();
+	// The calling thread holds it exclusive
+	bool Owned() const { return _owner == KeGetCurrentThread(); }
+
+	void LockShared();
+	void UnlockShared();
+
+private:
+	EX_PUSH_LOCK _lock;
+	PKTHREAD volatile _owner{ nullptr };
+};
+
+
+inline void RwLock::Init()
+{
+	ExInitializePushLock(&_lock);
+}
+
+inline void RwLock::Lock()
+{
+	KeEnterCriticalRegion();
+	ExAcquirePushLockExclusiveEx(&_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+	_owner = KeGetCurrentThread();
+}
+
+inline void RwLock::Unlock()
+{
+	_owner = nullptr;
+	ExReleasePushLockExclusiveEx(&_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+	KeLeaveCriticalRegion();
+}
+
+inline void RwLock::LockShared()
+{
+	KeEnterCriticalRegion();
+	ExAcquirePushLockSharedEx(&_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+}
+
+inline void RwLock::UnlockShared()
+{
+	ExReleasePushLockSharedEx(&_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+	KeLeaveCriticalRegion();
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...)  DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Size-class slab allocator used by Alloc() for small blocks.
+
+	Memory is taken from the pool one PAGE_SIZE page at a time. Every page belongs
+	to a single size class and is carved into equally sized blocks, free blocks are
+	linked through their first bytes (embedded freelist) so a page costs nothing but
+	its header. Blocks that were never handed out are taken with a bump index, so a
+	fresh page is not touched until it is actually used.
+
+	The page header starts at the page boundary, which is how Free finds it:
+	PAGE_ALIGN(block) -> header. Free gets pool blocks too though, and their page
+	is somebody else's memory (or already gone, for a double free), so nothing is
+	read from a page before Owns found it in the slab's page map: a radix tree
+	over the page number, 4 levels of 512 like the CPU's page tables, with a bit
+	per page at the bottom. Nodes are only added while the slab lives and freed
+	by FreeAll, so Owns walks it without the lock.
+
+	The slab is not synchronized, the caller (_ALLOC_) holds the lock. The only
+	exception is the live bit of a block: Acquire and Release flip it with interlocked
+	ops so the per-CPU magazines (see Magazine.h) can hand blocks out and take them
+	back without the lock. A block sitting in a magazine is not live, but it is still
+	counted as used by its page until Return puts it back on the page freelist.
+*/
+
+class Slab
+{
+public:
+	static constexpr USHORT _sizes[]{ 16, 32, 48, 64, 96, 128, 160, 192, 256, 384, 512 };
+	static constexpr int _classCount{ sizeof(_sizes) / sizeof(*_sizes) };
+	static constexpr int _maxBlock{ _sizes[_classCount - 1] };
+
+	static constexpr bool Fits(size_t NumberOfBytes) { return NumberOfBytes > 0 && NumberOfBytes <= _maxBlock; }
+	// Is p a block of one of this slab's pages, lock free
+	bool Owns(PVOID p) const;
+
+	void Init(ULONG64 PoolFlag);
+	PVOID Alloc(size_t NumberOfBytes, UCHAR Tag = 0);
+	bool Free(PVOID p);
+	void FreeAll();
+
+	// Lock free, mark a cached block as live / not live
+	static void Acquire(PVOID p, UCHAR Tag = 0);
+	static bool Release(PVOID p);
+	// Put a released block back on its page freelist
+	void Return(PVOID p);
+
+	// Size of the block p lives in
+	static ULONG BlockSize(PVOID p);
+	// Caller defined byte stored with the block (AllocStats tag index)
+	static UCHAR TagOf(PVOID p);
+
+	static constexpr int ClassOf(size_t NumberOfBytes)
+	{ int i{ 0 }; while (_sizes[i] < NumberOfBytes) ++i; return i; }
+	static int ClassOf(PVOID p);
+
+private:
+	struct Page
+	{
+		Page* Next;
+		Page* Prev;
+		PVOID FreeList;
+		USHORT Class;
+		USHORT Used;
+		USHORT Bump;			// blocks below Bump have been handed out at least once
+		USHORT Count;
+		LONG64 Live[4];			// one bit per block, set while the block is allocated
+		UCHAR Tags[256];
+	};
+
+	struct Class
+	{
+		Page* Partial;			// pages with at least one free block
+		Page* Full;
+	};
+
+	static constexpr ULONG _firstBlock{ (sizeof(Page) + 15) & ~15 };
+
+	// Page map, 9 bits of the page number per level
+	static constexpr int _mapLevels{ 4 };
+	static constexpr int _mapBits{ 9 };
+	static constexpr ULONG _mapFanout{ 1 << _mapBits };
+
+	static ULONG64 page_number(PVOID p) { return (ULONG64)(ULONG_PTR)p >> PAGE_SHIFT; }
+	static ULONG map_index(ULONG64 number, int level) { return ULONG(number >> (_mapBits * (_mapLevels - 1 - level))) & (_mapFanout - 1); }
+
+	static auto block(Page* page, int index) { return (UCHAR*)page + _firstBlock + index * _sizes[page->Class]; }
+	static auto index_of(Page* page, PVOID p) { return int((UCHAR*)p - block(page, 0)) / _sizes[page->Class]; }
+
+	Page* NewPage(int index);
+	void ReleasePage(Page* page);
+	static void Unlink(Page*& head, Page* page);
+	static void Push(Page*& head, Page* page);
+
+	bool Map(Page* page);
+	void Unmap(Page* page);
+	static void FreeMap(PVOID node, int level);
+
+private:
+	Class _classes[_classCount]{};
+	// Root of the page map, nodes are published with InterlockedExchangePointer
+	PVOID volatile _map{ nullptr };
+	ULONG64 _poolFlag{ POOL_FLAG_NON_PAGED };
+	int _pages{ 0 };
+
+	static_assert((PAGE_SIZE - _firstBlock) / 16 <= sizeof(Page::Live) * 8, "Page::Live must cover every block of a page");
+	static_assert((PAGE_SIZE - _firstBlock) / 16 <= sizeof(Page::Tags), "Page::Tags must cover every block of a page");
+};
+
+
+
+inline bool Slab::Owns(PVOID p) const
+{
+	auto page = (Page*)PAGE_ALIGN(p);
+	if (p == nullptr || (PVOID)page == p)
+		return false;
+
+	auto number = page_number(page);
+	auto node = _map;
+	for (int level = 0; node && level < _mapLevels - 1; ++level)
+		node = ((PVOID volatile*)node)[map_index(number, level)];
+
+	auto bit = number % _mapFanout;
+	if (!node || !_bittest64(&((LONG64*)node)[bit / 64], bit % 64))
+		return false;
+
+	// The page is ours, now its header can be read
+	auto offset = (ULONG)((UCHAR*)p - (UCHAR*)page);
+	return offset >= _firstBlock
+		&& (offset - _firstBlock) % _sizes[page->Class] == 0
+		&& (offset - _firstBlock) / _sizes[page->Class] < page->Count;
+}
+
+
+inline ULONG Slab::BlockSize(PVOID p)
+{
+	return _sizes[((Page*)PAGE_ALIGN(p))->Class];
+}
+
+
+inline UCHAR Slab::TagOf(PVOID p)
+{
+	auto page = (Page*)PAGE_ALIGN(p);
+	return page->Tags[index_of(page, p)];
+}
+
+
+inline int Slab::ClassOf(PVOID p)
+{
+	return ((Page*)PAGE_ALIGN(p))->Class;
+}
+
+
+inline void Slab::Acquire(PVOID p, UCHAR Tag)
+{
+	auto page = (Page*)PAGE_ALIGN(p);
+	auto i = index_of(page, p);
+	page->Tags[i] = Tag;
+	InterlockedBitTestAndSet64(&page->Live[i / 64], i % 64);
+}
+
+
+inline bool Slab::Release(PVOID p)
+{
+	auto page = (Page*)PAGE_ALIGN(p);
+	auto i = index_of(page, p);
+
+	// Not allocated, double free
+	return InterlockedBitTestAndReset64(&page->Live[i / 64], i % 64);
+}
+
+
+inline void Slab::Init(ULONG64 PoolFlag)
+{
+	_poolFlag = PoolFlag;
+}
+
+
+inline PVOID Slab::Alloc(size_t NumberOfBytes, UCHAR Tag)
+{
+	if (!Fits(NumberOfBytes))
+		return nullptr;
+
+	auto index = ClassOf(NumberOfBytes);
+	auto& cls = _classes[index];
+
+	auto page = cls.Partial;
+	if (!page)
+	{
+		page = NewPage(index);
+		if (!page)
+			return nullptr;
+		Push(cls.Partial, page);
+	}
+
+	int i{ 0 };
+	UCHAR* ptr{ nullptr };
+	if (page->FreeList)
+	{
+		ptr = (UCHAR*)page->FreeList;
+		page->FreeList = *(PVOID*)ptr;
+		i = index_of(page, ptr);
+	}
+	else
+	{
+		i = page->Bump++;
+		ptr = block(page, i);
+	}
+
+	page->Tags[i] = Tag;
+	InterlockedBitTestAndSet64(&page->Live[i / 64], i % 64);
+	++page->Used;
+
+	if (!page->FreeList && page->Bump == page->Count)
+	{
+		Unlink(cls.Partial, page);
+		Push(cls.Full, page);
+	}
+
+	// Same guarantee as ExAllocatePool2 without POOL_FLAG_UNINITIALIZED
+	RtlZeroMemory(ptr, _sizes[index]);
+	return ptr;
+}
+
+
+inline bool Slab::Free(PVOID p)
+{
+	if (!Owns(p) || !Release(p))
+		return false;
+
+	Return(p);
+	return true;
+}
+
+
+inline void Slab::Return(PVOID p)
+{
+	auto page = (Page*)PAGE_ALIGN(p);
+	auto& cls = _classes[page->Class];
+
+	auto full = page->Used == page->Count;
+	*(PVOID*)p = page->FreeList;
+	page->FreeList = p;
+	--page->Used;
+
+	if (full)
+	{
+		Unlink(cls.Full, page);
+		Push(cls.Partial, page);
+	}
+
+	// Keep one empty page per class around so a single alloc/free pair
+	// doesn't bounce a page to and from the pool manager.
+	if (page->Used == 0 && (page->Next || page->Prev))
+	{
+		Unlink(cls.Partial, page);
+		ReleasePage(page);
+	}
+}
+
+
+inline void Slab::FreeAll()
+{
+	for (auto& cls : _classes)
+	{
+		while (cls.Partial)
+		{
+			auto page = cls.Partial;
+			Unlink(cls.Partial, page);
+			ReleasePage(page);
+		}
+
+		while (cls.Full)
+		{
+			auto page = cls.Full;
+			Unlink(cls.Full, page);
+			ReleasePage(page);
+		}
+	}
+
+	if (_map)
+	{
+		FreeMap(_map, 0);
+		_map = nullptr;
+	}
+}
+
+
+inline Slab::Page* Slab::NewPage(int index)
+{
+	auto page = (Page*)ExAllocatePool2(_poolFlag, PAGE_SIZE, 'balS');
+	if (!page)
+	{
+		DbgMsg("(Slab::NewPage) -> ExAllocatePool2(PAGE_SIZE) returned NULL\n");
+		return nullptr;
+	}
+
+	// Allocations of PAGE_SIZE or more are page aligned
+	ASSERT(PAGE_ALIGN(page) == page);
+
+	if (!Map(page))
+	{
+		ExFreePool(page);
+		return nullptr;
+	}
+
+	page->Class = (USHORT)index;
+	page->Count = USHORT((PAGE_SIZE - _firstBlock) / _sizes[index]);
+	++_pages;
+
+	DbgMsg("(Slab::NewPage) -> %p class %d (%d bytes), %d pages\n", page, index, _sizes[index], _pages);
+	return page;
+}
+
+
+inline void Slab::ReleasePage(Page* page)
+{
+	DbgMsg("(Slab::ReleasePage) -> ExFreePool(%p) called\n", page);
+	Unmap(page);
+	ExFreePool(page);
+	--_pages;
+}
+
+
+inline void Slab::Unlink(Page*& head, Page* page)
+{
+	if (page->Prev)
+		page->Prev->Next = page->Next;
+	else
+		head = page->Next;
+
+	if (page->Next)
+		page->Next->Prev = page->Prev;
+
+	page->Next = page->Prev = nullptr;
+}
+
+
+inline void Slab::Push(Page*& head, Page* page)
+{
+	page->Prev = nullptr;
+	page->Next = head;
+	if (head)
+		head->Prev = page;
+	head = page;
+}
+
+
+// Owns reads the map from any IRQL <= DISPATCH_LEVEL, so it's always non-paged
+inline bool Slab::Map(Page* page)
+{
+	auto number = page_number(page);
+	auto slot = (PVOID*)&_map;
+	for (int level = 0;; ++level)
+	{
+		auto last = level == _mapLevels - 1;
+		if (!*slot)
+		{
+			// Interior nodes hold pointers, the last level a bit per page
+			auto node = ExAllocatePool2(POOL_FLAG_NON_PAGED, last ? _mapFanout / 8 : _mapFanout * sizeof(PVOID), 'pMlS');
+			if (!node)
+			{
+				DbgMsg("(Slab::Map) -> failed allocation\n");
+				return false;
+			}
+			InterlockedExchangePointer(slot, node);
+		}
+
+		if (last)
+			break;
+		slot = &((PVOID*)*slot)[map_index(number, level)];
+	}
+
+	auto bit = number % _mapFanout;
+	InterlockedBitTestAndSet64(&((LONG64*)*slot)[bit / 64], bit % 64);
+	return true;
+}
+
+
+// Only the bit goes, empty nodes stay until FreeAll
+inline void Slab::Unmap(Page* page)
+{
+	auto number = page_number(page);
+	auto node = _map;
+	for (int level = 0; level < _mapLevels - 1; ++level)
+		node = ((PVOID*)node)[map_index(number, level)];
+
+	auto bit = number % _mapFanout;
+	InterlockedBitTestAndReset64(&((LONG64*)node)[bit / 64], bit % 64);
+}
+
+
+inline void Slab::FreeMap(PVOID node, int level)
+{
+	if (level < _mapLevels - 1)
+	{
+		for (ULONG i = 0; i < _mapFanout; ++i)
+		{
+			if (auto child = ((PVOID*)node)[i])
+				FreeMap(child, level + 1);
+		}
+	}
+	ExFreePool(node);
+}
@@ -0,0 +1,293 @@
+#pragma once
+#include <ntddk.h>
+#include "New.h"
+#include "PoolPolicy.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Table of values addressed by generational handles.
+
+	Values are stored back to back in one pool buffer, so iterating is a plain
+	loop over size() elements and inserting doesn't allocate per entry. insert
+	hands out a SlotHandle (slot index + generation) that stays the same for the
+	value's whole life, no matter how the values get shuffled around underneath.
+
+	erase moves the last value into the hole (O(1), order isn't kept) and bumps
+	the slot's generation, so every handle to the erased value is stale from then
+	on and get() returns nullptr for it instead of some other value. Generations
+	are odd while a slot is live, a zeroed SlotHandle is never valid. free()
+	doesn't start them over, handles from before it stay stale afterwards too.
+
+	Pointers from get()/at() are only good until the next insert or erase, keep
+	the handle and call get() again after re-taking the lock. The storage grows
+	(doubling, memory from Policy, non-paged pool by default) like vector<T>,
+	insert returns an invalid handle when that fails.
+*/
+
+struct SlotHandle
+{
+	ULONG Index;
+	ULONG Generation;
+
+	explicit operator bool() const { return Generation & 1; }
+	bool operator==(const SlotHandle& rhs) const { return Index == rhs.Index && Generation == rhs.Generation; }
+};
+
+
+template <typename T, typename Policy = NonPagedPolicy>
+class slot_map
+{
+public:
+	template <typename... Args>
+	SlotHandle insert(Args&&... args);
+	bool erase(SlotHandle handle);
+	void clear();
+
+	// nullptr when the handle is stale
+	T* get(SlotHandle handle);
+	bool contains(SlotHandle handle) const;
+
+	// Dense access for iteration, index is in [0, size())
+	T& at(int index);
+	SlotHandle handle_at(int index) const;
+
+	T* begin() const { return _values; }
+	T* end() const { return _values + _size; }
+	constexpr int size() const noexcept { return _size; }
+	constexpr int capacity() const noexcept { return _capacity; }
+
+	bool reserve(int capacity);
+	void free();
+
+private:
+	struct Slot
+	{
+		// Position in _values while live, next free slot while not
+		ULONG Dense;
+		ULONG Generation;
+	};
+
+	static constexpr bool _trivial{ __is_trivially_copyable(T) };
+	static constexpr ULONG _none{ MAXULONG };
+
+	const Slot* slot(SlotHandle handle) const;
+	bool grow(int capacity);
+	// Gives the three buffers back, _capacity still has to be their size
+	void release();
+
+private:
+	T* _values{ nullptr };
+	// Slot of each value, so erase can fix up the value it moves
+	ULONG* _slotOf{ nullptr };
+	Slot* _slots{ nullptr };
+	ULONG _freeSlot{ _none };
+	// Even generation new slots start at, above any handed out before free()
+	ULONG _epoch{ 0 };
+	int _size{ 0 };
+	int _capacity{ 0 };
+	static constexpr int _minCapacity{ 16 };
+};
+
+
+template <typename T, typename Policy>
+template <typename... Args>
+SlotHandle slot_map<T, Policy>::insert(Args&&... args)
+{
+	if (_size == _capacity && !grow(_capacity ? _capacity * 2 : _minCapacity))
+		return {};
+
+	auto index = _freeSlot;
+	auto& s = _slots[index];
+	_freeSlot = s.Dense;
+
+	new (&_values[_size]) T(static_cast<Args&&>(args)...);
+	_slotOf[_size] = index;
+	s.Dense = _size++;
+	++s.Generation;
+
+	return { index, s.Generation };
+}
+
+
+template <typename T, typename Policy>
+bool slot_map<T, Policy>::erase(SlotHandle handle)
+{
+	auto s = const_cast<Slot*>(slot(handle));
+	if (!s)
+		return false;
+
+	auto dense = s->Dense;
+	auto last = ULONG(_size - 1);
+	if (dense != last)
+	{
+		if constexpr (_trivial)
+			RtlCopyMemory(&_values[dense], &_values[last], sizeof(T));
+		else
+			_values[dense] = static_cast<T&&>(_values[last]);
+
+		_slotOf[dense] = _slotOf[last];
+		_slots[_slotOf[dense]].Dense = dense;
+	}
+
+	if constexpr (!__is_trivially_destructible(T))
+		_values[last].~T();
+	--_size;
+
+	++s->Generation;
+	s->Dense = _freeSlot;
+	_freeSlot = handle.Index;
+	return true;
+}
+
+
+template <typename T, typename Policy>
+void slot_map<T, Policy>::clear()
+{
+	while (_size > 0)
+		erase(handle_at(_size - 1));
+}
+
+
+template <typename T, typename Policy>
+T* slot_map<T, Policy>::get(SlotHandle handle)
+{
+	auto s = slot(handle);
+	return s ? &_values[s->Dense] : nullptr;
+}
+
+
+template <typename T, typename Policy>
+bool slot_map<T, Policy>::contains(SlotHandle handle) const
+{
+	return slot(handle) != nullptr;
+}
+
+
+template <typename T, typename Policy>
+T& slot_map<T, Policy>::at(int index)
+{
+	ASSERT(index >= 0 && index < _size);
+	return _values[index];
+}
+
+
+template <typename T, typename Policy>
+SlotHandle slot_map<T, Policy>::handle_at(int index) const
+{
+	ASSERT(index >= 0 && index < _size);
+	auto slot = _slotOf[index];
+	return { slot, _slots[slot].Generation };
+}
+
+
+template <typename T, typename Policy>
+const typename slot_map<T, Policy>::Slot* slot_map<T, Policy>::slot(SlotHandle handle) const
+{
+	if (!handle || handle.Index >= ULONG(_capacity))
+		return nullptr;
+
+	auto s = &_slots[handle.Index];
+	return s->Generation == handle.Generation ? s : nullptr;
+}
+
+
+template <typename T, typename Policy>
+bool slot_map<T, Policy>::reserve(int capacity)
+{
+	return capacity <= _capacity || grow(capacity);
+}
+
+
+template <typename T, typename Policy>
+bool slot_map<T, Policy>::grow(int capacity)
+{
+	auto values = (T*)Policy::Allocate(capacity * sizeof(T), 'paMS');
+	auto slotOf = (ULONG*)Policy::Allocate(capacity * sizeof(ULONG), 'paMS');
+	auto slots = (Slot*)Policy::Allocate(capacity * sizeof(Slot), 'paMS');
+	if (!values || !slotOf || !slots)
+	{
+		DbgMsg("bool slot_map<T>::grow(%d) -> failed allocation\n", capacity);
+		if (values)
+			Policy::Free(values, capacity * sizeof(T));
+		if (slotOf)
+			Policy::Free(slotOf, capacity * sizeof(ULONG));
+		if (slots)
+			Policy::Free(slots, capacity * sizeof(Slot));
+		return false;
+	}
+
+	if (_values)
+	{
+		if constexpr (_trivial)
+			RtlCopyMemory(values, _values, _size * sizeof(T));
+		else
+		{
+			for (int i = 0; i < _size; ++i)
+			{
+				new (&values[i]) T(static_cast<T&&>(_values[i]));
+				_values[i].~T();
+			}
+		}
+		RtlCopyMemory(slotOf, _slotOf, _size * sizeof(ULONG));
+		RtlCopyMemory(slots, _slots, _capacity * sizeof(Slot));
+
+		release();
+	}
+
+	// Chain the new slots in front of whatever was still free
+	for (int i = capacity - 1; i >= _capacity; --i)
+	{
+		slots[i].Generation = _epoch;
+		slots[i].Dense = _freeSlot;
+		_freeSlot = ULONG(i);
+	}
+
+	_values = values;
+	_slotOf = slotOf;
+	_slots = slots;
+	_capacity = capacity;
+	return true;
+}
+
+
+template <typename T, typename Policy>
+void slot_map<T, Policy>::release()
+{
+	Policy::Free(_values, _capacity * sizeof(T));
+	Policy::Free(_slotOf, _capacity * sizeof(ULONG));
+	Policy::Free(_slots, _capacity * sizeof(Slot));
+}
+
+
+template <typename T, typename Policy>
+void slot_map<T, Policy>::free()
+{
+	if (_values)
+	{
+		if constexpr (!__is_trivially_destructible(T))
+		{
+			for (int i = 0; i < _size; ++i)
+				_values[i].~T();
+		}
+
+		for (int i = 0; i < _capacity; ++i)
+		{
+			if (_slots[i].Generation >= _epoch)
+				_epoch = (_slots[i].Generation | 1) + 1;
+		}
+
+		release();
+		DbgMsg("void slot_map<T>::free() -> Policy::Free(%d) called\n", _capacity * int(sizeof(T) + sizeof(ULONG) + sizeof(Slot)));
+	}
+
+	_values = nullptr;
+	_slotOf = nullptr;
+	_slots = nullptr;
+	_freeSlot = _none;
+	_size = _capacity = 0;
+}
@@ -0,0 +1,248 @@
+#pragma once
+#include <ntddk.h>
+#include "New.h"
+#include "PoolPolicy.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	vector with room for N elements inside the object itself.
+
+	Up to N elements never touch the pool, so a small_vector that stays within
+	its inline capacity can be filled at any IRQL and while holding a spin lock.
+	The first push past N moves everything to memory from Policy (PoolPolicy.h,
+	non-paged pool by default), doubling from there like vector<T>, from then on
+	the IRQL rules of that memory apply. If that growth
+	fails push_back returns false (emplace_back nullptr) and nothing is lost.
+
+	It frees its heap buffer in the destructor, so use it for locals and members,
+	not for globals (there is no one to run global destructors in a driver).
+*/
+
+template <typename T, int N, typename Policy = NonPagedPolicy>
+class small_vector
+{
+public:
+	small_vector() = default;
+	small_vector(small_vector&& rhs) noexcept { take(rhs); }
+	~small_vector() { free(); }
+
+	small_vector(const small_vector&) = delete;
+	small_vector& operator=(const small_vector&) = delete;
+	small_vector& operator=(small_vector&& rhs) noexcept
+	{
+		if (this != &rhs)
+		{
+			free();
+			take(rhs);
+		}
+		return *this;
+	}
+
+	T& operator[](int index) { return data()[index]; }
+	const T& operator[](int index) const { return data()[index]; }
+
+	T& at(int index);
+
+	T* begin() { return data(); }
+	T* end() { return data() + _size; }
+	const T* begin() const { return data(); }
+	const T* end() const { return data() + _size; }
+
+	constexpr int size() const noexcept { return _size; }
+	constexpr int capacity() const noexcept { return _heap ? _capacity : N; }
+	// Still in the inline buffer?
+	constexpr bool is_inline() const noexcept { return _heap == nullptr; }
+
+	bool push_back(const T& value) { return emplace_back(value) != nullptr; }
+	bool push_back(T&& value) { return emplace_back(static_cast<T&&>(value)) != nullptr; }
+	template <typename... Args>
+	T* emplace_back(Args&&... args);
+	void pop_back();
+
+	// Moves the last element into index, O(1) but doesn't keep the order
+	void erase_unordered(int index);
+	bool reserve(int capacity);
+
+	void clear();
+	// Clears and gives the heap buffer back, the vector is inline again
+	void free();
+
+private:
+	static constexpr bool _trivial{ __is_trivially_copyable(T) };
+
+	T* data() { return _heap ? _heap : (T*)_inline; }
+	const T* data() const { return _heap ? _heap : (const T*)_inline; }
+
+	static T* allocate(int capacity);
+	static void deallocate(T* heap, int capacity) { Policy::Free(heap, capacity * sizeof(T)); }
+	// Moves the elements into heap and makes it the buffer
+	void adopt(T* heap, int capacity);
+	void take(small_vector& rhs);
+	static void relocate(T* dst, T* src, int count);
+
+private:
+	alignas(T) UCHAR _inline[N * sizeof(T)];
+	T* _heap{ nullptr };
+	int _size{ 0 };
+	int _capacity{ 0 };
+
+	static_assert(N > 0, "small_vector needs an inline capacity");
+};
+
+
+template <typename T, int N, typename Policy>
+T& small_vector<T, N, Policy>::at(int index)
+{
+	ASSERT(index >= 0 && index < _size);
+	return data()[index];
+}
+
+
+template <typename T, int N, typename Policy>
+template <typename... Args>
+T* small_vector<T, N, Policy>::emplace_back(Args&&... args)
+{
+	if (_size < capacity())
+		return new (&data()[_size++]) T(static_cast<Args&&>(args)...);
+
+	auto capacity = this->capacity() * 2;
+	auto tmp = allocate(capacity);
+	if (!tmp)
+		return nullptr;
+
+	// Construct before relocating, args may refer to an element of the old buffer
+	auto elem = new (&tmp[_size]) T(static_cast<Args&&>(args)...);
+	adopt(tmp, capacity);
+	++_size;
+	return elem;
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::pop_back()
+{
+	if (_size == 0)
+		return;
+
+	--_size;
+	if constexpr (!__is_trivially_destructible(T))
+		data()[_size].~T();
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::erase_unordered(int index)
+{
+	ASSERT(index >= 0 && index < _size);
+
+	auto elem = data();
+	if (index != _size - 1)
+	{
+		if constexpr (_trivial)
+			RtlCopyMemory(&elem[index], &elem[_size - 1], sizeof(T));
+		else
+			elem[index] = static_cast<T&&>(elem[_size - 1]);
+	}
+	pop_back();
+}
+
+
+template <typename T, int N, typename Policy>
+bool small_vector<T, N, Policy>::reserve(int capacity)
+{
+	if (capacity <= this->capacity())
+		return true;
+
+	auto tmp = allocate(capacity);
+	if (!tmp)
+		return false;
+
+	adopt(tmp, capacity);
+	return true;
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::clear()
+{
+	while (_size > 0)
+		pop_back();
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::free()
+{
+	clear();
+	if (_heap)
+	{
+		deallocate(_heap, _capacity);
+		_heap = nullptr;
+		_capacity = 0;
+	}
+}
+
+
+template <typename T, int N, typename Policy>
+T* small_vector<T, N, Policy>::allocate(int capacity)
+{
+	auto tmp = (T*)Policy::Allocate(capacity * sizeof(T), 'ceVS');
+	if (!tmp)
+		DbgMsg("T* small_vector<T, N>::allocate(%d) -> failed allocation\n", capacity);
+	return tmp;
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::adopt(T* heap, int capacity)
+{
+	relocate(heap, data(), _size);
+	if (_heap)
+		deallocate(_heap, _capacity);
+
+	_heap = heap;
+	_capacity = capacity;
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::take(small_vector& rhs)
+{
+	_size = rhs._size;
+	if (rhs._heap)
+	{
+		// Heap buffers just change owner
+		_heap = rhs._heap;
+		_capacity = rhs._capacity;
+		rhs._heap = nullptr;
+		rhs._capacity = 0;
+	}
+	else
+	{
+		_heap = nullptr;
+		_capacity = 0;
+		relocate((T*)_inline, (T*)rhs._inline, rhs._size);
+	}
+	rhs._size = 0;
+}
+
+
+template <typename T, int N, typename Policy>
+void small_vector<T, N, Policy>::relocate(T* dst, T* src, int count)
+{
+	if constexpr (_trivial)
+		RtlCopyMemory(dst, src, count * sizeof(T));
+	else
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			new (&dst[i]) T(static_cast<T&&>(src[i]));
+			src[i].~T();
+		}
+	}
+}
@@ -0,0 +1,235 @@
+#pragma once
+#include <ntddk.h>
+#include "Search.h"
+
+
+
+/*
+	Non-owning views over characters that live somewhere else, a UNICODE_STRING,
+	an ANSI_STRING, a WString or just a pointer and a length.
+
+		WStringView path{ &ImageInfo->FullImageName };
+		auto name = path.substr(path.rfind(L'\\') + 1);
+		if (name.ends_with_icase(L".dll"))
+			...
+
+	A view is a pointer and a length, copying one or slicing it (substr,
+	remove_prefix/suffix) never allocates and never copies characters. That
+	also means it's only good while the characters it points at are, don't keep
+	one around after the UNICODE_STRING it came from is freed. Nothing is zero
+	terminated, a view of the middle of a path ends wherever it ends.
+
+	Positions and lengths are in characters like std::string_view, npos means
+	"not found" / "to the end". substr clamps instead of throwing, a position
+	past the end gives an empty view. The _icase functions only fold ASCII
+	'A'-'Z', same as Search.h (good enough for extensions and image names).
+
+	hash() is FNV-1a, the same as Hasher<const char*> in HashMap.h, and hash_icase()
+	the same over the lower case characters, so views work as HashMap keys with
+	Hasher/EqualTo below.
+*/
+
+template <typename T>
+class BasicStringView
+{
+public:
+	static constexpr size_t npos{ ~size_t(0) };
+
+	constexpr BasicStringView() = default;
+	constexpr BasicStringView(const T* str, size_t len) : _str{ str }, _len{ len } {}
+	// Zero terminated
+	constexpr BasicStringView(const T* str) : _str{ str }, _len{ str ? length(str) : 0 } {}
+
+	BasicStringView(PCUNICODE_STRING str) requires (sizeof(T) == sizeof(WCHAR))
+		: _str{ str ? str->Buffer : nullptr }, _len{ str && str->Buffer ? str->Length / sizeof(WCHAR) : 0 } {}
+	BasicStringView(PCANSI_STRING str) requires (sizeof(T) == sizeof(CHAR))
+		: _str{ str ? str->Buffer : nullptr }, _len{ str && str->Buffer ? str->Length : 0 } {}
+
+	// Up to the first zero or max characters, for fixed size names like ImageFileName
+	static constexpr BasicStringView bounded(const T* str, size_t max) { return { str, length(str, max) }; }
+
+	constexpr const T* data() const { return _str; }
+	constexpr size_t size() const { return _len; }
+	constexpr bool empty() const { return !_len; }
+	constexpr const T* begin() const { return _str; }
+	constexpr const T* end() const { return _str + _len; }
+	constexpr T operator[](size_t i) const { return _str[i]; }
+	constexpr T front() const { return _str[0]; }
+	constexpr T back() const { return _str[_len - 1]; }
+
+	constexpr BasicStringView substr(size_t pos, size_t count = npos) const;
+	constexpr void remove_prefix(size_t n) { n = n < _len ? n : _len; _str += n; _len -= n; }
+	constexpr void remove_suffix(size_t n) { _len -= n < _len ? n : _len; }
+
+	constexpr size_t find(T c, size_t pos = 0) const;
+	constexpr size_t rfind(T c, size_t pos = npos) const;
+	size_t find(BasicStringView str, size_t pos = 0) const;
+	size_t rfind(BasicStringView str, size_t pos = npos) const;
+
+	bool equals(BasicStringView str) const { return _len == str._len && same(_str, str._str, _len, false); }
+	bool equals_icase(BasicStringView str) const { return _len == str._len && same(_str, str._str, _len, true); }
+	bool starts_with(BasicStringView str) const { return str._len <= _len && same(_str, str._str, str._len, false); }
+	bool starts_with_icase(BasicStringView str) const { return str._len <= _len && same(_str, str._str, str._len, true); }
+	bool ends_with(BasicStringView str) const { return str._len <= _len && same(end() - str._len, str._str, str._len, false); }
+	bool ends_with_icase(BasicStringView str) const { return str._len <= _len && same(end() - str._len, str._str, str._len, true); }
+
+	bool operator==(BasicStringView str) const { return equals(str); }
+
+	ULONG64 hash() const;
+	ULONG64 hash_icase() const;
+
+private:
+	static constexpr T lower(T c) { return c >= 'A' && c <= 'Z' ? T(c + ('a' - 'A')) : c; }
+	// Characters are hashed as unsigned, CHAR above 0x7F mustn't sign extend
+	static constexpr ULONG64 unit(T c) { return sizeof(T) == sizeof(CHAR) ? (UCHAR)c : (USHORT)c; }
+	static constexpr size_t length(const T* str, size_t max = npos);
+	static bool same(const T* a, const T* b, size_t len, bool ignoreCase);
+
+private:
+	const T* _str{ nullptr };
+	size_t _len{ 0 };
+};
+
+typedef BasicStringView<WCHAR> WStringView;
+typedef BasicStringView<CHAR> StringView;
+
+
+// Declared again in HashMap.h, whichever comes first
+template <typename K>
+struct Hasher;
+template <typename K>
+struct EqualTo;
+
+template <typename T>
+struct Hasher<BasicStringView<T>>
+{
+	ULONG64 operator()(BasicStringView<T> key) const { return key.hash(); }
+};
+
+template <typename T>
+struct EqualTo<BasicStringView<T>>
+{
+	bool operator()(BasicStringView<T> a, BasicStringView<T> b) const { return a.equals(b); }
+};
+
+
+
+template <typename T>
+constexpr BasicStringView<T> BasicStringView<T>::substr(size_t pos, size_t count) const
+{
+	if (pos >= _len)
+		return { _str + _len, 0 };
+	return { _str + pos, count < _len - pos ? count : _len - pos };
+}
+
+
+template <typename T>
+constexpr size_t BasicStringView<T>::find(T c, size_t pos) const
+{
+	for (; pos < _len; ++pos)
+	{
+		if (_str[pos] == c)
+			return pos;
+	}
+	return npos;
+}
+
+
+template <typename T>
+constexpr size_t BasicStringView<T>::rfind(T c, size_t pos) const
+{
+	for (auto i = pos < _len ? pos + 1 : _len; i > 0; --i)
+	{
+		if (_str[i - 1] == c)
+			return i - 1;
+	}
+	return npos;
+}
+
+
+template <typename T>
+inline size_t BasicStringView<T>::find(BasicStringView str, size_t pos) const
+{
+	if (pos > _len || str._len > _len - pos)
+		return npos;
+
+	if constexpr (sizeof(T) == sizeof(CHAR))
+	{
+		auto found = AsciiFind(_str + pos, _len - pos, str._str, str._len, false);
+		return found == AsciiNotFound ? npos : pos + found;
+	}
+	else
+	{
+		for (auto last = _len - str._len; pos <= last; ++pos)
+		{
+			if (same(_str + pos, str._str, str._len, false))
+				return pos;
+		}
+		return npos;
+	}
+}
+
+
+template <typename T>
+inline size_t BasicStringView<T>::rfind(BasicStringView str, size_t pos) const
+{
+	if (str._len > _len)
+		return npos;
+
+	for (auto i = pos < _len - str._len ? pos : _len - str._len; ; --i)
+	{
+		if (same(_str + i, str._str, str._len, false))
+			return i;
+		if (!i)
+			return npos;
+	}
+}
+
+
+template <typename T>
+inline ULONG64 BasicStringView<T>::hash() const
+{
+	ULONG64 h{ 0xcbf29ce484222325 };
+	for (size_t i = 0; i < _len; ++i)
+		h = (h ^ unit(_str[i])) * 0x100000001b3;
+	return h;
+}
+
+
+template <typename T>
+inline ULONG64 BasicStringView<T>::hash_icase() const
+{
+	ULONG64 h{ 0xcbf29ce484222325 };
+	for (size_t i = 0; i < _len; ++i)
+		h = (h ^ unit(lower(_str[i]))) * 0x100000001b3;
+	return h;
+}
+
+
+template <typename T>
+constexpr size_t BasicStringView<T>::length(const T* str, size_t max)
+{
+	size_t len{ 0 };
+	while (len < max && str[len])
+		++len;
+	return len;
+}
+
+
+// Narrow views go through Search.h (SSE2 on x64), wide ones are compared
+// one character at a time
+template <typename T>
+inline bool BasicStringView<T>::same(const T* a, const T* b, size_t len, bool ignoreCase)
+{
+	if constexpr (sizeof(T) == sizeof(CHAR))
+		return AsciiEquals(a, b, len, ignoreCase);
+	else
+	{
+		for (size_t i = 0; i < len; ++i)
+		{
+			if (ignoreCase ? lower(a[i]) != lower(b[i]) : a[i] != b[i])
+				return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <ntddk.h>
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
+
+
+/*
+	UTF-8 <-> UTF-16 conversion into caller supplied buffers.
+
+	Rtl*ToAnsiString goes through the ANSI code page one character at a time
+	(anything outside it becomes '?') and usually allocates the result. These
+	convert straight into dst, so a callback can put a command line or an image
+	path right into the item it's filling:
+
+		size_t bytes{};
+		Utf16ToUtf8(name->Buffer, name->Length / sizeof(WCHAR), nullptr, 0, &bytes);
+		...allocate the item with bytes to spare...
+		Utf16ToUtf8(name->Buffer, name->Length / sizeof(WCHAR), itemText, bytes, &bytes);
+
+	With dst == nullptr only the size is worked out (written gets it), like
+	RtlUTF8ToUnicodeN. Sizes are in units of the type, bytes for UTF-8 and
+	WCHARs for UTF-16, nothing is zero terminated.
+
+	Returns STATUS_SUCCESS, STATUS_SOME_NOT_MAPPED when invalid input (broken
+	UTF-8, unpaired surrogates) was replaced by U+FFFD, or STATUS_BUFFER_TOO_SMALL
+	when dst ran out. written always says how much was converted, a character
+	that doesn't fit completely is left out.
+
+	Runs of ASCII go 16 characters at a time with SSE2 on x64. That's safe in
+	any x64 driver, the XMM registers are saved for us. AVX2 would need
+	KeSaveExtendedProcessorState around every call, which costs more than it
+	gains on strings this short, and x86/ARM64 just use the scalar loop.
+*/
+
+inline NTSTATUS Utf8ToUtf16(const CHAR* src, size_t bytes, WCHAR* dst, size_t dstChars, size_t* written)
+{
+	auto in = (const UCHAR*)src;
+	size_t i{ 0 }, out{ 0 };
+	NTSTATUS status{ STATUS_SUCCESS };
+
+	while (i < bytes)
+	{
+		auto run = bytes - i;
+#if defined(_M_AMD64)
+		if (run >= 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i*)(in + i));
+			ULONG mask = _mm_movemask_epi8(v);
+			if (!mask && (!dst || dstChars - out >= 16))
+			{
+				if (dst)
+				{
+					auto zero = _mm_setzero_si128();
+					_mm_storeu_si128((__m128i*)(dst + out), _mm_unpacklo_epi8(v, zero));
+					_mm_storeu_si128((__m128i*)(dst + out + 8), _mm_unpackhi_epi8(v, zero));
+				}
+				i += 16;
+				out += 16;
+				continue;
+			}
+
+			// Only the ASCII in front of the first multibyte sequence
+			ULONG first{};
+			if (_BitScanForward(&first, mask))
+				run = first;
+		}
+#endif
+		for (; run && in[i] < 0x80; --run, ++i, ++out)
+		{
+			if (dst)
+			{
+				if (out == dstChars)
+				{
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+				dst[out] = in[i];
+			}
+		}
+
+		if (status == STATUS_BUFFER_TOO_SMALL)
+			break;
+		if (i == bytes || in[i] < 0x80)
+			continue;
+
+		// Multibyte sequence, anything not allowed by the standard (overlong,
+		// surrogates, past U+10FFFF, cut short) turns into U+FFFD one byte at a time
+		ULONG cp{ in[i] };
+		size_t n{ 0 }, k{ 1 };
+		if (cp >= 0xC2 && cp <= 0xDF)
+			n = 2, cp &= 0x1F;
+		else if (cp >= 0xE0 && cp <= 0xEF)
+			n = 3, cp &= 0x0F;
+		else if (cp >= 0xF0 && cp <= 0xF4)
+			n = 4, cp &= 0x07;
+
+		if (n && bytes - i >= n)
+		{
+			for (; k < n && (in[i + k] & 0xC0) == 0x80; ++k)
+				cp = cp << 6 | (in[i + k] & 0x3F);
+		}
+
+		if (k != n || (n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF))
+			|| (cp >= 0xD800 && cp <= 0xDFFF))
+		{
+			cp = 0xFFFD;
+			n = 1;
+			status = STATUS_SOME_NOT_MAPPED;
+		}
+
+		size_t units = cp > 0xFFFF ? 2 : 1;
+		if (dst)
+		{
+			if (dstChars - out < units)
+			{
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			if (units == 2)
+			{
+				dst[out] = WCHAR(0xD800 + ((cp - 0x10000) >> 10));
+				dst[out + 1] = WCHAR(0xDC00 + (cp & 0x3FF));
+			}
+			else
+				dst[out] = WCHAR(cp);
+		}
+
+		i += n;
+		out += units;
+	}
+
+	*written = out;
+	return status;
+}
+
+
+inline NTSTATUS Utf16ToUtf8(const WCHAR* src, size_t chars, CHAR* dst, size_t dstBytes, size_t* written)
+{
+	auto out8 = (UCHAR*)dst;
+	size_t i{ 0 }, out{ 0 };
+	NTSTATUS status{ STATUS_SUCCESS };
+
+	while (i < chars)
+	{
+		auto run = chars - i;
+#if defined(_M_AMD64)
+		if (run >= 16)
+		{
+			auto lo = _mm_loadu_si128((const __m128i*)(src + i));
+			auto hi = _mm_loadu_si128((const __m128i*)(src + i + 8));
+			auto high = _mm_set1_epi16((SHORT)0xFF80);
+			auto zero = _mm_setzero_si128();
+
+			// One bit per character, set when it's ASCII
+			ULONG mask = _mm_movemask_epi8(_mm_packs_epi16(
+				_mm_cmpeq_epi16(_mm_and_si128(lo, high), zero),
+				_mm_cmpeq_epi16(_mm_and_si128(hi, high), zero)));
+
+			if (mask == 0xFFFF && (!dst || dstBytes - out >= 16))
+			{
+				if (dst)
+					_mm_storeu_si128((__m128i*)(out8 + out), _mm_packus_epi16(lo, hi));
+				i += 16;
+				out += 16;
+				continue;
+			}
+
+			ULONG first{};
+			if (_BitScanForward(&first, ~mask & 0xFFFF))
+				run = first;
+		}
+#endif
+		for (; run && src[i] < 0x80; --run, ++i, ++out)
+		{
+			if (dst)
+			{
+				if (out == dstBytes)
+				{
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+				out8[out] = UCHAR(src[i]);
+			}
+		}
+
+		if (status == STATUS_BUFFER_TOO_SMALL)
+			break;
+		if (i == chars || src[i] < 0x80)
+			continue;
+
+		ULONG cp{ src[i] };
+		size_t n{ 1 };
+		if (cp >= 0xD800 && cp <= 0xDBFF && chars - i > 1 && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF)
+		{
+			cp = 0x10000 + ((cp - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+			n = 2;
+		}
+		else if (cp >= 0xD800 && cp <= 0xDFFF)
+		{
+			cp = 0xFFFD;
+			status = STATUS_SOME_NOT_MAPPED;
+		}
+
+		size_t units = cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+		if (dst)
+		{
+			if (dstBytes - out < units)
+			{
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			auto p = out8 + out;
+			switch (units)
+			{
+			case 2:
+				p[0] = UCHAR(0xC0 | cp >> 6);
+				p[1] = UCHAR(0x80 | (cp & 0x3F));
+				break;
+			case 3:
+				p[0] = UCHAR(0xE0 | cp >> 12);
+				p[1] = UCHAR(0x80 | (cp >> 6 & 0x3F));
+				p[2] = UCHAR(0x80 | (cp & 0x3F));
+				break;
+			default:
+				p[0] = UCHAR(0xF0 | cp >> 18);
+				p[1] = UCHAR(0x80 | (cp >> 12 & 0x3F));
+				p[2] = UCHAR(0x80 | (cp >> 6 & 0x3F));
+				p[3] = UCHAR(0x80 | (cp & 0x3F));
+			}
+		}
+
+		i += n;
+		out += units;
+	}
+
+	*written = out;
+	return status;
+}
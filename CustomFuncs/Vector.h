@@ -1,5 +1,7 @@
 #pragma once
 #include <ntddk.h>
+#include "New.h"
+#include "PoolPolicy.h"
 
 #ifndef DbgMsg
 #define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
@@ -7,7 +9,21 @@
 
 
 
-template <typename T>
+/*
+	Elements live in memory from Policy (PoolPolicy.h), non-paged pool unless
+	the vector says otherwise. The buffer starts at
+	_minCapacity elements and doubles whenever push_back runs out of room, so
+	push_back is amortized O(1) and never silently drops elements. If the pool
+	can't satisfy a growth, push_back/reserve/resize return false (emplace_back
+	nullptr) and the vector is left as it was.
+
+	Trivially copyable element types are moved around with RtlCopyMemory and never
+	constructed or destroyed one by one, everything else is move constructed into
+	the new buffer and destroyed properly. The branches are if constexpr, so each
+	instantiation only contains the path for its own T.
+*/
+
+template <typename T, typename Policy = NonPagedPolicy>
 class vector
 {
 public:
@@ -29,87 +45,253 @@ public:
 	constexpr T* end() const { return _elem + _size; }
 
 	constexpr int size() const noexcept { return _size; }
+	constexpr int capacity() const noexcept { return _capacity; }
 
-	void push_back(const T& value);
+	bool push_back(const T& value) { return emplace_back(value) != nullptr; }
+	bool push_back(T&& value) { return emplace_back(static_cast<T&&>(value)) != nullptr; }
+	template <typename... Args>
+	T* emplace_back(Args&&... args);
 	void pop_back();
 
+	// Copies [first, last) to the end, the range must not be part of this vector
+	bool append(const T* first, const T* last);
+	// Moves the last element into index, O(1) but doesn't keep the order
+	void erase_unordered(int index);
+	// New elements are value initialized
+	bool resize(int size);
+
+	bool reserve(int capacity);
+	void shrink_to_fit();
+
 	void free();
 
 private:
-	void allocate();
+	static constexpr bool _trivial{ __is_trivially_copyable(T) };
+
+	static T* allocate(int capacity);
+	static void deallocate(T* elem, int capacity) { Policy::Free(elem, capacity * sizeof(T)); }
+	static void relocate(T* dst, T* src, int count);
+	static void destroy(T* first, int count);
+	bool reallocate(int capacity);
 
 private:
 	T* _elem{ nullptr };
 	int _size{ 0 };
-	static constexpr int _allocBytes{ PAGE_SIZE };
-	int _maxSize{ _allocBytes / sizeof(T) };
-	bool _allocated{ false };
+	int _capacity{ 0 };
+	static constexpr int _minCapacity{ 16 };
 };
 
 
-template <typename T>
-T& vector<T>::at(int index)
+template <typename T, typename Policy>
+T& vector<T, Policy>::at(int index)
 {
 	ASSERT(index >= 0 && index < _size);
 	return _elem[index];
 }
 
 
-template <typename T>
-void vector<T>::push_back(const T& value)
+template <typename T, typename Policy>
+template <typename... Args>
+T* vector<T, Policy>::emplace_back(Args&&... args)
 {
-	if (!_allocated)
-		allocate();
+	if (_size < _capacity)
+		return new (&_elem[_size++]) T(static_cast<Args&&>(args)...);
+
+	auto capacity = _capacity ? _capacity * 2 : _minCapacity;
+	auto tmp = allocate(capacity);
+	if (!tmp)
+		return nullptr;
+
+	// Construct before relocating, args may refer to an element of the old buffer
+	auto elem = new (&tmp[_size]) T(static_cast<Args&&>(args)...);
+	if (_elem)
+	{
+		relocate(tmp, _elem, _size);
+		deallocate(_elem, _capacity);
+	}
 
-	if (_elem && _size < _maxSize)
-		_elem[_size++] = value;
+	_elem = tmp;
+	_capacity = capacity;
+	++_size;
+	return elem;
 }
 
 
-template <typename T>
-void vector<T>::pop_back()
+template <typename T, typename Policy>
+void vector<T, Policy>::pop_back()
 {
 	if (_size == 0 || !_elem)
 		return;
 
-	_elem[--_size] = T{ 0 };
+	destroy(&_elem[--_size], 1);
 }
 
 
-template <typename T>
-void vector<T>::allocate()
+template <typename T, typename Policy>
+bool vector<T, Policy>::append(const T* first, const T* last)
 {
-	/*
-	* MmAllocateNonCachedMemory always returns a full multiple of the virtual memory page size,
-	* of nonpaged system-address-space memory, regardless of the requested allocation size.
-	* Therefore, requests for less than a page are rounded up to a full page
-	* and any remainder bytes on the page are wasted,
-	* they are inaccessible by the driver that called the function and are unusable by other kernel-mode code.
-	*
-	* https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/ntddk/nf-ntddk-mmallocatenoncachedmemory
-	*/
-
-	auto tmp = (T*)MmAllocateNonCachedMemory(_allocBytes);
-	if (tmp)
+	ASSERT(last < _elem || first >= _elem + _capacity || !_elem);
+
+	auto count = int(last - first);
+	if (count <= 0)
+		return true;
+
+	if (_size + count > _capacity)
 	{
-		RtlZeroMemory(tmp, _allocBytes);
-		_elem = tmp;
-		_allocated = true;
+		auto capacity = _capacity ? _capacity : _minCapacity;
+		while (capacity < _size + count)
+			capacity *= 2;
+
+		if (!reallocate(capacity))
+			return false;
 	}
+
+	if constexpr (_trivial)
+		RtlCopyMemory(&_elem[_size], first, count * sizeof(T));
 	else
 	{
-		DbgMsg("void vector<T>::allocate() -> failed allocation\n");
+		for (int i = 0; i < count; ++i)
+			new (&_elem[_size + i]) T(first[i]);
 	}
+
+	_size += count;
+	return true;
+}
+
+
+template <typename T, typename Policy>
+void vector<T, Policy>::erase_unordered(int index)
+{
+	ASSERT(index >= 0 && index < _size);
+
+	if (index != _size - 1)
+	{
+		if constexpr (_trivial)
+			RtlCopyMemory(&_elem[index], &_elem[_size - 1], sizeof(T));
+		else
+			_elem[index] = static_cast<T&&>(_elem[_size - 1]);
+	}
+	pop_back();
+}
+
+
+template <typename T, typename Policy>
+bool vector<T, Policy>::resize(int size)
+{
+	if (size < 0)
+		return false;
+
+	if (size < _size)
+	{
+		destroy(&_elem[size], _size - size);
+		_size = size;
+		return true;
+	}
+
+	if (!reserve(size))
+		return false;
+
+	if constexpr (__is_trivially_constructible(T))
+		RtlZeroMemory(&_elem[_size], (size - _size) * sizeof(T));
+	else
+	{
+		for (int i = _size; i < size; ++i)
+			new (&_elem[i]) T();
+	}
+
+	_size = size;
+	return true;
+}
+
+
+template <typename T, typename Policy>
+bool vector<T, Policy>::reserve(int capacity)
+{
+	return capacity <= _capacity || reallocate(capacity);
+}
+
+
+template <typename T, typename Policy>
+void vector<T, Policy>::shrink_to_fit()
+{
+	if (_size == 0)
+		free();
+	else if (_size < _capacity)
+		reallocate(_size);
+}
+
+
+template <typename T, typename Policy>
+T* vector<T, Policy>::allocate(int capacity)
+{
+	// Memory is zero initialized, every policy does that
+	auto tmp = (T*)Policy::Allocate(capacity * sizeof(T), 'rceV');
+	if (!tmp)
+		DbgMsg("T* vector<T>::allocate(%d) -> failed allocation\n", capacity);
+	return tmp;
+}
+
+
+template <typename T, typename Policy>
+void vector<T, Policy>::relocate(T* dst, T* src, int count)
+{
+	if constexpr (_trivial)
+		RtlCopyMemory(dst, src, count * sizeof(T));
+	else
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			new (&dst[i]) T(static_cast<T&&>(src[i]));
+			src[i].~T();
+		}
+	}
+}
+
+
+template <typename T, typename Policy>
+void vector<T, Policy>::destroy(T* first, int count)
+{
+	if constexpr (!__is_trivially_destructible(T))
+	{
+		for (int i = 0; i < count; ++i)
+			first[i].~T();
+	}
+	else
+	{
+		UNREFERENCED_PARAMETER(first);
+		UNREFERENCED_PARAMETER(count);
+	}
+}
+
+
+template <typename T, typename Policy>
+bool vector<T, Policy>::reallocate(int capacity)
+{
+	auto tmp = allocate(capacity);
+	if (!tmp)
+		return false;
+
+	if (_elem)
+	{
+		relocate(tmp, _elem, _size);
+		deallocate(_elem, _capacity);
+	}
+
+	_elem = tmp;
+	_capacity = capacity;
+	return true;
 }
 
 
-template <typename T>
-void vector<T>::free()
+template <typename T, typename Policy>
+void vector<T, Policy>::free()
 {
 	if (_elem)
 	{
-		MmFreeNonCachedMemory(_elem, _allocBytes);
+		destroy(_elem, _size);
+		deallocate(_elem, _capacity);
+		DbgMsg("void vector<T>::free() -> Policy::Free(%d) called\n", _capacity * (int)sizeof(T));
 		_elem = nullptr;
-		DbgMsg("void vector<T>::free() -> MmFreeNonCachedMemory(%d) called\n", _allocBytes);
+		_size = _capacity = 0;
 	}
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include "PoolPolicy.h"
 
 
 #ifndef DbgMsg
@@ -15,8 +16,39 @@ struct is_pointer<T*> { static const bool value = true; };
 
 
 
+/*
+	Ownership policies for vector<T, Ownership>.
 
-template <typename T>
+	PoolOwned: the elements are pointers from ExAllocatePool*, the vector frees
+	them on pop_back/free/free_all. Which slots own their pointer is kept in a
+	bitmap at the end of the page (one bit per slot), so checking or dropping
+	ownership is O(1) instead of a scan over a second list of pointers.
+
+	RawValue: the elements are plain values, nothing is tracked and nothing is
+	freed, the whole page is used for elements.
+
+	The default picks PoolOwned for pointer types and RawValue for everything
+	else, like the old runtime is_pointer check did. vector<HANDLE, RawValue>
+	keeps pointers without owning them.
+
+	The page itself comes from Policy (PoolPolicy.h). NonCachedPolicy is the
+	default because that's what this vector always used, vector<T, Ownership,
+	NonPagedPolicy> or PagedPolicy get a normal cached pool page instead.
+*/
+
+struct PoolOwned { static constexpr bool _owns{ true }; };
+struct RawValue { static constexpr bool _owns{ false }; };
+
+template <bool>
+struct default_ownership { using type = RawValue; };
+
+template <>
+struct default_ownership<true> { using type = PoolOwned; };
+
+
+
+
+template <typename T, typename Ownership = typename default_ownership<is_pointer<T>::value>::type, typename Policy = NonCachedPolicy>
 class vector
 {
 	T& operator[](int index) { return _elem[index]; }
@@ -32,33 +64,59 @@ public:
 
 	constexpr int size() const noexcept { return _size; }
 
-	void push_back(const T& value);
+	// With PoolOwned the vector takes ownership of value unless owned is false,
+	// the same pointer must not be pushed owned twice (checked on DBG builds)
+	void push_back(const T& value, bool owned = true);
 	void pop_back();
 
+	// Does the slot free its pointer? Always false for RawValue
+	bool owned(int index) const;
+	// Stops owning the pointer at index without freeing it
+	void release(int index);
+
 	void free(int index);
 	void free(auto& p);
 	void free_all();
 
 private:
+	static constexpr bool _owns{ Ownership::_owns };
+	static constexpr int _allocBytes{ PAGE_SIZE };
+
+	// As many slots as fit in the page together with one bit each
+	static constexpr int slots()
+	{
+		if constexpr (!_owns)
+			return _allocBytes / sizeof(T);
+		else
+		{
+			int n = _allocBytes * 8 / (sizeof(T) * 8 + 1);
+			while (n * sizeof(T) + (n + 63) / 64 * sizeof(ULONG64) > _allocBytes)
+				--n;
+			return n;
+		}
+	}
+
 	void allocate();
-	bool find(ULONG_PTR p) const;
-	void add(ULONG_PTR p);
-	void remove(ULONG_PTR p);
+	void setOwned(int index, bool owned);
+	// Frees the slot's pointer if it owns it, clears the bit
+	void drop(int index);
+	// Moves the last element (and its bit) into index
+	void moveLast(int index);
 
 private:
 	T* _elem{ nullptr };
-	ULONG_PTR* _heap{ nullptr };
+	ULONG64* _owned{ nullptr };
 	int _size{ 0 };
-	int _count{ 0 };
-	static constexpr int _allocBytes{ PAGE_SIZE };
-	int _maxSize{ _allocBytes / sizeof(T) };
+	static constexpr int _maxSize{ slots() };
 	bool _allocated{ false };
+
+	static_assert(!_owns || is_pointer<T>::value, "PoolOwned needs a pointer element type");
 };
 
-template <typename T>
-T& vector<T>::at(int index)
+template <typename T, typename Ownership, typename Policy>
+T& vector<T, Ownership, Policy>::at(int index)
 {
-	
+
 	if (!(index >= 0 && index < _size))
 	{
 		DbgMsg("T& vector<T>::at(%d) -> OUT OF BOUNDS\n", index);
@@ -68,62 +126,101 @@ T& vector<T>::at(int index)
 }
 
 
-template <typename T>
-void vector<T>::push_back(const T& value)
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::push_back(const T& value, bool owned)
 {
 	if (!_allocated)
 		allocate();
 
 	if (_allocated && _size < _maxSize)
 	{
-		if (is_pointer<T>::value)
+		if constexpr (_owns)
 		{
-			if (!find((ULONG_PTR)value))
-				add((ULONG_PTR)value);
+#if DBG
+			// Owning the same pointer twice frees it twice
+			for (int i = 0; owned && value && i < _size; ++i)
+			{
+				if (_elem[i] == value && this->owned(i))
+				{
+					DbgMsg("vector<T>::push_back(%llx) -> ALREADY OWNED at %d\n", (ULONG_PTR)value, i);
+					ASSERT(FALSE);
+					owned = false;
+				}
+			}
+#endif
+			setOwned(_size, owned && value != nullptr);
 		}
+		else
+			UNREFERENCED_PARAMETER(owned);
+
 		_elem[_size++] = value;
 	}
 }
 
-template <typename T>
-void vector<T>::pop_back()
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::pop_back()
 {
 	if (_size == 0)
 		return;
 
-	if (is_pointer<T>::value)
+	if constexpr (_owns)
 	{
-		remove((ULONG_PTR)_elem[_size - 1]);
+		drop(_size - 1);
 		DbgMsg("_elem[--_size](%llx) = NULL\n", (ULONG_PTR)_elem[_size - 1]);
-		_elem[--_size] = NULL;
+	}
+	_elem[--_size] = T{};
+}
+
+
+template <typename T, typename Ownership, typename Policy>
+bool vector<T, Ownership, Policy>::owned(int index) const
+{
+	if constexpr (_owns)
+		return _owned && index >= 0 && index < _size && (_owned[index / 64] >> (index % 64)) & 1;
+	else
+	{
+		UNREFERENCED_PARAMETER(index);
+		return false;
+	}
+}
+
+
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::release(int index)
+{
+	if constexpr (_owns)
+	{
+		if (index >= 0 && index < _size)
+			setOwned(index, false);
 	}
 	else
-		_elem[--_size] = NULL;
+		UNREFERENCED_PARAMETER(index);
 }
 
 
-template <typename T>
-void vector<T>::allocate()
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::allocate()
 {
 	/*
-	* MmAllocateNonCachedMemory always returns a full multiple of the virtual memory page size, 
+	* MmAllocateNonCachedMemory always returns a full multiple of the virtual memory page size,
 	* of nonpaged system-address-space memory, regardless of the requested allocation size.
 	* Therefore, requests for less than a page are rounded up to a full page
 	* and any remainder bytes on the page are wasted,
 	* they are inaccessible by the driver that called the function and are unusable by other kernel-mode code.
-	* 
+	*
 	* https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/ntddk/nf-ntddk-mmallocatenoncachedmemory
+	*
+	* That's why every policy gets a whole page here, and comes back zeroed.
 	*/
 
-	auto tmp = (T*)MmAllocateNonCachedMemory(_allocBytes);
+	auto tmp = (T*)Policy::Allocate(_allocBytes, 'ceVP');
 	if (tmp)
 	{
-		RtlZeroMemory(tmp, _allocBytes);
 		_elem = tmp;
-		if (is_pointer<T>::value)
+		if constexpr (_owns)
 		{
-			_maxSize /= 2;
-			_heap =  (ULONG_PTR*)&_elem[_maxSize];
+			// The bitmap sits in the last bytes of the page, behind the slots
+			_owned = (ULONG64*)((UCHAR*)tmp + _allocBytes) - (_maxSize + 63) / 64;
 		}
 		_allocated = true;
 	}
@@ -134,44 +231,35 @@ void vector<T>::allocate()
 }
 
 
-template <typename T>
-void vector<T>::free(int index)
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::free(int index)
 {
 	if (_size == 0 || !_elem || !(index >= 0 && index < _size))
 		return;
 
-	if (is_pointer<T>::value)
-	{
-		remove((ULONG_PTR)_elem[index]);
-		_elem[index] = _elem[--_size];
-	}
+	if constexpr (_owns)
+		drop(index);
+	moveLast(index);
 }
 
 
-template <typename T>
-void vector<T>::free(auto& p)
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::free(auto& p)
 {
+	static_assert(_owns, "free(p) is only for PoolOwned vectors");
+
 	if (_size == 0 || !_elem || p == nullptr)
 		return;
 
-	for (int i = 0; i < _count; ++i)
+	for (int i = 0; i < _size; ++i)
 	{
-		if (_heap[i] == (ULONG_PTR)p)
+		if (_elem[i] == (T)p)
 		{
-			if (i == _count - 1)
-				_heap[--_count] = NULL;
-			else
-			{
-				_heap[i] = _heap[_count - 1];
-				_heap[--_count] = NULL;
-			}
-
-			DbgMsg("ExFreePool(%llx)\n", (ULONG_PTR)p);
-			ExFreePool(p);
-
-			if (_elem[i] == (T)p)
-				_elem[i] = _elem[--_size];
+			if (!owned(i))
+				return;
 
+			drop(i);
+			moveLast(i);
 			p = nullptr;
 			return;
 		}
@@ -179,79 +267,71 @@ void vector<T>::free(auto& p)
 }
 
 
-template <typename T>
-void vector<T>::free_all()
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::free_all()
 {
 	if (_elem)
 	{
-		if (_heap)
+		if constexpr (_owns)
 		{
-			while (_count > 0)
+			// Only visit the set bits, a word at a time
+			for (int w = 0; w < (_size + 63) / 64; ++w)
 			{
-				DbgMsg("ExFreePool(%llx)\n", _heap[_count - 1]);
-				ExFreePool((PVOID)_heap[--_count]);
+				auto bits = _owned[w];
+				ULONG bit;
+				while (_BitScanForward64(&bit, bits))
+				{
+					bits &= bits - 1;
+					auto p = _elem[w * 64 + bit];
+					DbgMsg("ExFreePool(%llx)\n", (ULONG_PTR)p);
+					ExFreePool((PVOID)p);
+				}
+				_owned[w] = 0;
 			}
-			_heap = nullptr;
+			_owned = nullptr;
 		}
 
-		while (_size > 0)
-		{
-			DbgMsg("_elem[--_size](%llx) = NULL\n", (ULONG_PTR)_elem[_size - 1]);
-			_elem[--_size] = NULL;
-		}
-
-		MmFreeNonCachedMemory(_elem, _allocBytes);
-		DbgMsg("void vector<T>::free_all() -> MmFreeNonCachedMemory(%d) called\n", _allocBytes);
+		Policy::Free(_elem, _allocBytes);
+		DbgMsg("void vector<T>::free_all() -> Policy::Free(%d) called\n", _allocBytes);
 		_elem = nullptr;
+		_size = 0;
 		_allocated = false;
 	}
 }
 
-template <typename T>
-bool vector<T>::find(ULONG_PTR p) const
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::setOwned(int index, bool owned)
 {
-	if (!_heap || _count == 0)
-		return false;
-
-	for (int i = 0; i < _count; ++i)
-	{
-		if (_heap[i] == p)
-			return true;
-	}
-	return false;
+	auto mask = 1ull << (index % 64);
+	if (owned)
+		_owned[index / 64] |= mask;
+	else
+		_owned[index / 64] &= ~mask;
 }
 
-template <typename T>
-void vector<T>::add(ULONG_PTR p)
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::drop(int index)
 {
-	if (p == NULL)
+	if (!owned(index))
 		return;
 
-	if (_heap && _count < _maxSize)
-		_heap[_count++] = p;
+	setOwned(index, false);
+	DbgMsg("ExFreePool(%llx)\n", (ULONG_PTR)_elem[index]);
+	ExFreePool((PVOID)_elem[index]);
 }
 
-template <typename T>
-void vector<T>::remove(ULONG_PTR p)
+template <typename T, typename Ownership, typename Policy>
+void vector<T, Ownership, Policy>::moveLast(int index)
 {
-	if (!_heap || _count == 0 || p == NULL)
-		return;
-
-	for (int i = 0; i < _count; ++i)
+	auto last = _size - 1;
+	if (index != last)
 	{
-		if (_heap[i] == p)
-		{
-			if (i == _count - 1)
-				_heap[--_count] = NULL;
-			else
-			{
-				_heap[i] = _heap[_count - 1];
-				_heap[--_count] = NULL;
-			}
-
-			DbgMsg("ExFreePool(%llx)\n", p);
-			ExFreePool((PVOID)p);
-			return;
-		}
+		_elem[index] = _elem[last];
+		if constexpr (_owns)
+			setOwned(index, owned(last));
 	}
+
+	if constexpr (_owns)
+		setOwned(last, false);
+	_elem[--_size] = T{};
 }
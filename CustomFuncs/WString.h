@@ -1,4 +1,7 @@
 #pragma once
+#include <ntstrsafe.h>
+#include "StringView.h"
+#include "PoolPolicy.h"
 
 
 
@@ -19,52 +22,89 @@
 	To use this globaly you can just comment out constructors
 	and destructors. The overloaded operator='s and Free will make everything work perfectly,
 	just dont forget to call Free somewhere for all WString objects.
+
+	Strings shorter than _inlineChars characters are kept in a buffer inside the
+	object, so names like "\\Device\\random" never touch the pool. Unicode() still
+	gives a normal UNICODE_STRING, its Buffer just points into the object then, so
+	it's only valid as long as that WString is (copies and moves get their own).
+
+	Capacity is tracked apart from the length (it's _unicode.MaximumLength), so
+	assigning a string that fits reuses the buffer, and the ANSI copy keeps its
+	buffer too. Reserve/Append/AppendFormat build a string in place, growing by
+	doubling, so a path put together from a few pieces costs one allocation if
+	Reserve is called first:
+
+		WString path{ L"\\Device\\" };
+		path.Reserve(64);
+		path.Append(name);
+		path.AppendFormat(L"_%u", pid);
+
+	Pool buffers are reference counted and shared between copies, a copy (or
+	passing a WString by value) is one interlocked increment. The first change
+	made through a WString whose buffer is shared gives it its own buffer, the
+	other copies don't see it. So don't write through Unicode()->Buffer, the
+	characters may belong to other copies too.
+
+	A WString converts to a WStringView (StringView.h), so functions that only
+	read a string can take a view and get WStrings, UNICODE_STRINGs and
+	literals alike without a copy.
+
+	Policy (PoolPolicy.h) is where the pool buffers come from. WString keeps
+	using non-paged pool, a string that's only touched at PASSIVE_LEVEL can be
+	a BasicWString<PagedPolicy>, and one that's built and thrown away per
+	request can take its buffer from a LookasidePolicy.
 */
 
 
 
-class WString
+template <typename Policy = NonPagedPolicy>
+class BasicWString
 {
 public:
+	// Characters (with the terminator) that fit without a pool allocation
+	static constexpr size_t _inlineChars{ 30 };
+
 	// Constructors
 	//***********************************************
-	explicit WString(const WCHAR* wStr);
-	explicit WString(PCUNICODE_STRING wStr);
+	explicit BasicWString(const WCHAR* wStr);
+	explicit BasicWString(PCUNICODE_STRING wStr);
 
-	explicit WString(const CHAR* aStr);
-	explicit WString(const PANSI_STRING aStr);
+	explicit BasicWString(const CHAR* aStr);
+	explicit BasicWString(const PANSI_STRING aStr);
 
-	WString(const WString& rhs);		// Copy
-	WString(WString&& rhs) noexcept;	// Move
+	BasicWString(const BasicWString& rhs);		// Copy
+	BasicWString(BasicWString&& rhs) noexcept;	// Move
 	//***********************************************
 
 
 	// Destructor
 	//***********************************************
-	~WString();
+	~BasicWString();
 	//***********************************************
 
 
 	// Operator overloading
 	//***********************************************
 	operator bool() const { return _unicode.Buffer != nullptr; }
+	// Valid until the string is changed or destroyed
+	operator WStringView() const { return { _unicode.Buffer, _len }; }
 	//***********************************************
 
 
 	// Copy and Move assignment operators
 	//***********************************************
-	WString& operator=(const WString& rhs);			// Copy
-	WString& operator=(WString&& rhs) noexcept;		// Move
+	BasicWString& operator=(const BasicWString& rhs);			// Copy
+	BasicWString& operator=(BasicWString&& rhs) noexcept;		// Move
 	//***********************************************
 
 
 	// Custom assignment operators
 	//***********************************************
-	WString& operator=(PCUNICODE_STRING rhs);
-	WString& operator=(const WCHAR* rhs);
+	BasicWString& operator=(PCUNICODE_STRING rhs);
+	BasicWString& operator=(const WCHAR* rhs);
 
-	WString& operator=(const PANSI_STRING rhs);
-	WString& operator=(const CHAR* rhs);
+	BasicWString& operator=(const PANSI_STRING rhs);
+	BasicWString& operator=(const CHAR* rhs);
 	//***********************************************
 
 
@@ -76,6 +116,22 @@ public:
 	constexpr auto Length() const { return _unicode.Length; }
 	// Ptr to allocated buffer
 	constexpr auto Buffer() const { return _unicode.Buffer; }
+	// Characters that fit without growing, not counting the terminator
+	constexpr size_t Capacity() const { return _unicode.Buffer ? _unicode.MaximumLength / _wSize - 1 : 0; }
+	// The string lives in _inline, no pool memory behind it
+	constexpr bool IsInline() const { return _unicode.Buffer == _inline; }
+	// Other WStrings point to the same pool buffer
+	bool IsShared() const { return _unicode.Buffer && !IsInline() && Header()->Refs > 1; }
+
+	// Builder functions, false (and the string unchanged) if the pool is out
+	// or the result would be longer than a UNICODE_STRING can hold
+	bool Reserve(size_t chars);
+	bool Append(const WCHAR* str);
+	bool Append(PCUNICODE_STRING str);
+	bool Append(const CHAR* str);
+	bool Append(const BasicWString& str);
+	// RtlStringCbPrintfW format, appended at the end
+	bool AppendFormat(const WCHAR* format, ...);
 
 	constexpr auto Unicode() { return  &_unicode; }
 	constexpr auto Ansi() { if (!_updated)InitializeAnsi(); return &_ansi; }
@@ -87,349 +143,502 @@ private:
 	// This is mainly a wide-character class, so we only allocate memory
 	// for _ansi when Ansi() is called
 	void InitializeAnsi();
+
+	// Makes room for chars characters plus the terminator, in _inline if they
+	// fit. keep copies the current string over, otherwise it's emptied. Returns
+	// nullptr and leaves everything as it was when the pool is out. A shared
+	// buffer is never written to, Grow makes a private one first
+	WCHAR* Grow(size_t chars, bool keep);
+	void SetLength(size_t len);
+	// Frees whatever came from the pool, the string is empty afterwards
+	void Release();
+	// Drops this string's reference to the pool buffer, frees it with the last one
+	void Unref();
+	// Points to rhs's pool buffer and takes a reference on it
+	void Share(const BasicWString& rhs);
+	void Assign(const WCHAR* str, size_t len);
+	void Assign(PCANSI_STRING str);
+	bool AppendChars(const WCHAR* str, size_t len);
+	// Takes over rhs's buffers, copies the characters if they're inline
+	void Take(BasicWString& rhs);
 	//***********************************************
 
 private:
 	// Member variables
 	//***********************************************
-	UNICODE_STRING _unicode{ 0 };
-	ANSI_STRING _ansi{ 0 };
+	UNICODE_STRING _unicode{};
+	ANSI_STRING _ansi{};
 	size_t _len{ 0 };
 
+	// Sits in front of the characters of every pool buffer
+	struct Shared
+	{
+		LONG64 volatile Refs;
+	};
+	Shared* Header() const { return (Shared*)_unicode.Buffer - 1; }
+
 	static constexpr USHORT _wSize{ sizeof(WCHAR) };
+	// MaximumLength is a USHORT, the terminator has to fit as well
+	static constexpr size_t _maxChars{ MAXUSHORT / sizeof(WCHAR) - 1 };
 
 	// To minimize calls to InitializeAnsi()
 	// we only call if _ansi is not initialized
 	// or _unicode.buffer has changed
 	bool _updated{ false };
+
+	WCHAR _inline[_inlineChars]{};
 	//***********************************************
 };
 
+typedef BasicWString<> WString;
 
 
-WString::WString(const WCHAR* wStr)
-	: _unicode{ USHORT(wcslen(wStr) * _wSize)
-	, USHORT(wcslen(wStr) * _wSize + _wSize), nullptr }
-	, _len{ wcslen(wStr) }, _updated{false}
+
+template <typename Policy>
+BasicWString<Policy>::BasicWString(const WCHAR* wStr)
 {
 	DbgMsg("WString::WString(const WCHAR* wStr) called\n");
 	if (wStr)
-	{
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			wcsncpy(_unicode.Buffer, wStr, _len);
-		}
-	}
+		Assign(wStr, wcslen(wStr));
 }
 
 
-WString::WString(PCUNICODE_STRING wStr)
-	: _unicode{ wStr->Length, USHORT(wStr->Length + _wSize), nullptr }
-	, _len{ size_t(wStr->Length / _wSize) }, _updated{false}
+template <typename Policy>
+BasicWString<Policy>::BasicWString(PCUNICODE_STRING wStr)
 {
 	DbgMsg("WString::WString(PCUNICODE_STRING wStr) called\n");
 	if (wStr->Buffer)
-	{
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			wcsncpy(_unicode.Buffer, wStr->Buffer, _len);
-		}
-	}
+		Assign(wStr->Buffer, wStr->Length / _wSize);
 }
 
 
-WString::WString(const CHAR* aStr)
-	: _unicode{ USHORT(strlen(aStr) * _wSize)
-	, USHORT(strlen(aStr) * _wSize + _wSize), nullptr}
-	, _len{ strlen(aStr) }, _updated{false}
+template <typename Policy>
+BasicWString<Policy>::BasicWString(const CHAR* aStr)
 {
 	DbgMsg("WString::WString(const CHAR* aStr) called\n");
 	if (aStr)
 	{
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			CANSI_STRING str{ (USHORT)_len, USHORT(_len + 1), (PCHAR)aStr};
-			RtlAnsiStringToUnicodeString(&_unicode, &str, FALSE);
-		}
+		CANSI_STRING str{ (USHORT)strlen(aStr), USHORT(strlen(aStr) + 1), (PCHAR)aStr };
+		Assign(&str);
 	}
 }
 
 
-WString::WString(const PANSI_STRING aStr)
-	: _unicode{ USHORT(aStr->Length * _wSize)
-	, USHORT(aStr->Length * _wSize + _wSize), nullptr }
-	, _len{ size_t(aStr->Length) }, _updated{false}
+template <typename Policy>
+BasicWString<Policy>::BasicWString(const PANSI_STRING aStr)
 {
 	DbgMsg("WString::WString(const PANSI_STRING aStr) called\n");
 	if (aStr->Buffer)
-	{
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			RtlAnsiStringToUnicodeString(&_unicode, aStr, FALSE);
-		}
-	}
+		Assign(aStr);
 }
 
 
-WString::~WString()
+template <typename Policy>
+BasicWString<Policy>::~BasicWString()
 {
-	if (_unicode.Buffer) 
-	{
-		DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer); 
-		ExFreePool(_unicode.Buffer);
-	}
-
-	if (_ansi.Buffer)
-	{
-		DbgMsg("ExFreePool(_ansi.Buffer) called in destructor\n");
-		ExFreePool(_ansi.Buffer);
-	}
+	Release();
 }
 
 
-WString::WString(const WString& rhs) : WString(&rhs._unicode)
-{ DbgMsg("WString::WString(const WString& rhs) called\n"); }
+template <typename Policy>
+BasicWString<Policy>::BasicWString(const BasicWString& rhs)
+{
+	DbgMsg("WString::WString(const WString& rhs) called\n");
+	if (rhs.IsInline())
+		Assign(rhs._unicode.Buffer, rhs._len);
+	else if (rhs._unicode.Buffer)
+		Share(rhs);
+}
 
 
-WString::WString(WString&& rhs) noexcept
-	: _unicode{ rhs._unicode }, _len{ rhs._len }, _updated{ false }
+template <typename Policy>
+BasicWString<Policy>::BasicWString(BasicWString&& rhs) noexcept
 {
 	DbgMsg("WString::WString(WString&& rhs) noexcept called\n");
-	RtlZeroMemory(&rhs, sizeof(WString));
+	Take(rhs);
 }
 
 
-WString& WString::operator=(const WString& rhs)
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(const BasicWString& rhs)
 {
 	DbgMsg("WString& WString::operator=(const WString& rhs) called\n");
-	if (this != &rhs && rhs._unicode.Buffer)
-	{
-		if (_unicode.Buffer)
-		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
-		}
-
-		_len = rhs._len;
-		_unicode.Length = rhs._unicode.Length;
-		_unicode.MaximumLength = rhs._unicode.MaximumLength;
+	if (this == &rhs || !rhs._unicode.Buffer)
+		return *this;
 
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			wcsncpy(_unicode.Buffer, rhs._unicode.Buffer, _len);
-		}
-	}
+	if (rhs.IsInline())
+		Assign(rhs._unicode.Buffer, rhs._len);
+	else if (_unicode.Buffer != rhs._unicode.Buffer)
+		Share(rhs);
 	return *this;
 }
 
 
-WString& WString::operator=(WString&& rhs) noexcept
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(BasicWString&& rhs) noexcept
 {
 	DbgMsg("WString& WString::operator=(WString&& rhs) noexcept called\n");
 	if (this != &rhs && rhs._unicode.Buffer)
 	{
-		if (_unicode.Buffer)
-		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
-		}
-
-		_len = rhs._len;
-		_unicode = { rhs._unicode.Length, rhs._unicode.MaximumLength, rhs._unicode.Buffer };
-		RtlZeroMemory(&rhs, sizeof(WString));
+		Release();
+		Take(rhs);
 	}
 	return *this;
 }
 
 
-WString& WString::operator=(PCUNICODE_STRING rhs)
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(PCUNICODE_STRING rhs)
 {
 	DbgMsg("WString& WString::operator=(PCUNICODE_STRING rhs) called\n");
 
 	if (rhs->Buffer && &_unicode != rhs)
+		Assign(rhs->Buffer, rhs->Length / _wSize);
+	return *this;
+}
+
+
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(const WCHAR* rhs)
+{
+	DbgMsg("WString& WString::operator=(const WCHAR* rhs) called\n");
+
+	if (rhs && _unicode.Buffer != rhs)
+		Assign(rhs, wcslen(rhs));
+	return *this;
+}
+
+
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(const PANSI_STRING rhs)
+{
+	DbgMsg("WString& WString::operator=(const PANSI_STRING rhs) called\n");
+
+	if (rhs->Buffer &&  &_ansi != rhs)
+		Assign(rhs);
+	return *this;
+}
+
+
+template <typename Policy>
+BasicWString<Policy>& BasicWString<Policy>::operator=(const CHAR* rhs)
+{
+	DbgMsg("WString& WString::operator=(const CHAR* rhs) called\n");
+
+	if (rhs && _ansi.Buffer != rhs)
 	{
-		if (_unicode.Buffer)
+		CANSI_STRING str{ (USHORT)strlen(rhs), USHORT(strlen(rhs) + 1), (PCHAR)rhs };
+		Assign(&str);
+	}
+	return *this;
+}
+
+
+template <typename Policy>
+void BasicWString<Policy>::InitializeAnsi()
+{
+	if (_unicode.Buffer)
+	{
+		auto length = USHORT(_unicode.Length / _wSize);
+
+		// Keep the old buffer if the string still fits
+		if (_ansi.Buffer && _ansi.MaximumLength < length + 1)
 		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
+			DbgMsg("ExFreePool(_ansi.Buffer) called inside InitializeAnsi()\n");
+			Policy::Free(_ansi.Buffer, _ansi.MaximumLength);
+			_ansi = {};
 		}
 
-		_len = rhs->Length / _wSize;
-		_unicode.Length = rhs->Length;
-		_unicode.MaximumLength = _unicode.Length + _wSize;
+		if (!_ansi.Buffer)
+		{
+			_ansi.MaximumLength = length + 1;
+			_ansi.Buffer = (PCHAR)Policy::Allocate(_ansi.MaximumLength, 'rtSw');
+		}
 
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
+		_ansi.Length = length;
+		if (_ansi.Buffer)
 		{
-			_unicode.Buffer[_len] = NULL;
-			wcsncpy(_unicode.Buffer, rhs->Buffer, _len);
+			_ansi.Buffer[_ansi.Length] = NULL;
+			RtlUnicodeStringToAnsiString(&_ansi, &_unicode, FALSE);
+			_updated = true;
 		}
 	}
-	return *this;
 }
 
 
-WString& WString::operator=(const WCHAR* rhs)
+template <typename Policy>
+bool BasicWString<Policy>::Reserve(size_t chars)
 {
-	DbgMsg("WString& WString::operator=(const WCHAR* rhs) called\n");
+	return Grow(chars, true) != nullptr;
+}
 
-	if (rhs && _unicode.Buffer != rhs)
+
+template <typename Policy>
+bool BasicWString<Policy>::Append(const WCHAR* str)
+{
+	return !str || AppendChars(str, wcslen(str));
+}
+
+
+template <typename Policy>
+bool BasicWString<Policy>::Append(PCUNICODE_STRING str)
+{
+	return !str->Buffer || AppendChars(str->Buffer, str->Length / _wSize);
+}
+
+
+template <typename Policy>
+bool BasicWString<Policy>::Append(const CHAR* str)
+{
+	if (!str)
+		return true;
+
+	auto len = strlen(str);
+	if (!Grow(_len + len, true))
+		return false;
+
+	// Convert straight into the free space behind the string
+	UNICODE_STRING tail{ 0, USHORT((Capacity() - _len + 1) * _wSize), _unicode.Buffer + _len };
+	CANSI_STRING ansi{ (USHORT)len, USHORT(len + 1), (PCHAR)str };
+	if (!NT_SUCCESS(RtlAnsiStringToUnicodeString(&tail, &ansi, FALSE)))
 	{
-		if (_unicode.Buffer)
+		_unicode.Buffer[_len] = NULL;
+		return false;
+	}
+
+	SetLength(_len + tail.Length / _wSize);
+	return true;
+}
+
+
+template <typename Policy>
+bool BasicWString<Policy>::Append(const BasicWString& str)
+{
+	return !str._unicode.Buffer || AppendChars(str._unicode.Buffer, str._len);
+}
+
+
+template <typename Policy>
+bool BasicWString<Policy>::AppendFormat(const WCHAR* format, ...)
+{
+	if (!Grow(_len, true))
+		return false;
+
+	va_list args;
+	va_start(args, format);
+
+	auto ok = false;
+	for (;;)
+	{
+		auto tail = _unicode.Buffer + _len;
+		va_list copy;
+		va_copy(copy, args);
+		auto status = RtlStringCbVPrintfW(tail, (Capacity() - _len + 1) * _wSize, format, copy);
+		va_end(copy);
+
+		if (NT_SUCCESS(status))
 		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
+			SetLength(_len + wcslen(tail));
+			ok = true;
+			break;
 		}
 
-		_len = wcslen(rhs);
-		_unicode.Length = (USHORT)_len * _wSize;
-		_unicode.MaximumLength = _unicode.Length + _wSize;
-
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
+		// Truncated, double and print again
+		tail[0] = NULL;
+		if (status != STATUS_BUFFER_OVERFLOW || Capacity() >= _maxChars)
 		{
-			_unicode.Buffer[_len] = NULL;
-			wcsncpy(_unicode.Buffer, rhs, _len);
+			DbgMsg("WString::AppendFormat() -> Status=(%x)\n", status);
+			break;
 		}
+
+		auto chars = (Capacity() + 1) * 2;
+		if (!Grow(chars < _maxChars ? chars : _maxChars, true))
+			break;
 	}
-	return *this;
+
+	va_end(args);
+	return ok;
 }
 
 
-WString& WString::operator=(const PANSI_STRING rhs)
+template <typename Policy>
+WCHAR* BasicWString<Policy>::Grow(size_t chars, bool keep)
 {
-	DbgMsg("WString& WString::operator=(const PANSI_STRING rhs) called\n");
+	// Whatever is kept has to fit, even when asked for less (Reserve(0) on a
+	// shared string, or Assign of a short piece of it)
+	if (keep && chars < _len)
+		chars = _len;
 
-	if (rhs->Buffer &&  &_ansi != rhs)
+	if (_unicode.Buffer && chars <= Capacity() && !IsShared())
 	{
-		if (_unicode.Buffer)
-		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
-		}
+		if (!keep)
+			SetLength(0);
+		return _unicode.Buffer;
+	}
 
-		_len = rhs->Length;
-		_unicode.Length = (USHORT)_len * _wSize;
-		_unicode.MaximumLength = _unicode.Length + _wSize;
+	if (chars > _maxChars)
+	{
+		DbgMsg("WString::Grow(%llu) -> too long for a UNICODE_STRING\n", (ULONG64)chars);
+		return nullptr;
+	}
+
+	WCHAR* buffer{ _inline };
+	USHORT maxLength{ sizeof(_inline) };
 
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
+	if (chars >= _inlineChars)
+	{
+		// Growing an existing string at least doubles it, so appending stays linear
+		auto capacity = chars + 1;
+		if (keep && _unicode.Buffer && capacity < (Capacity() + 1) * 2)
+			capacity = (Capacity() + 1) * 2 < _maxChars + 1 ? (Capacity() + 1) * 2 : _maxChars + 1;
+
+		maxLength = USHORT(capacity * _wSize);
+		auto shared = (Shared*)Policy::Allocate(sizeof(Shared) + maxLength, 'rtSw');
+		if (!shared)
 		{
-			_unicode.Buffer[_len] = NULL;
-			RtlAnsiStringToUnicodeString(&_unicode, rhs, FALSE);
+			DbgMsg("WString::Grow(%llu) -> failed allocation\n", (ULONG64)chars);
+			return nullptr;
 		}
+		shared->Refs = 1;
+		buffer = (WCHAR*)(shared + 1);
 	}
-	return *this;
+
+	auto len = _len;
+	if (keep && _unicode.Buffer)
+		RtlCopyMemory(buffer, _unicode.Buffer, len * _wSize);
+	else
+		len = 0;
+
+	Unref();
+	_unicode.Buffer = buffer;
+	_unicode.MaximumLength = maxLength;
+	SetLength(len);
+	return buffer;
 }
 
 
-WString& WString::operator=(const CHAR* rhs)
+template <typename Policy>
+void BasicWString<Policy>::SetLength(size_t len)
 {
-	DbgMsg("WString& WString::operator=(const CHAR* rhs) called\n");
+	_unicode.Buffer[len] = NULL;
+	_unicode.Length = USHORT(len * _wSize);
+	_len = len;
+	_updated = false;
+}
 
-	if (rhs && _ansi.Buffer != rhs)
+
+template <typename Policy>
+void BasicWString<Policy>::Release()
+{
+	Unref();
+
+	if (_ansi.Buffer)
 	{
-		if (_unicode.Buffer)
-		{
-			DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
-			ExFreePool(_unicode.Buffer);
-
-			if (_ansi.Buffer)
-			{
-				DbgMsg("ExFreePool(_ansi.Buffer)\n");
-				ExFreePool(_ansi.Buffer);
-				_ansi.Buffer = nullptr;
-				_updated = false;
-			}
-		}
+		DbgMsg("ExFreePool(_ansi.Buffer)\n");
+		Policy::Free(_ansi.Buffer, _ansi.MaximumLength);
+	}
 
-		_len = strlen(rhs);
-		_unicode.Length = (USHORT)_len * _wSize;
-		_unicode.MaximumLength = _unicode.Length + _wSize;
+	_unicode = {};
+	_ansi = {};
+	_len = 0;
+	_updated = false;
+}
 
-		_unicode.Buffer = (WCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, _unicode.MaximumLength, 'rtSw');
-		if (_unicode.Buffer)
-		{
-			_unicode.Buffer[_len] = NULL;
-			CANSI_STRING str{ (USHORT)_len, USHORT(_len + 1), (PCHAR)rhs};
-			RtlAnsiStringToUnicodeString(&_unicode, &str, FALSE);
-		}
+
+template <typename Policy>
+void BasicWString<Policy>::Unref()
+{
+	if (_unicode.Buffer && !IsInline() && !InterlockedDecrement64(&Header()->Refs))
+	{
+		DbgMsg("ExFreePool(%ws)\n", _unicode.Buffer);
+		Policy::Free(Header(), sizeof(Shared) + _unicode.MaximumLength);
 	}
-	return *this;
 }
 
 
-void WString::InitializeAnsi()
+template <typename Policy>
+void BasicWString<Policy>::Share(const BasicWString& rhs)
 {
-	if (_unicode.Buffer)
+	InterlockedIncrement64(&rhs.Header()->Refs);
+	Unref();
+
+	_unicode = rhs._unicode;
+	_len = rhs._len;
+	_updated = false;
+}
+
+
+template <typename Policy>
+void BasicWString<Policy>::Assign(const WCHAR* str, size_t len)
+{
+	// str may point into our own buffer, it moves along if the buffer does
+	auto inside = _unicode.Buffer && str >= _unicode.Buffer && str < _unicode.Buffer + _len;
+	auto offset = str - _unicode.Buffer;
+
+	if (!Grow(len, inside))
 	{
-		if (_ansi.Buffer)	// just to be sure
-		{
-			DbgMsg("ExFreePool(_ansi.Buffer) called inside InitializeAnsi()\n");
-			ExFreePool(_ansi.Buffer);
-		}
+		Release();
+		return;
+	}
 
-		_ansi.Length = _unicode.Length / _wSize;
-		_ansi.MaximumLength = _ansi.Length + 1;
+	if (inside)
+		str = _unicode.Buffer + offset;
 
-		_ansi.Buffer = (PCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, _ansi.MaximumLength, 'rtSw');
-		if (_ansi.Buffer)
-		{
-			_ansi.Buffer[_ansi.Length] = NULL;
-			RtlUnicodeStringToAnsiString(&_ansi, &_unicode, FALSE);
-			_updated = true;
-		}
+	RtlMoveMemory(_unicode.Buffer, str, len * _wSize);
+	SetLength(len);
+}
+
+
+template <typename Policy>
+void BasicWString<Policy>::Assign(PCANSI_STRING str)
+{
+	if (!Grow(str->Length, false))
+	{
+		Release();
+		return;
+	}
+
+	RtlAnsiStringToUnicodeString(&_unicode, str, FALSE);
+	SetLength(_unicode.Length / _wSize);
+}
+
+
+template <typename Policy>
+bool BasicWString<Policy>::AppendChars(const WCHAR* str, size_t len)
+{
+	auto inside = _unicode.Buffer && str >= _unicode.Buffer && str < _unicode.Buffer + _len;
+	auto offset = str - _unicode.Buffer;
+
+	if (!Grow(_len + len, true))
+		return false;
+
+	if (inside)
+		str = _unicode.Buffer + offset;
+
+	RtlMoveMemory(_unicode.Buffer + _len, str, len * _wSize);
+	SetLength(_len + len);
+	return true;
+}
+
+
+template <typename Policy>
+void BasicWString<Policy>::Take(BasicWString& rhs)
+{
+	_unicode = rhs._unicode;
+	if (rhs.IsInline())
+	{
+		RtlCopyMemory(_inline, rhs._inline, sizeof(_inline));
+		_unicode.Buffer = _inline;
 	}
+
+	_ansi = rhs._ansi;
+	_len = rhs._len;
+	_updated = rhs._updated;
+
+	rhs._unicode = {};
+	rhs._ansi = {};
+	rhs._len = 0;
+	rhs._updated = false;
 }
 
 
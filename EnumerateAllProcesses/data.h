@@ -1,6 +1,7 @@
 #pragma once
 #include "WString.h"
 #include "fastmutex.h"
+#include "rwlock.h"
 
 
 #define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
@@ -12,10 +13,23 @@ NTSTATUS IrpComplete(PIRP Irp, NTSTATUS Status = STATUS_SUCCESS, ULONG_PTR Info
 DRIVER_UNLOAD UnloadDriver;
 DRIVER_DISPATCH CreateClose, IoControl;
 
-int ref_index{};
-ProcessInfo* RetProcByName(const char* name, vector<ProcessInfo*>& vec, int& index = ref_index);
-void FindProcess(const char* name, vector<ProcessInfo*>& vec);
+// Process rows and an index of them by the atom of their image name, so lookups
+// by name don't walk the rows and ignore case like the atoms do. Every indexed
+// row holds a reference on its atom. Both only change together, under an
+// exclusive procLock
+struct ProcessTable
+{
+	slot_map<ProcessInfo, PagedPolicy> Rows;
+	HashMap<Atom, SlotHandle, Hasher<Atom>, EqualTo<Atom>, PagedPolicy> ByName;
+};
+
+ProcessInfo* RetProcByName(StringView name, ProcessTable& table, SlotHandle& handle);
+ProcessInfo* InsertProcess(StringView name, ProcessTable& table);
+void EraseProcess(SlotHandle handle, ProcessTable& table);
+void ClearProcesses(ProcessTable& table);
+void FindProcess(const char* name, ProcessTable& table);
 bool FindPid(ULONG pid, ProcessInfo* process = nullptr);
+bool AddPid(ULONG pid, ProcessInfo* proc);
 bool RemovePid(ULONG pid, ProcessInfo* proc);
 void HideByPid(ULONG pid);
 
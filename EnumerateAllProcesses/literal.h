@@ -0,0 +1,93 @@
+#pragma once
+#include <ntddk.h>
+
+
+
+/*
+	UNICODE_STRING constants made at compile time from narrow literals.
+
+		constexpr auto dev = "\\Device\\random"_us;
+		IoCreateDevice(pDriverObject, 0, dev.Unicode(), ...);
+
+	The literal is widened by the compiler into a static WCHAR array, and the
+	UNICODE_STRING pointing at it is static too, both in read-only memory. There
+	is no strlen, no pool allocation and no RtlAnsiStringToUnicodeString at run
+	time, and nothing to free. Every use of the same literal shares one copy.
+
+	Only ASCII is accepted, a character above 0x7F doesn't compile (widening it
+	would depend on the code page). Unicode() hands out a PUNICODE_STRING because
+	that's what IoCreateDevice and friends take, they only read it. Don't write
+	through it.
+*/
+
+// Not constexpr on purpose, calling it in a consteval function is a compile error
+void NonAsciiCharacterInUnicodeLiteral();
+
+
+template <size_t N>
+struct AsciiLiteral
+{
+	static constexpr size_t Size{ N };
+
+	consteval AsciiLiteral(const CHAR(&str)[N])
+	{
+		for (size_t i = 0; i < N; ++i)
+		{
+			if ((UCHAR)str[i] > 0x7F)
+				NonAsciiCharacterInUnicodeLiteral();
+			Chars[i] = str[i];
+		}
+	}
+
+	CHAR Chars[N]{};
+};
+
+
+template <AsciiLiteral Str>
+struct StaticUnicode
+{
+	struct Wide
+	{
+		WCHAR Chars[Str.Size];
+	};
+
+	static consteval Wide Widen()
+	{
+		Wide wide{};
+		for (size_t i = 0; i < Str.Size; ++i)
+			wide.Chars[i] = (WCHAR)Str.Chars[i];
+		return wide;
+	}
+
+	static constexpr Wide Buffer{ Widen() };
+	static constexpr UNICODE_STRING Value
+	{
+		USHORT((Str.Size - 1) * sizeof(WCHAR)),
+		USHORT(Str.Size * sizeof(WCHAR)),
+		const_cast<PWCH>(Buffer.Chars)
+	};
+
+	static_assert(Str.Size * sizeof(WCHAR) <= MAXUSHORT, "literal is too long for a UNICODE_STRING");
+};
+
+
+class UnicodeLiteral
+{
+public:
+	consteval UnicodeLiteral(PCUNICODE_STRING str) : _str{ str } {}
+
+	// Size in wchar
+	constexpr size_t Size() const { return _str->Length / sizeof(WCHAR); }
+	constexpr PCWSTR Buffer() const { return _str->Buffer; }
+	constexpr PUNICODE_STRING Unicode() const { return const_cast<PUNICODE_STRING>(_str); }
+
+private:
+	PCUNICODE_STRING _str;
+};
+
+
+template <AsciiLiteral Str>
+consteval UnicodeLiteral operator""_us()
+{
+	return { &StaticUnicode<Str>::Value };
+}
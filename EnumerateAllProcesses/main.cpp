@@ -1,5 +1,10 @@
 #include <ntifs.h>
 #include "vector.h"
+#include "slotmap.h"
+#include "literal.h"
+#include "search.h"
+#include "stringview.h"
+#include "atomtable.h"
 #include "common.h"
 #include "data.h"
 #include "autolock.h"
@@ -7,18 +12,27 @@
 
 // Globals
 //------------------------------------------
-FastMutex mutex;
-vector<ProcessInfo*> processes;
-vector<const char*> names;
-vector<ProcessInfo*> allProcesses;
+// Readers (IO_ACTIVE_PROCESSES, the list copies) share it, lookups by name and
+// changes are exclusive, a lookup and the change it leads to under one hold
+RwLock procLock;
+// Everything below is only touched from IOCTLs and the process notify routine
+// (PASSIVE_LEVEL, APC_LEVEL under procLock), paged pool is enough
+ProcessTable processes;
+BasicAtomTable<PagedPolicy> atoms;
+// Watch list, each entry holds a reference on its atom
+vector<Atom, PagedPolicy> names;
+ProcessTable allProcesses;
 //------------------------------------------
 
 
 extern "C"
 NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING)
 {
-	mutex.Init();
-	WString dos{ "\\??\\random" };
+	procLock.Init();
+	atoms.Init(16, DRIVER_TAG);
+	processes.ByName.Init(16, DRIVER_TAG);
+	allProcesses.ByName.Init(64, DRIVER_TAG);
+	constexpr auto dos = "\\??\\random"_us;
 
 	auto status = STATUS_SUCCESS;
 	PDEVICE_OBJECT DeviceObject = nullptr;
@@ -30,7 +44,7 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING)
 	{
 		//UNICODE_STRING dev = RTL_CONSTANT_STRING(L"\\Device\\random");
 
-		WString dev{ "\\Device\\random" };
+		constexpr auto dev = "\\Device\\random"_us;
 		status = IoCreateDevice(pDriverObject, 0, dev.Unicode(), FILE_DEVICE_UNKNOWN, 0, FALSE, &DeviceObject);
 		if (!NT_SUCCESS(status))
 		{
@@ -79,16 +93,21 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING)
 
 void UnloadDriver(PDRIVER_OBJECT pDriverObject)
 {
-	WString dos{ "\\??\\random" };
+	constexpr auto dos = "\\??\\random"_us;
 	PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
 	IoDeleteSymbolicLink(dos.Unicode());
 	IoDeleteDevice(pDriverObject->DeviceObject);
 
 	{
-		AutoLock lock(mutex);
-		processes.free();
-		allProcesses.free();
+		ExclusiveLock lock(procLock);
+		ClearProcesses(processes);
+		processes.Rows.free();
+		processes.ByName.Free();
+		ClearProcesses(allProcesses);
+		allProcesses.Rows.free();
+		allProcesses.ByName.Free();
 		names.free();
+		atoms.Free();
 	}
 
 	DbgMsg("Driver unloaded\n");
@@ -114,11 +133,12 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 	auto status = STATUS_UNSUCCESSFUL;
 	ULONG byteIO = 0;
 
-	auto found = [](auto str, auto substr)
+	// Same name (in any case) is same atom
+	auto found = [](auto& list, Atom atom)
 	{
-		for (int i = 0; i < str.size(); ++i)
+		for (int i = 0; i < list.size(); ++i)
 		{
-			if (strstr(str.at(i), substr))
+			if (list.at(i) == atom)
 				return i;
 		}
 		return -1;
@@ -131,27 +151,36 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 		__try
 		{
 			auto name = (const char*)Irp->AssociatedIrp.SystemBuffer;
-			if (found(names, name) < 0)
+			auto atom = atoms.Add(name);
+			if (atom)
 			{
-				auto ptr = (char*)ExAllocatePool2(POOL_FLAG_PAGED, strlen(name) + 1, DRIVER_TAG);
-				if (ptr)
+				// Looked up under the lock, or two callers could add the same name
+				ExclusiveLock lock(procLock);
+				if (found(names, atom) < 0)
 				{
-					AutoLock lock(mutex);
-					RtlCopyMemory(ptr, name, strlen(name) + 1);
-					names.push_back(ptr);
-				}
+					if (!names.push_back(atom))
+					{
+						DbgMsg("(IO_ADD_PROCESS) -> name list is full\n");
+						atoms.Release(atom);
+						status = STATUS_INSUFFICIENT_RESOURCES;
+						break;
+					}
 
-				DbgMsg("Name list:\n");
-				for (int i = 0; i < names.size(); ++i)
-				{
-					if (names.at(i) != 0)
-						DbgMsg("%s\n", names.at(i));
+					DbgMsg("Name list:\n");
+					for (int i = 0; i < names.size(); ++i)
+					{
+						if (names.at(i) != 0)
+							DbgMsg("%s\n", atoms.Name(names.at(i)));
+					}
+					status = STATUS_SUCCESS;
+					byteIO = stack->Parameters.DeviceIoControl.InputBufferLength;
+					break;
 				}
-				status = STATUS_SUCCESS;
-				byteIO = stack->Parameters.DeviceIoControl.InputBufferLength;
-				break;
 			}
 
+			// Already on the list, it keeps the reference it has
+			if (atom)
+				atoms.Release(atom);
 			break;
 		}
 		__except (EXCEPTION_EXECUTE_HANDLER)
@@ -166,26 +195,19 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 		__try
 		{
 			auto name = (const char*)Irp->AssociatedIrp.SystemBuffer;
-			auto index = found(names, name);
+			ExclusiveLock lock(procLock);
+			auto index = found(names, atoms.Find(name));
 			if (index >= 0)
 			{
-				AutoLock lock(mutex);
-				DbgMsg("process %s removed\n", names.at(index));
-				ExFreePool((PVOID)names.at(index));
-				names.at(index) = nullptr;
-				if (index == names.size() - 1)
-					names.pop_back();
-				else
-				{
-					names.at(index) = names.at(names.size() - 1);
-					names.pop_back();
-				}
+				DbgMsg("process %s removed\n", atoms.Name(names.at(index)));
+				atoms.Release(names.at(index));
+				names.erase_unordered(index);
 
 				DbgMsg("Name list:\n");
 				for (int i = 0; i < names.size(); ++i)
 				{
 					if (names.at(i))
-						DbgMsg("%s\n", names.at(i));
+						DbgMsg("%s\n", atoms.Name(names.at(i)));
 				}
 				status = STATUS_SUCCESS;
 				byteIO = stack->Parameters.DeviceIoControl.InputBufferLength;
@@ -206,39 +228,47 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 		__try
 		{
 			{
-				AutoLock lock(mutex);
-				while (processes.size() > 0)
+				ExclusiveLock lock(procLock);
+				ClearProcesses(processes);
+			}
+
+			// FindProcess takes procLock itself, so it runs on a copy of the list
+			// with a reference on every name, the list can change meanwhile
+			vector<Atom, PagedPolicy> watched;
+			{
+				SharedLock lock(procLock);
+				for (int i = 0; i < names.size(); ++i)
 				{
-					if (processes.at(processes.size() - 1))
-						ExFreePool(processes.at(processes.size() - 1));
-					processes.pop_back();
+					if (names.at(i) && watched.push_back(names.at(i)))
+						atoms.AddRef(names.at(i));
 				}
 			}
 
-			for (int i = 0; i < names.size(); ++i)
+			for (int i = 0; i < watched.size(); ++i)
 			{
-				if (names.at(i))
-					FindProcess(names.at(i), processes);
+				FindProcess(atoms.Name(watched.at(i)), processes);
+				atoms.Release(watched.at(i));
 			}
+			watched.free();
 
 			auto buffer = (ProcessInfo*)Irp->AssociatedIrp.SystemBuffer;
 			auto len = stack->Parameters.DeviceIoControl.InputBufferLength;
 			auto _size = len / sizeof(ProcessInfo);
 
-			if (_size > processes.size())
-				_size = processes.size();
-
 			auto index = 0;
 			{
-				AutoLock lock(mutex);
+				SharedLock lock(procLock);
+				if (_size > processes.Rows.size())
+					_size = processes.Rows.size();
+
 				for (int i = 0; i < _size; ++i)
 				{
-					memcpy(buffer[i].Name, processes.at(i)->Name, SIZEOF(buffer->Name));
-					buffer[i].PidCount = processes.at(i)->PidCount;
+					memcpy(buffer[i].Name, processes.Rows.at(i).Name, SIZEOF(buffer->Name));
+					buffer[i].PidCount = processes.Rows.at(i).PidCount;
 					for (int j = 0; j < SIZEOF(buffer->Pid); ++j)
 					{
-						if (processes.at(i)->Pid[j] != 0)
-							buffer[i].Pid[index++] = processes.at(i)->Pid[j];
+						if (processes.Rows.at(i).Pid[j] != 0)
+							buffer[i].Pid[index++] = processes.Rows.at(i).Pid[j];
 					}
 					byteIO += sizeof(buffer[i]);
 					index = 0;
@@ -263,20 +293,21 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 			auto len = stack->Parameters.DeviceIoControl.InputBufferLength;
 			auto _size = len / sizeof(ProcessInfo);
 
-			if (_size > allProcesses.size())
-				_size = allProcesses.size();
-
 			auto index = 0;
 			{
-				AutoLock lock(mutex);
+				// Concurrent callers copy in parallel, only writers wait
+				SharedLock lock(procLock);
+				if (_size > allProcesses.Rows.size())
+					_size = allProcesses.Rows.size();
+
 				for (int i = 0; i < _size; ++i)
 				{
-					memcpy(buffer[i].Name, allProcesses.at(i)->Name, SIZEOF(buffer->Name));
-					buffer[i].PidCount = allProcesses.at(i)->PidCount;
+					memcpy(buffer[i].Name, allProcesses.Rows.at(i).Name, SIZEOF(buffer->Name));
+					buffer[i].PidCount = allProcesses.Rows.at(i).PidCount;
 					for (int j = 0; j < SIZEOF(buffer->Pid); ++j)
 					{
-						if (allProcesses.at(i)->Pid[j] != 0)
-							buffer[i].Pid[index++] = allProcesses.at(i)->Pid[j];
+						if (allProcesses.Rows.at(i).Pid[j] != 0)
+							buffer[i].Pid[index++] = allProcesses.Rows.at(i).Pid[j];
 					}
 					byteIO += sizeof(buffer[i]);
 					index = 0;
@@ -302,25 +333,23 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 				status = STATUS_INSUFFICIENT_RESOURCES;
 			else
 			{
-				for (int i = 0; i < allProcesses.size(); ++i)
+				auto len = strlen(name);
+				ExclusiveLock lock(procLock);
+				for (int i = 0; i < allProcesses.Rows.size(); ++i)
 				{
-					if (strstr(allProcesses.at(i)->Name, name))
+					auto& proc = allProcesses.Rows.at(i);
+					if (AsciiMatch(proc.Name, strnlen(proc.Name, SIZEOF(proc.Name)), name, len, Match::Contains))
 					{
-						for (int j = 0; j < SIZEOF(allProcesses.at(i)->Pid); ++j)
+						for (int j = 0; j < SIZEOF(allProcesses.Rows.at(i).Pid); ++j)
 						{
-							if (allProcesses.at(i)->Pid[j] != 0)
+							if (allProcesses.Rows.at(i).Pid[j] != 0)
 							{
-								HideByPid(allProcesses.at(i)->Pid[j]);
-								DbgMsg("%s (%u) hidden\n", allProcesses.at(i)->Name, allProcesses.at(i)->Pid[j]);
+								HideByPid(allProcesses.Rows.at(i).Pid[j]);
+								DbgMsg("%s (%u) hidden\n", allProcesses.Rows.at(i).Name, allProcesses.Rows.at(i).Pid[j]);
 							}
 						}
-						{
-							AutoLock lock(mutex);
-							ExFreePool(allProcesses.at(i));
-							allProcesses.at(i) = nullptr;
-							allProcesses.at(i) = allProcesses.at(allProcesses.size() - 1);
-							allProcesses.pop_back();
-						}
+						// The last entry moves into i, look at it again
+						EraseProcess(allProcesses.Rows.handle_at(i--), allProcesses);
 					}
 				}
 				status = STATUS_SUCCESS;
@@ -342,18 +371,20 @@ NTSTATUS IoControl(PDEVICE_OBJECT, PIRP Irp)
 	return IrpComplete(Irp, status, byteIO);
 }
 
-void FindProcess(const char* name, vector<ProcessInfo*>& vec)
+void FindProcess(const char* name, ProcessTable& table)
 {
 	auto sysProcess = PsInitialSystemProcess;
 	auto curProcess = sysProcess;
 	bool access = true;
+	auto nameLen = name ? strlen(name) : 0;
 
 	do
 	{
-		const CHAR* const curName = (CHAR*)((uintptr_t)curProcess + 0x5a8);
+		// ImageFileName is a CHAR[15], not always terminated
+		auto curName = StringView::bounded((CHAR*)((uintptr_t)curProcess + 0x5a8), sizeof(ProcessInfo::Name));
 		if (name)
 		{
-			if (strstr(curName, name))
+			if (AsciiMatch(curName.data(), curName.size(), name, nameLen, Match::Contains))
 				access = true;
 			else
 				access = false;
@@ -365,41 +396,20 @@ void FindProcess(const char* name, vector<ProcessInfo*>& vec)
 			if (activeThreads)
 			{
 				auto pid = *((ULONG*)((uintptr_t)curProcess + 0x440));
-				auto proc = RetProcByName(curName, vec);
-				if (proc)
-				{
-					AutoLock lock(mutex);
-					if (!FindPid(pid, proc) && proc->PidCount < SIZEOF(proc->Pid))
-					{
-						for (int i = 0; i < SIZEOF(proc->Pid); ++i)
-						{
-							if (proc->Pid[i] == 0)
-							{
-								proc->Pid[i] = pid;
-								++proc->PidCount;
-								break;
-							}
-						}
-					}
-				}
-				else
+				// Lookup and insert under one lock, or two callers could both add the name
+				ExclusiveLock lock(procLock);
+				SlotHandle handle{};
+				auto proc = RetProcByName(curName, table, handle);
+				if (!proc)
 				{
-					auto ptr = (ProcessInfo*)ExAllocatePool2(POOL_FLAG_PAGED, sizeof(ProcessInfo), DRIVER_TAG);
-					if (!ptr)
+					proc = InsertProcess(curName, table);
+					if (!proc)
 					{
 						DbgMsg("(FindProcessByName) -> failed allocation\n");
 						return;
 					}
-					else
-					{
-						AutoLock lock(mutex);
-						RtlZeroMemory(ptr, sizeof(ProcessInfo));
-						RtlCopyMemory(ptr->Name, curName, SIZEOF(ptr->Name));
-						*ptr->Pid = pid;
-						++ptr->PidCount;
-						vec.push_back(ptr);
-					}
 				}
+				AddPid(pid, proc);
 			}
 		}
 
@@ -409,18 +419,61 @@ void FindProcess(const char* name, vector<ProcessInfo*>& vec)
 	} while (curProcess != sysProcess);
 }
 
-ProcessInfo* RetProcByName(const char* name, vector<ProcessInfo*>& vec, int& index)
+// Under an exclusive procLock, held across whatever the caller does with the row
+ProcessInfo* RetProcByName(StringView name, ProcessTable& table, SlotHandle& handle)
 {
-	AutoLock lock(mutex);
-	for (int i = 0; i < vec.size(); ++i)
+	ASSERT(procLock.Owned());
+	// No atom means no row has the name, Find takes no reference
+	auto atom = atoms.Find(name.data(), name.size());
+	auto indexed = atom ? table.ByName.Find(atom) : nullptr;
+	if (!indexed)
+		return nullptr;
+	handle = *indexed;
+	return table.Rows.get(handle);
+}
+
+// Under an exclusive procLock, the caller checked the name isn't in the table
+ProcessInfo* InsertProcess(StringView name, ProcessTable& table)
+{
+	ASSERT(procLock.Owned());
+	auto atom = atoms.Add(name.data(), name.size());
+	if (!atom)
+		return nullptr;
+
+	auto handle = table.Rows.insert();
+	auto proc = table.Rows.get(handle);
+	if (!proc || !table.ByName.Insert(atom, handle))
 	{
-		if (strstr((char*)vec.at(i)->Name, name))
-		{
-			index = i;
-			return vec.at(i);
-		}
+		if (proc)
+			table.Rows.erase(handle);
+		atoms.Release(atom);
+		return nullptr;
 	}
-	return nullptr;
+	// The row starts zeroed, a 15 character name stays unterminated like ImageFileName
+	RtlCopyMemory(proc->Name, name.data(), name.size());
+	return proc;
+}
+
+// Under an exclusive procLock
+void EraseProcess(SlotHandle handle, ProcessTable& table)
+{
+	ASSERT(procLock.Owned());
+	auto proc = table.Rows.get(handle);
+	if (!proc)
+		return;
+	auto atom = atoms.Find(proc->Name, strnlen(proc->Name, SIZEOF(proc->Name)));
+	if (atom && table.ByName.Erase(atom))
+		atoms.Release(atom);
+	table.Rows.erase(handle);
+}
+
+// Under an exclusive procLock
+void ClearProcesses(ProcessTable& table)
+{
+	ASSERT(procLock.Owned());
+	table.ByName.ForEach([](const Atom& atom, SlotHandle&) { atoms.Release(atom); });
+	table.ByName.Clear();
+	table.Rows.clear();
 }
 
 bool FindPid(ULONG pid, ProcessInfo* process)
@@ -433,6 +486,23 @@ bool FindPid(ULONG pid, ProcessInfo* process)
 	return false;
 }
 
+bool AddPid(ULONG pid, ProcessInfo* proc)
+{
+	if (proc && !FindPid(pid, proc) && proc->PidCount < SIZEOF(proc->Pid))
+	{
+		for (int i = 0; i < SIZEOF(proc->Pid); ++i)
+		{
+			if (proc->Pid[i] == 0)
+			{
+				proc->Pid[i] = pid;
+				++proc->PidCount;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 bool RemovePid(ULONG pid, ProcessInfo* proc)
 
 {
@@ -463,42 +533,22 @@ void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateI
 			PsLookupProcessByProcessId(ProcessId, &process);
 			const CHAR* const name = (CHAR*)((uintptr_t)process + 0x5a8);
 			auto pid = HandleToULong(ProcessId);
-			auto proc = RetProcByName(name, allProcesses);
-			if (proc != nullptr)
-			{
-				AutoLock lock(mutex);
-				if (!FindPid(pid, proc) && proc->PidCount < SIZEOF(proc->Pid))
-				{
-					for (int i = 0; i < SIZEOF(proc->Pid); ++i)
-					{
-						if (proc->Pid[i] == 0)
-						{
-							proc->Pid[i] = pid;
-							++proc->PidCount;
-							DbgMsg("PID: (%u) added [%s]\n", pid, name);
-							break;
-						}
-					}
-				}
-			}
-			else
+			auto procName = StringView::bounded(name, sizeof(ProcessInfo::Name));
 			{
-				auto ptr = (ProcessInfo*)ExAllocatePool2(POOL_FLAG_PAGED, sizeof(ProcessInfo), DRIVER_TAG);
-				if (!ptr)
+				ExclusiveLock lock(procLock);
+				SlotHandle handle{};
+				if (auto proc = RetProcByName(procName, allProcesses, handle))
 				{
-					DbgMsg("(OnProcessNotify) -> failed allocation\n");
-					return;
+					if (AddPid(pid, proc))
+						DbgMsg("PID: (%u) added [%s]\n", pid, name);
 				}
-				else
+				else if (auto ptr = InsertProcess(procName, allProcesses))
 				{
-					AutoLock lock(mutex);
-					RtlZeroMemory(ptr, sizeof(ProcessInfo));
-					RtlCopyMemory(ptr->Name, name, SIZEOF(ptr->Name));
-					*ptr->Pid = pid;
-					++ptr->PidCount;
-					allProcesses.push_back(ptr);
+					AddPid(pid, ptr);
 					DbgMsg("First -> PID: (%u) added [%s]\n", pid, ptr->Name);
 				}
+				else
+					DbgMsg("(OnProcessNotify) -> failed allocation\n");
 			}
 			ObDereferenceObject(process);
 		}
@@ -506,27 +556,21 @@ void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateI
 		{
 			const CHAR* const name = (CHAR*)((uintptr_t)PsGetCurrentProcess() + 0x5a8);
 			auto pid = *((ULONG*)((uintptr_t)PsGetCurrentProcess() + 0x440));
-			int index{};
-			auto proc = RetProcByName(name, allProcesses, index);
-			if (proc != nullptr)
+			ExclusiveLock lock(procLock);
+			SlotHandle handle{};
+			auto proc = RetProcByName(StringView::bounded(name, sizeof(ProcessInfo::Name)), allProcesses, handle);
+			if (!proc)
+				DbgMsg("(HIDDEN)PID: (%u) removed [%s]\n", pid, name);
+			else if (proc->PidCount > 1)
 			{
-				AutoLock lock(mutex);
-				if (proc->PidCount > 1)
-				{
-					if (RemovePid(pid, proc))
-						DbgMsg("PID: (%u) removed [%s]\n", pid, name);
-				}
-				else
-				{
-					DbgMsg("Last -> PID: (%u) removed [%s]\n", pid, allProcesses.at(index)->Name);
-					ExFreePool(allProcesses.at(index));
-					allProcesses.at(index) = nullptr;
-					allProcesses.at(index) = allProcesses.at(allProcesses.size() - 1);
-					allProcesses.pop_back();
-				}
+				if (RemovePid(pid, proc))
+					DbgMsg("PID: (%u) removed [%s]\n", pid, name);
 			}
 			else
-				DbgMsg("(HIDDEN)PID: (%u) removed [%s]\n", pid, name);
+			{
+				DbgMsg("Last -> PID: (%u) removed [%s]\n", pid, proc->Name);
+				EraseProcess(handle, allProcesses);
+			}
 		}
 	}
 	__except (EXCEPTION_EXECUTE_HANDLER)
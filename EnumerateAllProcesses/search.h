@@ -0,0 +1,160 @@
+#pragma once
+#include <ntddk.h>
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
+
+
+/*
+	ASCII string matching with optional case folding, for process and image names.
+
+		AsciiMatch(proc.Name, strnlen(proc.Name, 15), "notepad.exe", 11, Match::Equals);
+
+	Equals, Prefix and Contains are separate modes, strstr only has the last one.
+	By default 'A'-'Z' match 'a'-'z', other bytes (including anything above
+	0x7F) have to match exactly.
+
+	On x64 everything goes 16 bytes at a time with SSE2. Contains checks the
+	first and the last byte of the pattern at 16 positions at once and only
+	compares the rest where both match, so a miss on a 15 byte ImageFileName
+	costs a couple of loads and compares. Strings shorter than 16 bytes are loaded
+	whole when that can't cross into the next page, so they don't fall back to a
+	byte loop. Other architectures use the plain loops.
+*/
+
+enum class Match
+{
+	Equals,
+	Prefix,
+	Contains
+};
+
+constexpr size_t AsciiNotFound{ ~size_t(0) };
+
+constexpr CHAR AsciiLower(CHAR c) { return c >= 'A' && c <= 'Z' ? CHAR(c + ('a' - 'A')) : c; }
+
+bool AsciiEquals(const CHAR* a, const CHAR* b, size_t len, bool ignoreCase = true);
+bool AsciiStartsWith(const CHAR* str, size_t len, const CHAR* prefix, size_t prefixLen, bool ignoreCase = true);
+// Position of the first pattern in str, AsciiNotFound if there isn't one
+size_t AsciiFind(const CHAR* str, size_t len, const CHAR* pattern, size_t patternLen, bool ignoreCase = true);
+bool AsciiMatch(const CHAR* str, size_t len, const CHAR* pattern, size_t patternLen, Match mode, bool ignoreCase = true);
+
+
+#if defined(_M_AMD64)
+inline __m128i AsciiFold16(__m128i v, bool ignoreCase)
+{
+	if (!ignoreCase)
+		return v;
+
+	// Signed compares, bytes above 0x7F are negative and never in range
+	auto upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+// First n (<= 16) bytes of p, zeros after them. Reads the full 16 bytes when
+// they're all on p's page, which is mapped since p is
+inline __m128i AsciiLoad16(const CHAR* p, size_t n)
+{
+	if (n >= 16)
+		return _mm_loadu_si128((const __m128i*)p);
+
+	__m128i v;
+	if (((ULONG_PTR)p & (PAGE_SIZE - 1)) <= PAGE_SIZE - 16)
+		v = _mm_loadu_si128((const __m128i*)p);
+	else
+	{
+		alignas(16) CHAR tmp[16]{};
+		for (size_t i = 0; i < n; ++i)
+			tmp[i] = p[i];
+		return _mm_load_si128((const __m128i*)tmp);
+	}
+
+	auto lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	return _mm_and_si128(v, _mm_cmpgt_epi8(_mm_set1_epi8((CHAR)n), lanes));
+}
+#endif
+
+
+inline bool AsciiEquals(const CHAR* a, const CHAR* b, size_t len, bool ignoreCase)
+{
+#if defined(_M_AMD64)
+	for (size_t i = 0; i < len; i += 16)
+	{
+		auto n = len - i;
+		auto va = AsciiFold16(AsciiLoad16(a + i, n), ignoreCase);
+		auto vb = AsciiFold16(AsciiLoad16(b + i, n), ignoreCase);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+			return false;
+	}
+	return true;
+#else
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (ignoreCase ? AsciiLower(a[i]) != AsciiLower(b[i]) : a[i] != b[i])
+			return false;
+	}
+	return true;
+#endif
+}
+
+
+inline bool AsciiStartsWith(const CHAR* str, size_t len, const CHAR* prefix, size_t prefixLen, bool ignoreCase)
+{
+	return prefixLen <= len && AsciiEquals(str, prefix, prefixLen, ignoreCase);
+}
+
+
+inline size_t AsciiFind(const CHAR* str, size_t len, const CHAR* pattern, size_t patternLen, bool ignoreCase)
+{
+	if (!patternLen)
+		return 0;
+	if (patternLen > len)
+		return AsciiNotFound;
+
+	// Every position a match can start at
+	auto starts = len - patternLen + 1;
+
+#if defined(_M_AMD64)
+	auto first = _mm_set1_epi8(ignoreCase ? AsciiLower(pattern[0]) : pattern[0]);
+	auto last = _mm_set1_epi8(ignoreCase ? AsciiLower(pattern[patternLen - 1]) : pattern[patternLen - 1]);
+
+	for (size_t i = 0; i < starts; i += 16)
+	{
+		auto n = starts - i;
+		auto f = _mm_cmpeq_epi8(AsciiFold16(AsciiLoad16(str + i, n), ignoreCase), first);
+		auto l = _mm_cmpeq_epi8(AsciiFold16(AsciiLoad16(str + i + patternLen - 1, n), ignoreCase), last);
+
+		ULONG mask = _mm_movemask_epi8(_mm_and_si128(f, l));
+		if (n < 16)
+			mask &= (1ul << n) - 1;
+
+		for (ULONG bit{}; _BitScanForward(&bit, mask); mask &= mask - 1)
+		{
+			if (patternLen <= 2 || AsciiEquals(str + i + bit + 1, pattern + 1, patternLen - 2, ignoreCase))
+				return i + bit;
+		}
+	}
+#else
+	for (size_t i = 0; i < starts; ++i)
+	{
+		if (AsciiEquals(str + i, pattern, patternLen, ignoreCase))
+			return i;
+	}
+#endif
+	return AsciiNotFound;
+}
+
+
+inline bool AsciiMatch(const CHAR* str, size_t len, const CHAR* pattern, size_t patternLen, Match mode, bool ignoreCase)
+{
+	switch (mode)
+	{
+	case Match::Equals:
+		return len == patternLen && AsciiEquals(str, pattern, len, ignoreCase);
+	case Match::Prefix:
+		return AsciiStartsWith(str, len, pattern, patternLen, ignoreCase);
+	default:
+		return AsciiFind(str, len, pattern, patternLen, ignoreCase) != AsciiNotFound;
+	}
+}
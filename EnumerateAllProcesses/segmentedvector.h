@@ -0,0 +1,162 @@
+#pragma once
+#include <ntddk.h>
+
+#ifndef __PLACEMENT_NEW_INLINE
+#define __PLACEMENT_NEW_INLINE
+inline void* operator new(size_t, void* where) noexcept { return where; }
+inline void operator delete(void*, void*) noexcept {}
+#endif // !__PLACEMENT_NEW_INLINE
+#include "poolpolicy.h"
+
+#ifndef DbgMsg
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+#endif // !DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
+
+
+
+/*
+	Vector made of page-sized blocks, elements never move once they're in.
+
+	The block directory is a fixed array inside the object, so appending only ever
+	adds a block and fills a slot, a ProcessInfo* or an index taken from it stays
+	valid until that very element is popped or the vector is freed. That makes it
+	fine to keep a pointer across a lock release, which vector<T> can't promise.
+
+	One writer at a time (the caller's lock), any number of readers without it:
+	the writer constructs the element and stores the block pointer first, then
+	publishes the new size with release semantics, so a reader that sees index
+	< size() also sees the finished element. Readers must not race pop_back/free.
+
+	_maxBlocks * _perBlock is the hard limit, push_back returns false (emplace_back
+	nullptr) past it or when the pool is out of memory. Blocks come from Policy
+	(PoolPolicy.h, non-paged pool by default) and are only given back by free().
+*/
+
+template <typename T, typename Policy = NonPagedPolicy>
+class segmented_vector
+{
+public:
+	static constexpr int _perBlock{ sizeof(T) < PAGE_SIZE ? int(PAGE_SIZE / sizeof(T)) : 1 };
+	static constexpr int _maxBlocks{ 256 };
+
+	T& operator[](int index) { return _blocks[index / _perBlock][index % _perBlock]; }
+	const T& operator[](int index) const { return _blocks[index / _perBlock][index % _perBlock]; }
+
+	T& at(int index);
+
+	// Safe to call without the writer's lock
+	int size() const noexcept { return ReadAcquire(&_size); }
+	constexpr int capacity() const noexcept { return _blockCount * _perBlock; }
+
+	bool push_back(const T& value) { return emplace_back(value) != nullptr; }
+	bool push_back(T&& value) { return emplace_back(static_cast<T&&>(value)) != nullptr; }
+	template <typename... Args>
+	T* emplace_back(Args&&... args);
+	void pop_back();
+
+	// Calls f(T&) on every element that was published when it started
+	template <typename F>
+	void for_each(F&& f);
+
+	void free();
+
+private:
+	bool grow();
+
+private:
+	T* _blocks[_maxBlocks]{};
+	LONG volatile _size{ 0 };
+	int _blockCount{ 0 };
+
+	static_assert(alignof(T) <= MEMORY_ALLOCATION_ALIGNMENT, "segmented_vector<T> only supports T aligned up to MEMORY_ALLOCATION_ALIGNMENT");
+};
+
+
+template <typename T, typename Policy>
+T& segmented_vector<T, Policy>::at(int index)
+{
+	ASSERT(index >= 0 && index < size());
+	return (*this)[index];
+}
+
+
+template <typename T, typename Policy>
+template <typename... Args>
+T* segmented_vector<T, Policy>::emplace_back(Args&&... args)
+{
+	auto size = (int)_size;
+	if (size == capacity() && !grow())
+		return nullptr;
+
+	auto elem = new (&_blocks[size / _perBlock][size % _perBlock]) T(static_cast<Args&&>(args)...);
+	WriteRelease(&_size, size + 1);
+	return elem;
+}
+
+
+template <typename T, typename Policy>
+void segmented_vector<T, Policy>::pop_back()
+{
+	auto size = (int)_size;
+	if (size == 0)
+		return;
+
+	WriteRelease(&_size, size - 1);
+	if constexpr (!__is_trivially_destructible(T))
+		(*this)[size - 1].~T();
+}
+
+
+template <typename T, typename Policy>
+template <typename F>
+void segmented_vector<T, Policy>::for_each(F&& f)
+{
+	auto size = this->size();
+	for (int b = 0; b * _perBlock < size; ++b)
+	{
+		auto block = _blocks[b];
+		auto count = size - b * _perBlock < _perBlock ? size - b * _perBlock : _perBlock;
+		for (int i = 0; i < count; ++i)
+			f(block[i]);
+	}
+}
+
+
+template <typename T, typename Policy>
+bool segmented_vector<T, Policy>::grow()
+{
+	if (_blockCount == _maxBlocks)
+	{
+		DbgMsg("bool segmented_vector<T>::grow() -> all %d blocks in use\n", _maxBlocks);
+		return false;
+	}
+
+	auto block = (T*)Policy::Allocate(_perBlock * sizeof(T), 'geSV');
+	if (!block)
+	{
+		DbgMsg("bool segmented_vector<T>::grow() -> failed allocation\n");
+		return false;
+	}
+
+	// Readers only look at blocks below size(), which is published after this
+	_blocks[_blockCount++] = block;
+	return true;
+}
+
+
+template <typename T, typename Policy>
+void segmented_vector<T, Policy>::free()
+{
+	while (_size > 0)
+		pop_back();
+
+	for (int b = 0; b < _blockCount; ++b)
+	{
+		Policy::Free(_blocks[b], _perBlock * sizeof(T));
+		_blocks[b] = nullptr;
+	}
+
+	if (_blockCount)
+		DbgMsg("void segmented_vector<T>::free() -> %d blocks freed\n", _blockCount);
+	_blockCount = 0;
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include "fastmutex.h"
+#include "intrusivelist.h"
+#include "stringview.h"
+#include "common.h"
 
 
 #define DbgMsg(x, ...) DbgPrintEx(0, 0, x, __VA_ARGS__)
@@ -15,8 +18,8 @@ NTSTATUS IrpComplete(PIRP Irp, NTSTATUS Status = STATUS_SUCCESS, ULONG_PTR Info
 void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo);
 void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create);
 void ImageLoadCallback(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo);
-void PushItem(LIST_ENTRY* entry);
-bool FindDllExePos(PANSI_STRING str, USHORT& index, USHORT& len);
+// The image name part of a path or command line, name points into str
+bool FindDllExePos(PCUNICODE_STRING str, WStringView& name);
 
 template <typename T>
 struct FullItem
@@ -25,9 +28,19 @@ struct FullItem
 	T Data;
 };
 
+void PushItem(FullItem<ItemHeader>* item);
+
+// Every FullItem<T> starts like a FullItem<ItemHeader>, which is what the queue holds
+template <typename T>
+void PushItem(FullItem<T>* item)
+{
+	static_assert(__is_base_of(ItemHeader, T), "queued items start with an ItemHeader");
+	static_assert(offsetof(FullItem<T>, Data) == offsetof(FullItem<ItemHeader>, Data));
+	PushItem((FullItem<ItemHeader>*)item);
+}
+
 struct Globals
 {
-	LIST_ENTRY ItemsHead;
-	USHORT ItemsCount;
+	IntrusiveList<FullItem<ItemHeader>, &FullItem<ItemHeader>::Entry> Items;
 	FastMutex Mutex;
-};
\ No newline at end of file
+};
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "data.h"
 #include "common.h"
 #include "autolock.h"
+#include "transcode.h"
 
 
 Globals _globals;
@@ -10,7 +11,7 @@ Globals _globals;
 extern "C"
 NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING)
 {
-	InitializeListHead(&_globals.ItemsHead);
+	_globals.Items.Init();
 	_globals.Mutex.Init();
 
 	auto status = STATUS_SUCCESS;
@@ -95,11 +96,8 @@ void UnloadDriver(PDRIVER_OBJECT pDriverObject)
 	IoDeleteSymbolicLink(&dos);
 	IoDeleteDevice(pDriverObject->DeviceObject);
 
-	while (!IsListEmpty(&_globals.ItemsHead))
-	{
-		auto entry = RemoveHeadList(&_globals.ItemsHead);
-		ExFreePool(CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry));
-	}
+	while (auto item = _globals.Items.PopFront())
+		ExFreePool(item);
 
 	DbgMsg("Driver unloaded\n");
 }
@@ -126,7 +124,7 @@ NTSTATUS CreateClose(PDEVICE_OBJECT, PIRP Irp)
 		DbgMsg("Handle to SymbolicLink %wZ closed\n", dos);
 		break;
 
-	default:
+	default:
 		break;
 	}
 
@@ -147,21 +145,13 @@ NTSTATUS Read(PDEVICE_OBJECT, PIRP Irp)
 	else
 	{
 		AutoLock lock(_globals.Mutex);
-		while (true)
+		while (auto item = _globals.Items.Front())
 		{
-			if (IsListEmpty(&_globals.ItemsHead))
-				break;
-
-			auto entry = RemoveHeadList(&_globals.ItemsHead);
-			auto item = CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry);
 			auto size = item->Data.Size;
-
 			if (len < size)
-			{
-				InsertHeadList(&_globals.ItemsHead, entry);
 				break;
-			}
-			--_globals.ItemsCount;
+
+			_globals.Items.PopFront();
 
 			memcpy(buffer, &item->Data, size);
 			len -= size;
@@ -179,33 +169,19 @@ void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateI
 	if (CreateInfo)
 	{
 		USHORT allocSize = sizeof(FullItem<ProcessCreateInfo>);
-		USHORT CommandLineSize = 0, index = 0;
-		ANSI_STRING str{};
+		USHORT CommandLineSize = 0;
+		WStringView exe;
+		auto cmd = CreateInfo->CommandLine;
 
-		if (CreateInfo->CommandLine)
+		if (cmd)
 		{
-			UNICODE_STRING tmp{};
-			tmp.Buffer = (PWCH)ExAllocatePoolWithTag(PagedPool, CreateInfo->CommandLine->Length, DRIVER_TAG);
-			if (!tmp.Buffer)
+			if (!FindDllExePos(cmd, exe))
 				return;
 
-			tmp.MaximumLength = CreateInfo->CommandLine->Length;
-			RtlCopyUnicodeString(&tmp, CreateInfo->CommandLine);
-			if (!NT_SUCCESS(RtlUnicodeStringToAnsiString(&str, &tmp, TRUE)))
-			{
-				ExFreePool(tmp.Buffer);
-				return;
-			}
-			ExFreePool(tmp.Buffer);
-
-			USHORT len{};
-			if (!FindDllExePos(&str, index, len))
-			{
-				RtlFreeAnsiString(&str);
-				return;
-			}
-
-			CommandLineSize = len;
+			// UTF-8 straight from the command line into the item, no copies in between
+			size_t bytes{};
+			Utf16ToUtf8(exe.data(), exe.size(), nullptr, 0, &bytes);
+			CommandLineSize = (USHORT)bytes;
 			allocSize += CommandLineSize + 1;
 		}
 
@@ -225,18 +201,18 @@ void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateI
 		item.ParentProcessId = HandleToULong(CreateInfo->ParentProcessId);
 		item.Size = sizeof(ProcessCreateInfo) + CommandLineSize + 1;
 
-		if (!str.Buffer || !(CommandLineSize > 0))
+		if (!cmd || !(CommandLineSize > 0))
 		{
-			RtlFreeAnsiString(&str);
+			ExFreePool(info);
 			return;
 		}
 
-		memcpy((UCHAR*)&item + sizeof(ProcessCreateInfo), &str.Buffer[index], CommandLineSize);
+		size_t bytes{};
+		Utf16ToUtf8(exe.data(), exe.size(), (CHAR*)&item + sizeof(ProcessCreateInfo), CommandLineSize, &bytes);
 		item.CommandLineLength = CommandLineSize;
 		item.CommandLineOffset = sizeof(item);
 
-		RtlFreeAnsiString(&str);
-		PushItem(&info->Entry);
+		PushItem(info);
 	}
 	else
 	{
@@ -255,7 +231,7 @@ void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateI
 		item.ProcessId = HandleToULong(ProcessId);
 		item.Size = sizeof(ProcessExitInfo);
 
-		PushItem(&info->Entry);
+		PushItem(info);
 	}
 }
 
@@ -277,69 +253,49 @@ void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create)
 	item.Size = sizeof(item);
 	item.Type = Create ? ItemType::ThreadCreate : ItemType::ThreadExit;
 
-	PushItem(&info->Entry);
+	PushItem(info);
 }
 
 void ImageLoadCallback(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo)
 {
 	UNREFERENCED_PARAMETER(FullImageName);
 	USHORT allocSize = sizeof(FullItem<ImageLoadInfo>);
-	USHORT imageNameSize = 0, dllNameSize = 0, nameIndex = 0, dllIndex = 0;
-	ANSI_STRING dll{}, name{};
+	USHORT imageNameSize = 0, dllNameSize = 0;
+	WStringView imageName, dllName;
+	PUNICODE_STRING name{ nullptr };
+	PCUNICODE_STRING dll{ nullptr };
 	//if (FullImageName)
 	{
-		PUNICODE_STRING tmp{ nullptr };
 		PEPROCESS process{ nullptr };
-		IMAGE_INFO_EX* exInfo{ nullptr };		UNICODE_STRING fileName{};
+		IMAGE_INFO_EX* exInfo{ nullptr };
 
 		if (!NT_SUCCESS(PsLookupProcessByProcessId(ProcessId, &process)))
 			return;
-		if (!NT_SUCCESS(SeLocateProcessImageName(process, &tmp)))
+		if (!NT_SUCCESS(SeLocateProcessImageName(process, &name)))
 		{
 			ObDereferenceObject(process);
 			return;
 		}
 		ObDereferenceObject(process);
 
-		auto size{ 0 };
-		if (ImageInfo->ExtendedInfoPresent)		{
+		if (ImageInfo->ExtendedInfoPresent)
+		{
 			exInfo = CONTAINING_RECORD(ImageInfo, IMAGE_INFO_EX, ImageInfo);
-			size = tmp->Length > exInfo->FileObject->FileName.Length ?
-				tmp->Length : exInfo->FileObject->FileName.Length;
-			fileName.Buffer = (PWCH)ExAllocatePoolWithTag(PagedPool,
-				size, DRIVER_TAG);
-			if (!fileName.Buffer)
-				return;
-
-			fileName.MaximumLength = tmp->Length;
-			RtlCopyUnicodeString(&fileName, tmp);
-			if (!NT_SUCCESS(RtlUnicodeStringToAnsiString(&name, &fileName, TRUE)))
-			{
-				ExFreePool(fileName.Buffer);
-				return;
-			}
-
-			fileName.MaximumLength = exInfo->FileObject->FileName.Length;
-			RtlCopyUnicodeString(&fileName, &exInfo->FileObject->FileName);
-			if (!NT_SUCCESS(RtlUnicodeStringToAnsiString(&dll, &fileName, TRUE)))
-			{
-				RtlFreeAnsiString(&name);
-				ExFreePool(fileName.Buffer);
-				return;
-			}
-			ExFreePool(fileName.Buffer);
+			dll = &exInfo->FileObject->FileName;
 
-			USHORT nameLen = 0, dllLen = 0;
-			if (!FindDllExePos(&name, nameIndex, nameLen)
-				|| !FindDllExePos(&dll, dllIndex, dllLen))
+			if (!FindDllExePos(name, imageName)
+				|| !FindDllExePos(dll, dllName))
 			{
-				RtlFreeAnsiString(&name);
-				RtlFreeAnsiString(&dll);
+				ExFreePool(name);
 				return;
 			}
 
-			imageNameSize = nameLen;
-			dllNameSize = dllLen;
+			// Both names go into the item as UTF-8 below, this only sizes them
+			size_t bytes{};
+			Utf16ToUtf8(imageName.data(), imageName.size(), nullptr, 0, &bytes);
+			imageNameSize = (USHORT)bytes;
+			Utf16ToUtf8(dllName.data(), dllName.size(), nullptr, 0, &bytes);
+			dllNameSize = (USHORT)bytes;
 			allocSize += imageNameSize + dllNameSize + 2;
 		}
 	}
@@ -349,6 +305,7 @@ void ImageLoadCallback(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_I
 	if (!info)
 	{
 		DbgMsg("(ImageLoadCallback) -> failed allocation\n");
+		ExFreePool(name);
 		return;
 	}
 
@@ -359,62 +316,49 @@ void ImageLoadCallback(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_I
 	item.Type = ItemType::ImageLoad;
 	item.Size = sizeof(ImageLoadInfo) + imageNameSize + dllNameSize + 2;
 
-	if (!name.Buffer || !dll.Buffer || !(imageNameSize > 0) || !(dllNameSize > 0))
+	if (!dll || !(imageNameSize > 0) || !(dllNameSize > 0))
 	{
-		RtlFreeAnsiString(&name);
-		RtlFreeAnsiString(&dll);
+		ExFreePool(info);
+		ExFreePool(name);
 		return;
 	}
 
-	memcpy((UCHAR*)&item + sizeof(ImageLoadInfo), &name.Buffer[nameIndex], imageNameSize);
-	memcpy((UCHAR*)&item + sizeof(ImageLoadInfo) + imageNameSize + 1, &dll.Buffer[dllIndex], dllNameSize);
+	size_t bytes{};
+	Utf16ToUtf8(imageName.data(), imageName.size(), (CHAR*)&item + sizeof(ImageLoadInfo), imageNameSize, &bytes);
+	Utf16ToUtf8(dllName.data(), dllName.size(), (CHAR*)&item + sizeof(ImageLoadInfo) + imageNameSize + 1, dllNameSize, &bytes);
 	item.ImageNameLength = imageNameSize;
 	item.ImageNameOffset = sizeof(ImageLoadInfo);
 	item.DllNameLength = dllNameSize;
 	item.DllNameOffset = sizeof(ImageLoadInfo) + imageNameSize + 1;
 
-	RtlFreeAnsiString(&name);
-	RtlFreeAnsiString(&dll);
-		
-	PushItem(&info->Entry);
+	ExFreePool(name);
+	PushItem(info);
 }
 
-void PushItem(LIST_ENTRY* entry)
+void PushItem(FullItem<ItemHeader>* item)
 {
 	AutoLock lock(_globals.Mutex);
-	if (_globals.ItemsCount > 1024)
-	{
-		auto item = RemoveHeadList(&_globals.ItemsHead);
-		--_globals.ItemsCount;
-		ExFreePool(CONTAINING_RECORD(item, FullItem<ItemHeader>, Entry));
-	}
-	InsertTailList(&_globals.ItemsHead, entry);
-	++_globals.ItemsCount;
+	if (_globals.Items.Size() > 1024)
+		ExFreePool(_globals.Items.PopFront());
+	_globals.Items.PushBack(item);
 }
 
-bool FindDllExePos(PANSI_STRING str, USHORT& index, USHORT& len)
+bool FindDllExePos(PCUNICODE_STRING str, WStringView& name)
 {
-	if (str->Buffer)
+	// First ".dll"/".exe" (in any case) and everything back to the '\\' before it
+	WStringView path{ str };
+	for (auto dot = path.find(L'.'); dot != WStringView::npos; dot = path.find(L'.', dot + 1))
 	{
-		for (USHORT i = 0; i < str->Length; ++i)
+		auto ext = path.substr(dot, 4);
+		if (!ext.equals_icase(L".dll") && !ext.equals_icase(L".exe"))
+			continue;
+
+		auto slash = path.rfind(L'\\', dot);
+		if (slash != WStringView::npos)
 		{
-			if (str->Buffer[i] == '.' && str->Buffer[i + 1] == 'd'
-				&& str->Buffer[i + 2] == 'l' && str->Buffer[i + 3] == 'l'
-				|| str->Buffer[i] == '.' && str->Buffer[i + 1] == 'e'
-				&& str->Buffer[i + 2] == 'x' && str->Buffer[i + 3] == 'e')
-			{
-				index = i;
-				len = 3;
-				for (;index > 0; --index)
-				{
-					++len;
-					if (str->Buffer[index - 1] == '\\')
-					{
-						return true;
-					}
-				}
-			}
+			name = path.substr(slash + 1, dot + 4 - (slash + 1));
+			return true;
 		}
 	}
 	return false;
-}
\ No newline at end of file
+}
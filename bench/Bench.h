@@ -0,0 +1,228 @@
+#pragma once
+#include <ntddk.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+
+/*
+	Small benchmark harness for the CustomFuncs headers, built against the
+	user-mode shim in shim/.
+
+		Bench bench(argc, argv);
+		bench.Run("vector<ULONG> push_back", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+		{
+			vector<ULONG> v;
+			t.Start();
+			for (ULONG64 i = 0; i < ops; ++i)
+				v.push_back(ULONG(i));
+			t.Stop();
+			v.free();
+		});
+
+	The body does ops operations. Only what's between Start and Stop is timed
+	(there can be more than one pair, they add up), a body that never calls
+	them is timed as a whole. Every benchmark runs _runs times and the fastest
+	run is reported, as ns/op and pool allocations/op (ExAllocatePool2,
+	MmAllocateNonCachedMemory and lookaside misses, counted by the shim).
+
+	RunThreads starts threads threads that each call body(ops, thread) at the
+	same moment, the whole thing is timed and divided by every op of every
+	thread, so a flat ns/op as threads are added means it scales.
+
+	Arguments:
+		--quick		ops / 100, what ctest runs to make sure nothing is broken
+		name		only benchmarks whose name contains it
+*/
+
+class Bench
+{
+public:
+	class Timing
+	{
+	public:
+		void Start();
+		void Stop();
+		// Every op handled this many items, report per item instead
+		void Items(ULONG64 count) { _items = count; }
+
+	private:
+		friend class Bench;
+		std::chrono::steady_clock::time_point _start{};
+		ULONG64 _allocsAtStart{ 0 };
+		ULONG64 _ns{ 0 };
+		ULONG64 _allocs{ 0 };
+		ULONG64 _items{ 1 };
+		bool _used{ false };
+	};
+
+	Bench(int argc, char** argv);
+
+	template <typename F>
+	void Run(const char* name, ULONG64 ops, F&& body);
+	template <typename F>
+	void RunThreads(const char* name, int threads, ULONG64 ops, F&& body);
+
+	// Header line of a group of benchmarks
+	void Section(const char* title);
+
+	bool Quick() const { return _quick; }
+
+	// xorshift64, the same sequence every run
+	class Random
+	{
+	public:
+		explicit Random(ULONG64 seed = 0x9E3779B97F4A7C15) : _state{ seed } {}
+		ULONG64 Next() { _state ^= _state << 13; _state ^= _state >> 7; _state ^= _state << 17; return _state; }
+		// [0, n)
+		ULONG64 Below(ULONG64 n) { return Next() % n; }
+
+	private:
+		ULONG64 _state;
+	};
+
+	// Keeps the compiler from dropping work whose result isn't used
+	template <typename T>
+	static void Keep(const T& value) { asm volatile("" : : "r"(&value) : "memory"); }
+
+private:
+	static constexpr int _runs{ 5 };
+
+	bool Skip(const char* name) const { return _filter && !strstr(name, _filter); }
+	void Report(const char* name, double ns, double allocs);
+
+	ULONG64 _divisor{ 1 };
+	bool _quick{ false };
+	const char* _filter{ nullptr };
+};
+
+
+
+inline void Bench::Timing::Start()
+{
+	_used = true;
+	_allocsAtStart = ShimPool::Allocs.load(std::memory_order_relaxed);
+	_start = std::chrono::steady_clock::now();
+}
+
+
+inline void Bench::Timing::Stop()
+{
+	auto end = std::chrono::steady_clock::now();
+	_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start).count();
+	_allocs += ShimPool::Allocs.load(std::memory_order_relaxed) - _allocsAtStart;
+}
+
+
+inline Bench::Bench(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--quick"))
+		{
+			_quick = true;
+			_divisor = 100;
+		}
+		else
+			_filter = argv[i];
+	}
+
+	printf("%-52s %12s %12s\n", "", "ns/op", "allocs/op");
+}
+
+
+inline void Bench::Section(const char* title)
+{
+	printf("\n%s\n", title);
+}
+
+
+template <typename F>
+void Bench::Run(const char* name, ULONG64 ops, F&& body)
+{
+	if (Skip(name))
+		return;
+
+	ops = ops / _divisor ? ops / _divisor : 1;
+
+	double bestNs{ 0 }, bestAllocs{ 0 };
+	for (int run = 0; run < _runs; ++run)
+	{
+		Timing timing;
+		auto start = std::chrono::steady_clock::now();
+		auto allocs = ShimPool::Allocs.load(std::memory_order_relaxed);
+
+		body(timing, ops);
+
+		if (!timing._used)
+		{
+			timing._ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			timing._allocs = ShimPool::Allocs.load(std::memory_order_relaxed) - allocs;
+		}
+
+		auto count = double(ops * timing._items);
+		auto ns = timing._ns / count;
+		if (run == 0 || ns < bestNs)
+		{
+			bestNs = ns;
+			bestAllocs = timing._allocs / count;
+		}
+	}
+
+	Report(name, bestNs, bestAllocs);
+}
+
+
+template <typename F>
+void Bench::RunThreads(const char* name, int threads, ULONG64 ops, F&& body)
+{
+	if (Skip(name))
+		return;
+
+	ops = ops / _divisor ? ops / _divisor : 1;
+
+	double bestNs{ 0 }, bestAllocs{ 0 };
+	for (int run = 0; run < _runs; ++run)
+	{
+		std::atomic<int> ready{ 0 };
+		std::atomic<bool> go{ false };
+		std::vector<std::thread> workers;
+		for (int thread = 0; thread < threads; ++thread)
+		{
+			workers.emplace_back([&, thread]
+			{
+				ready.fetch_add(1);
+				while (!go.load(std::memory_order_acquire))
+					std::this_thread::yield();
+				body(ops, thread);
+			});
+		}
+		while (ready.load() < threads)
+			std::this_thread::yield();
+
+		auto allocs = ShimPool::Allocs.load();
+		auto start = std::chrono::steady_clock::now();
+		go.store(true, std::memory_order_release);
+		for (auto& worker : workers)
+			worker.join();
+		auto end = std::chrono::steady_clock::now();
+
+		auto count = double(ops * threads);
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / count;
+		if (run == 0 || ns < bestNs)
+		{
+			bestNs = ns;
+			bestAllocs = (ShimPool::Allocs.load() - allocs) / count;
+		}
+	}
+
+	Report(name, bestNs, bestAllocs);
+}
+
+
+inline void Bench::Report(const char* name, double ns, double allocs)
+{
+	printf("  %-50s %12.2f %12.4f\n", name, ns, allocs);
+	fflush(stdout);
+}
@@ -0,0 +1,251 @@
+#include <ntddk.h>
+#include <vector>
+#include "Bench.h"
+#include "Vector.h"
+#include "WString.h"
+#include "Alloc.h"
+
+
+
+/*
+	vector push_back, Alloc/Free and WString construction, copy, move and
+	assignment. The strings are picked so each path is hit: "short" fits in
+	WString's inline buffer, "long" needs a pool buffer.
+*/
+
+static const WCHAR* const ShortName{ u"\\Device\\random" };
+static const WCHAR* const LongName{ u"\\Device\\HarddiskVolume3\\Windows\\System32\\drivers\\random.sys" };
+static const CHAR* const LongAnsiName{ "\\Device\\HarddiskVolume3\\Windows\\System32\\drivers\\random.sys" };
+
+
+static void VectorBenchmarks(Bench& bench)
+{
+	bench.Section("vector");
+
+	bench.Run("vector<ULONG> push_back", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		vector<ULONG> v;
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+			v.push_back(ULONG(i));
+		t.Stop();
+		v.free();
+	});
+
+	bench.Run("vector<ULONG> push_back after reserve", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		vector<ULONG> v;
+		t.Start();
+		v.reserve(int(ops));
+		for (ULONG64 i = 0; i < ops; ++i)
+			v.push_back(ULONG(i));
+		t.Stop();
+		v.free();
+	});
+
+	bench.Run("vector<WString> push_back (shared copy)", 100'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString name{ LongName };
+		vector<WString> v;
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+			v.push_back(name);
+		t.Stop();
+		v.free();
+	});
+}
+
+
+static void AllocBenchmarks(Bench& bench)
+{
+	bench.Section("Alloc / Free");
+
+	struct Size
+	{
+		const char* Alloc;
+		const char* Free;
+		size_t Bytes;
+	};
+	static constexpr Size sizes[]
+	{
+		{ "Alloc 64 B (slab)", "Free 64 B (slab)", 64 },
+		{ "Alloc 2 KB (pool)", "Free 2 KB (pool)", 2048 },
+	};
+
+	for (auto& size : sizes)
+	{
+		bench.Run(size.Alloc, 100'000, [&](Bench::Timing& t, ULONG64 ops)
+		{
+			std::vector<PVOID> blocks(ops);
+			t.Start();
+			for (auto& p : blocks)
+				p = Alloc(size.Bytes, POOL_FLAG_NON_PAGED, 'hcnB');
+			t.Stop();
+			for (auto& p : blocks)
+				Free(p);
+		});
+
+		bench.Run(size.Free, 100'000, [&](Bench::Timing& t, ULONG64 ops)
+		{
+			std::vector<PVOID> blocks(ops);
+			for (auto& p : blocks)
+				p = Alloc(size.Bytes, POOL_FLAG_NON_PAGED, 'hcnB');
+			t.Start();
+			for (auto& p : blocks)
+				Free(p);
+			t.Stop();
+		});
+	}
+
+	FreeAll();
+}
+
+
+static void WStringBenchmarks(Bench& bench)
+{
+	bench.Section("WString");
+
+	bench.Run("construct short", 1'000'000, [](Bench::Timing&, ULONG64 ops)
+	{
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ ShortName };
+			Bench::Keep(s);
+		}
+	});
+
+	bench.Run("construct long", 1'000'000, [](Bench::Timing&, ULONG64 ops)
+	{
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ LongName };
+			Bench::Keep(s);
+		}
+	});
+
+	bench.Run("construct long from ANSI", 1'000'000, [](Bench::Timing&, ULONG64 ops)
+	{
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ LongAnsiName };
+			Bench::Keep(s);
+		}
+	});
+
+	bench.Run("copy short", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString source{ ShortName };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ source };
+			Bench::Keep(s);
+		}
+		t.Stop();
+	});
+
+	bench.Run("copy long", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString source{ LongName };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ source };
+			Bench::Keep(s);
+		}
+		t.Stop();
+	});
+
+	bench.Run("move long", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString a{ LongName };
+		WString b{ LongName };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			// Back and forth, every move finds a buffer to take
+			b = MOVE(a);
+			a = MOVE(b);
+		}
+		t.Stop();
+		Bench::Keep(a);
+	});
+
+	bench.Run("assign long literal", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString s{ LongName };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			s = i & 1 ? LongName : ShortName;
+			Bench::Keep(s);
+		}
+		t.Stop();
+	});
+
+	bench.Run("assign WString (shared)", 1'000'000, [](Bench::Timing& t, ULONG64 ops)
+	{
+		WString a{ LongName };
+		WString b{ ShortName };
+		WString s{ ShortName };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			s = i & 1 ? a : b;
+			Bench::Keep(s);
+		}
+		t.Stop();
+	});
+
+	bench.Run("Append x4 after Reserve", 1'000'000, [](Bench::Timing&, ULONG64 ops)
+	{
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			WString s{ u"\\Device\\" };
+			s.Reserve(80);
+			s.Append(u"HarddiskVolume3");
+			s.Append(u"\\Windows\\System32");
+			s.Append(u"\\drivers");
+			s.Append(u"\\random.sys");
+			Bench::Keep(s);
+		}
+	});
+}
+
+
+// A copy shares the pool buffer, growing it into _inline (Reserve below the
+// length, or assigning a short piece of itself) must keep the whole string
+static bool CheckWString()
+{
+	WString a{ LongName };
+	WString b{ a };
+	if (!b.Reserve(0) || wcscmp(b.Buffer(), LongName) || wcscmp(a.Buffer(), LongName))
+	{
+		printf("WString Reserve(0) on a shared copy lost the string\n");
+		return false;
+	}
+
+	WString c{ a };
+	auto tail = LongName + wcslen(LongName) - 10;
+	c = c.Buffer() + (tail - LongName);
+	if (c.Size() != 10 || wcscmp(c.Buffer(), tail) || wcscmp(a.Buffer(), LongName))
+	{
+		printf("WString assigned a piece of its shared buffer lost the string\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+int main(int argc, char** argv)
+{
+	if (!CheckWString())
+		return 1;
+
+	Bench bench(argc, argv);
+	VectorBenchmarks(bench);
+	AllocBenchmarks(bench);
+	WStringBenchmarks(bench);
+	return 0;
+}
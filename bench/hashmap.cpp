@@ -0,0 +1,249 @@
+#include <ntddk.h>
+#include <vector>
+#include "Bench.h"
+#include "Vector.h"
+#include "HashMap.h"
+#include "IntrusiveHash.h"
+#include "StringView.h"
+
+
+
+/*
+	HashMap against a chained hash (IntrusiveHash) and the linear scans the
+	drivers used for lookups (FindPid, RetProcByName), from 100 to 100k keys.
+
+	- find hit / find miss: look up a random PID that is / isn't there
+	- erase + insert: drop a random PID and add a new one, the size stays the same
+	- find name: look up a random image name, the way RetProcByName does
+
+	The linear side does fewer ops as it gets bigger, ns/op is what to compare.
+*/
+
+struct Proc
+{
+	LIST_ENTRY PidHook;
+	LIST_ENTRY NameHook;
+	ULONG Pid;
+	CHAR Name[15];
+};
+
+static StringView NameOf(const Proc& proc) { return StringView::bounded(proc.Name, sizeof(proc.Name)); }
+
+
+// PIDs are multiples of 4, the ones in the set are even multiples and the
+// misses odd ones, shuffled so neither side gets them in order
+struct Keys
+{
+	std::vector<Proc> Procs;
+	std::vector<ULONG> Misses;
+
+	explicit Keys(int count) : Procs(count), Misses(count)
+	{
+		Bench::Random random(count);
+		for (int i = 0; i < count; ++i)
+		{
+			Procs[i].Pid = ULONG(i * 8 + 8);
+			Misses[i] = ULONG(i * 8 + 4);
+		}
+		for (int i = count - 1; i > 0; --i)
+		{
+			auto j = int(random.Below(i + 1));
+			auto pid = Procs[i].Pid;
+			Procs[i].Pid = Procs[j].Pid;
+			Procs[j].Pid = pid;
+		}
+		// Six digits fill Name exactly, up to 1M keys the names are unique
+		for (auto& proc : Procs)
+			snprintf(proc.Name, sizeof(proc.Name), "proc%06u.exe", (proc.Pid / 8) % 1000000);
+	}
+};
+
+
+struct HashMapSide
+{
+	static constexpr const char* Name{ "HashMap" };
+	static constexpr bool Scans{ false };
+	HashMap<ULONG, Proc*> ByPid;
+	HashMap<StringView, Proc*> ByName;
+
+	void Build(std::vector<Proc>& procs)
+	{
+		ByPid.Init(ULONG(procs.size()));
+		ByName.Init(ULONG(procs.size()));
+		for (auto& proc : procs)
+		{
+			ByPid.Insert(proc.Pid, &proc);
+			ByName.Insert(NameOf(proc), &proc);
+		}
+	}
+	Proc* Find(ULONG pid) { auto p = ByPid.Find(pid); return p ? *p : nullptr; }
+	Proc* Find(StringView name) { auto p = ByName.Find(name); return p ? *p : nullptr; }
+	void Replace(Proc& proc, ULONG pid) { ByPid.Erase(proc.Pid); proc.Pid = pid; ByPid.Insert(pid, &proc); }
+	void Free() { ByPid.Free(); ByName.Free(); }
+};
+
+struct ChainedSide
+{
+	static constexpr const char* Name{ "chained" };
+	static constexpr bool Scans{ false };
+	IntrusiveHash<Proc, &Proc::PidHook, &Proc::Pid> ByPid;
+	IntrusiveHash<Proc, &Proc::NameHook, NameOf> ByName;
+
+	void Build(std::vector<Proc>& procs)
+	{
+		ByPid.Init(ULONG(procs.size()));
+		ByName.Init(ULONG(procs.size()));
+		for (auto& proc : procs)
+		{
+			ByPid.Insert(&proc);
+			ByName.Insert(&proc);
+		}
+	}
+	Proc* Find(ULONG pid) { return ByPid.Find(pid); }
+	Proc* Find(StringView name) { return ByName.Find(name); }
+	void Replace(Proc& proc, ULONG pid) { ByPid.Remove(&proc); proc.Pid = pid; ByPid.Insert(&proc); }
+	void Free() { ByPid.Free(); ByName.Free(); }
+};
+
+struct LinearSide
+{
+	static constexpr const char* Name{ "linear" };
+	static constexpr bool Scans{ true };
+	vector<Proc*> Procs;
+
+	void Build(std::vector<Proc>& procs)
+	{
+		Procs.reserve(int(procs.size()));
+		for (auto& proc : procs)
+			Procs.push_back(&proc);
+	}
+	Proc* Find(ULONG pid)
+	{
+		for (auto proc : Procs)
+		{
+			if (proc->Pid == pid)
+				return proc;
+		}
+		return nullptr;
+	}
+	Proc* Find(StringView name)
+	{
+		for (auto proc : Procs)
+		{
+			if (NameOf(*proc).equals(name))
+				return proc;
+		}
+		return nullptr;
+	}
+	// Found by scanning, then replaced in place like the drivers' lists
+	void Replace(Proc& proc, ULONG pid)
+	{
+		for (int i = 0; i < Procs.size(); ++i)
+		{
+			if (Procs[i]->Pid == proc.Pid)
+			{
+				Procs.erase_unordered(i);
+				break;
+			}
+		}
+		proc.Pid = pid;
+		Procs.push_back(&proc);
+	}
+	void Free() { Procs.free(); }
+};
+
+
+template <typename Side>
+static void Lookups(Bench& bench, int count)
+{
+	// Roughly the same time per benchmark whatever the side
+	auto ops = Side::Scans ? 20'000'000 / count : 200'000;
+	char name[64];
+
+	snprintf(name, sizeof(name), "%-8s %-15s %6d keys", Side::Name, "find hit", count);
+	bench.Run(name, ops, [count](Bench::Timing& t, ULONG64 ops)
+	{
+		Keys keys(count);
+		Side side;
+		side.Build(keys.Procs);
+
+		Bench::Random random;
+		ULONG64 found{ 0 };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+			found += side.Find(keys.Procs[random.Below(count)].Pid) != nullptr;
+		t.Stop();
+		Bench::Keep(found);
+		side.Free();
+	});
+
+	snprintf(name, sizeof(name), "%-8s %-15s %6d keys", Side::Name, "find miss", count);
+	bench.Run(name, ops, [count](Bench::Timing& t, ULONG64 ops)
+	{
+		Keys keys(count);
+		Side side;
+		side.Build(keys.Procs);
+
+		Bench::Random random;
+		ULONG64 found{ 0 };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+			found += side.Find(keys.Misses[random.Below(count)]) != nullptr;
+		t.Stop();
+		Bench::Keep(found);
+		side.Free();
+	});
+
+	snprintf(name, sizeof(name), "%-8s %-15s %6d keys", Side::Name, "erase + insert", count);
+	bench.Run(name, ops, [count](Bench::Timing& t, ULONG64 ops)
+	{
+		Keys keys(count);
+		Side side;
+		side.Build(keys.Procs);
+
+		// New PIDs above every one in use, so they never collide
+		Bench::Random random;
+		auto next = ULONG(count * 8 + 8);
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i, next += 8)
+			side.Replace(keys.Procs[random.Below(count)], next);
+		t.Stop();
+		side.Free();
+	});
+
+	snprintf(name, sizeof(name), "%-8s %-15s %6d keys", Side::Name, "find name", count);
+	bench.Run(name, ops, [count](Bench::Timing& t, ULONG64 ops)
+	{
+		Keys keys(count);
+		Side side;
+		side.Build(keys.Procs);
+
+		Bench::Random random;
+		ULONG64 found{ 0 };
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+			found += side.Find(NameOf(keys.Procs[random.Below(count)])) != nullptr;
+		t.Stop();
+		Bench::Keep(found);
+		side.Free();
+	});
+}
+
+
+int main(int argc, char** argv)
+{
+	Bench bench(argc, argv);
+
+	for (auto count : { 100, 1'000, 10'000, 100'000 })
+	{
+		char title[32];
+		snprintf(title, sizeof(title), "%d keys", count);
+		bench.Section(title);
+
+		Lookups<HashMapSide>(bench, count);
+		Lookups<ChainedSide>(bench, count);
+		Lookups<LinearSide>(bench, count);
+	}
+
+	return 0;
+}
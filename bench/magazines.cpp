@@ -0,0 +1,83 @@
+#include <ntddk.h>
+#include "Bench.h"
+#include "Alloc.h"
+
+
+
+/*
+	Small Alloc/Free from 1 to 64 threads, with the per-CPU magazines (Alloc.h
+	as it is) against the slab alone behind one FastMutex, which is what every
+	small Alloc/Free went through before the magazines.
+
+	Each thread allocates a batch of blocks of mixed sizes and frees them
+	again, one op is one Alloc plus one Free. The shim emulates as many
+	processors as the machine has (BENCH_CPUS overrides it), the magazines
+	only pay off when there's more than one.
+*/
+
+struct MagazineSide
+{
+	static constexpr const char* Name{ "magazines" };
+	void Init() {}
+	PVOID Alloc(size_t NumberOfBytes) { return ::Alloc(NumberOfBytes, POOL_FLAG_NON_PAGED, 'hcnB'); }
+	void Free(PVOID p) { ::Free(p); }
+	void FreeAll() { ::FreeAll(); }
+};
+
+struct SlabSide
+{
+	static constexpr const char* Name{ "slab + mutex" };
+	FastMutex Mutex;
+	Slab Cache;
+
+	void Init() { Mutex.Init(); Cache.Init(POOL_FLAG_NON_PAGED); }
+	PVOID Alloc(size_t NumberOfBytes) { AutoLock lock(Mutex); return Cache.Alloc(NumberOfBytes); }
+	void Free(PVOID p) { AutoLock lock(Mutex); Cache.Free(p); }
+	void FreeAll() { Cache.FreeAll(); }
+};
+
+
+static constexpr int Batch{ 16 };
+static constexpr ULONG64 TotalOps{ 400'000 };
+
+
+template <typename Side>
+static void Scale(Bench& bench, int threads)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%-12s %2d threads", Side::Name, threads);
+
+	Side side;
+	side.Init();
+	bench.RunThreads(name, threads, TotalOps / threads, [&side](ULONG64 ops, int thread)
+	{
+		PVOID blocks[Batch];
+		Bench::Random random(thread + 1);
+		for (ULONG64 done = 0; done < ops; done += Batch)
+		{
+			for (auto& p : blocks)
+				p = side.Alloc(16 + random.Below(Slab::_maxBlock - 16));
+			for (auto& p : blocks)
+				side.Free(p);
+		}
+	});
+	side.FreeAll();
+}
+
+
+int main(int argc, char** argv)
+{
+	Bench bench(argc, argv);
+
+	char title[64];
+	snprintf(title, sizeof(title), "Alloc + Free, %u emulated processors", KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS));
+	bench.Section(title);
+
+	for (auto threads : { 1, 2, 4, 8, 16, 32, 64 })
+	{
+		Scale<MagazineSide>(bench, threads);
+		Scale<SlabSide>(bench, threads);
+	}
+
+	return 0;
+}
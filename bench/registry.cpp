@@ -0,0 +1,218 @@
+#include <ntddk.h>
+#include <vector>
+#include "Bench.h"
+// Every request goes through the registry, that's what's measured here
+#define ALLOC_NO_SLAB
+#include "Alloc.h"
+
+
+
+/*
+	_ALLOC_'s hash set registry against the array it replaced, which grew and
+	shrank 8 slots at a time and found a pointer by scanning. LinearRegistry
+	below is that array, the same algorithm as Alloc.h before the hash set.
+
+	For 1k, 10k and 100k live blocks:
+	- steady state: free a random live block and allocate a new one, the
+	  number of live blocks stays the same
+	- fill: allocate N blocks from an empty registry, per block
+
+	The linear fill isn't run at 100k with --quick, it's quadratic.
+*/
+
+class LinearRegistry
+{
+public:
+	void Init(int newCapacity);
+	PVOID Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag);
+	bool Free(PVOID& p);
+	void FreeAll();
+
+private:
+	FastMutex _mutex{};
+	ULONG_PTR* _alloc{ nullptr };
+	int _size{ 0 };
+	int _capacity{ 0 };
+	bool _initialized{ false };
+};
+
+
+inline void LinearRegistry::Init(int newCapacity)
+{
+	if (newCapacity == _capacity || newCapacity < _size)
+		return;
+
+	auto tmp = (ULONG_PTR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, newCapacity * sizeof(ULONG_PTR), 'looP');
+	if (tmp)
+	{
+		if (_alloc)
+		{
+			RtlCopyMemory(tmp, _alloc, _size * sizeof(ULONG_PTR));
+			ExFreePool(_alloc);
+		}
+		_alloc = tmp;
+		_capacity = newCapacity;
+
+		if (!_initialized)
+			_mutex.Init();
+		_initialized = true;
+	}
+}
+
+
+inline PVOID LinearRegistry::Alloc(size_t NumberOfBytes, ULONG64 PoolFlag, ULONG Tag)
+{
+	if (_capacity == 0)
+		Init(8);
+	else if (_size == _capacity)
+		Init(_capacity + 8);
+
+	if (_size >= _capacity)
+		return nullptr;
+
+	auto ptr = ExAllocatePool2(PoolFlag, NumberOfBytes, Tag);
+	if (ptr)
+	{
+		AutoLock lock(_mutex);
+		_alloc[_size++] = (ULONG_PTR)ptr;
+	}
+	return ptr;
+}
+
+
+inline bool LinearRegistry::Free(PVOID& p)
+{
+	if (_size == 0 || p == nullptr)
+		return false;
+
+	if (_size < (_capacity / 2) && ((_capacity / 2) % 8) == 0)
+		Init(_capacity / 2);
+	else if (_size < (_capacity / 2) && ((_capacity - 8) % 8) == 0)
+		Init(_capacity - 8);
+
+	for (int i = 0; i < _size; ++i)
+	{
+		if (_alloc[i] == (ULONG_PTR)p)
+		{
+			AutoLock lock(_mutex);
+			_alloc[i] = _alloc[_size - 1];
+			_alloc[--_size] = NULL;
+
+			ExFreePool(p);
+			p = nullptr;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+inline void LinearRegistry::FreeAll()
+{
+	if (_alloc)
+	{
+		while (_size > 0)
+			ExFreePool((PVOID)_alloc[--_size]);
+		ExFreePool(_alloc);
+		_alloc = nullptr;
+		_capacity = 0;
+	}
+}
+
+
+
+// The two registries behind one interface
+struct HashSide
+{
+	static constexpr const char* Name{ "hash" };
+	PVOID Alloc(size_t NumberOfBytes) { return ::Alloc(NumberOfBytes, POOL_FLAG_NON_PAGED, 'hcnB'); }
+	bool Free(PVOID& p) { return ::Free(p); }
+	void FreeAll() { ::FreeAll(); }
+};
+
+struct LinearSide
+{
+	static constexpr const char* Name{ "linear" };
+	LinearRegistry Registry;
+	PVOID Alloc(size_t NumberOfBytes) { return Registry.Alloc(NumberOfBytes, POOL_FLAG_NON_PAGED, 'hcnB'); }
+	bool Free(PVOID& p) { return Registry.Free(p); }
+	void FreeAll() { Registry.FreeAll(); }
+};
+
+
+// Bigger than Slab::_maxBlock, in case ALLOC_NO_SLAB ever goes away
+static constexpr size_t BlockSize{ 1024 };
+
+
+template <typename Side>
+static void SteadyState(Bench& bench, int live)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%-6s free + alloc, %6d live", Side::Name, live);
+
+	bench.Run(name, 20'000, [live](Bench::Timing& t, ULONG64 ops)
+	{
+		Side side;
+		std::vector<PVOID> blocks(live);
+		for (auto& p : blocks)
+			p = side.Alloc(BlockSize);
+
+		Bench::Random random;
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			auto& p = blocks[random.Below(live)];
+			side.Free(p);
+			p = side.Alloc(BlockSize);
+		}
+		t.Stop();
+		side.FreeAll();
+	});
+}
+
+
+template <typename Side>
+static void Fill(Bench& bench, int live)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%-6s fill, per block,  %6d live", Side::Name, live);
+
+	// ops is the number of times the registry is filled, reported per block
+	bench.Run(name, 1, [live](Bench::Timing& t, ULONG64 ops)
+	{
+		Side side;
+		std::vector<PVOID> blocks(live);
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			for (auto& p : blocks)
+				p = side.Alloc(BlockSize);
+		}
+		t.Stop();
+		side.FreeAll();
+		t.Items(live);
+	});
+}
+
+
+int main(int argc, char** argv)
+{
+	Bench bench(argc, argv);
+
+	bench.Section("Steady state, random victim");
+	for (auto live : { 1'000, 10'000, 100'000 })
+	{
+		SteadyState<HashSide>(bench, live);
+		SteadyState<LinearSide>(bench, live);
+	}
+
+	bench.Section("Fill from empty");
+	for (auto live : { 1'000, 10'000, 100'000 })
+	{
+		Fill<HashSide>(bench, live);
+		if (live < 100'000 || !bench.Quick())
+			Fill<LinearSide>(bench, live);
+	}
+
+	return 0;
+}
@@ -0,0 +1,848 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cwchar>
+#include <cstdarg>
+#include <cassert>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+
+// <new> already has placement new, keeps New.h from defining it again
+#define __PLACEMENT_NEW_INLINE
+
+
+
+/*
+	Just enough of ntddk.h to build the CustomFuncs headers as they are in user
+	mode on Linux, so they can be benchmarked with gcc/clang. Nothing in
+	CustomFuncs is changed for it, everything the headers expect from the WDK
+	is emulated here.
+
+	- Types have their Windows x64 widths (LONG/ULONG are 32 bit, ULONG64,
+	  SIZE_T and ULONG_PTR are all size_t). WCHAR is char16_t, UTF-16 like
+	  on Windows (the SSE2 code in Transcode.h counts on that), so wide
+	  literals are written u"..." and wcslen/wcscmp have char16_t overloads.
+	- ExAllocatePool2 / MmAllocateNonCachedMemory / lookaside lists go to the
+	  C heap. Requests of PAGE_SIZE or more are page aligned like the pool's,
+	  Slab.h relies on that. Every pool allocation and free is counted, see
+	  ShimPool below.
+	- FAST_MUTEX is a pthread mutex, EX_PUSH_LOCK a pthread rwlock, spin locks
+	  spin (and yield).
+	- IRQL is tracked per thread. Raising to DISPATCH_LEVEL takes one of
+	  ShimCpuCount() "processors" for the thread until it goes back below, so
+	  per-CPU data (Magazine.h) is never touched by two threads at once, the
+	  same guarantee the kernel gives. The thread keeps the processor it got
+	  first, like a thread that's rarely migrated.
+	- ASSERT is assert(), DBG follows NDEBUG.
+	- DbgPrintEx prints nothing.
+*/
+
+#ifdef NDEBUG
+#define DBG 0
+#else
+#define DBG 1
+#endif
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef const char* PCSTR;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, KIRQL, *PKIRQL;
+typedef short SHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64, *PLONG64, LONGLONG, LONG_PTR;
+typedef size_t ULONG64, *PULONG64, ULONGLONG, ULONG_PTR, SIZE_T, *PSIZE_T;
+typedef char16_t WCHAR, *PWCH, *PWSTR;
+typedef const char16_t* PCWCH, *PCWSTR;
+typedef LONG NTSTATUS;
+typedef PVOID HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+// What the WDK's C++ NULL is, the headers compare integers with it
+#undef NULL
+#define NULL 0
+
+#define FORCEINLINE inline
+#define __forceinline inline
+#define DECLSPEC_ALIGN(x) alignas(x)
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) ((type*)((PCHAR)(address) - (ULONG_PTR)(&((type*)0)->field)))
+#define MAXUSHORT 0xffff
+#define MAXULONG 0xffffffff
+
+// gcc < 13 only has the older spelling
+#if defined(__GNUC__) && !defined(__clang__) && !__has_builtin(__is_trivially_destructible)
+#define __is_trivially_destructible(T) __has_trivial_destructor(T)
+#endif
+
+#define ASSERT(exp) assert(exp)
+#define NT_ASSERT(exp) assert(exp)
+
+inline ULONG DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...)
+{
+	UNREFERENCED_PARAMETER(ComponentId);
+	UNREFERENCED_PARAMETER(Level);
+	UNREFERENCED_PARAMETER(Format);
+	return 0;
+}
+
+// The headers only define DbgMsg when it isn't already, and theirs relies on
+// MSVC dropping the comma when there are no arguments
+#define DbgMsg(x, ...) DbgPrintEx(0, 0, x __VA_OPT__(,) __VA_ARGS__)
+
+
+/*
+	Status codes
+*/
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
+#define STATUS_SOME_NOT_MAPPED			((NTSTATUS)0x00000107L)
+#define STATUS_BUFFER_OVERFLOW			((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL				((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER		((NTSTATUS)0xC000000DL)
+#define STATUS_NO_MEMORY				((NTSTATUS)0xC0000017L)
+#define STATUS_BUFFER_TOO_SMALL			((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_INVALID_PARAMETER_2		((NTSTATUS)0xC00000F0L)
+#define STATUS_ILLEGAL_CHARACTER		((NTSTATUS)0xC0000161L)
+#define STATUS_INVALID_BUFFER_SIZE		((NTSTATUS)0xC0000206L)
+
+
+/*
+	Memory
+*/
+
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+#define PAGE_ALIGN(Va) ((PVOID)((ULONG_PTR)(Va) & ~(PAGE_SIZE - 1)))
+
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill) memset((Destination), (Fill), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+
+#define POOL_FLAG_UNINITIALIZED		0x0000000000000002ULL
+#define POOL_FLAG_CACHE_ALIGNED		0x0000000000000004ULL
+#define POOL_FLAG_NON_PAGED			0x0000000000000040ULL
+#define POOL_FLAG_NON_PAGED_EXECUTE	0x0000000000000080ULL
+#define POOL_FLAG_PAGED				0x0000000000000100ULL
+
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	PagedPool,
+	NonPagedPoolNx = 512,
+} POOL_TYPE;
+
+
+// Everything that came from or went back to the "pool", benchmarks read the
+// difference around the code they time
+struct ShimPool
+{
+	static inline std::atomic<ULONG64> Allocs{ 0 };
+	static inline std::atomic<ULONG64> Frees{ 0 };
+	static inline std::atomic<ULONG64> Bytes{ 0 };
+};
+
+inline PVOID ShimAllocate(SIZE_T NumberOfBytes, ULONG64 Flags)
+{
+	if (!NumberOfBytes)
+		return nullptr;
+
+	size_t alignment = NumberOfBytes >= PAGE_SIZE ? PAGE_SIZE
+		: Flags & POOL_FLAG_CACHE_ALIGNED ? SYSTEM_CACHE_ALIGNMENT_SIZE : MEMORY_ALLOCATION_ALIGNMENT;
+	auto p = aligned_alloc(alignment, (NumberOfBytes + alignment - 1) & ~(alignment - 1));
+	if (!p)
+		return nullptr;
+
+	if (!(Flags & POOL_FLAG_UNINITIALIZED))
+		memset(p, 0, NumberOfBytes);
+
+	ShimPool::Allocs.fetch_add(1, std::memory_order_relaxed);
+	ShimPool::Bytes.fetch_add(NumberOfBytes, std::memory_order_relaxed);
+	return p;
+}
+
+inline void ShimFree(PVOID p)
+{
+	if (!p)
+		return;
+	ShimPool::Frees.fetch_add(1, std::memory_order_relaxed);
+	free(p);
+}
+
+inline PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+	UNREFERENCED_PARAMETER(Tag);
+	return ShimAllocate(NumberOfBytes, Flags);
+}
+
+inline void ExFreePool(PVOID P) { ShimFree(P); }
+inline void ExFreePoolWithTag(PVOID P, ULONG Tag) { UNREFERENCED_PARAMETER(Tag); ShimFree(P); }
+
+inline PVOID MmAllocateNonCachedMemory(SIZE_T NumberOfBytes)
+{
+	// Whole pages and zeroed, like the real one
+	return ShimAllocate((NumberOfBytes + PAGE_SIZE - 1) & ~(SIZE_T)(PAGE_SIZE - 1), 0);
+}
+
+inline void MmFreeNonCachedMemory(PVOID BaseAddress, SIZE_T NumberOfBytes)
+{
+	UNREFERENCED_PARAMETER(NumberOfBytes);
+	ShimFree(BaseAddress);
+}
+
+
+/*
+	IRQL and processors
+*/
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+typedef struct _PROCESSOR_NUMBER
+{
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+// Spins, and yields so a waiter doesn't sit on a core the holder needs
+inline void ShimSpinAcquire(ULONG_PTR* Lock)
+{
+	while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(Lock, __ATOMIC_RELAXED))
+			sched_yield();
+	}
+}
+
+inline void ShimSpinRelease(ULONG_PTR* Lock)
+{
+	__atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+struct DECLSPEC_CACHEALIGN ShimCpu
+{
+	ULONG_PTR Lock;
+};
+
+struct ShimThread
+{
+	KIRQL Irql{ PASSIVE_LEVEL };
+	LONG Cpu{ -1 };
+};
+
+inline thread_local ShimThread ShimCurrentThread;
+
+// BENCH_CPUS overrides the number of emulated processors
+inline ULONG ShimCpuCount()
+{
+	static const ULONG count = []
+	{
+		auto env = getenv("BENCH_CPUS");
+		auto n = env ? strtoul(env, nullptr, 10) : std::thread::hardware_concurrency();
+		return ULONG(n ? (n < 256 ? n : 256) : 1);
+	}();
+	return count;
+}
+
+inline ShimCpu* ShimCpus()
+{
+	static ShimCpu cpus[256]{};
+	return cpus;
+}
+
+inline ULONG ShimCpuOfThread()
+{
+	auto& thread = ShimCurrentThread;
+	if (thread.Cpu < 0)
+	{
+		static std::atomic<ULONG> next{ 0 };
+		thread.Cpu = LONG(next.fetch_add(1, std::memory_order_relaxed) % ShimCpuCount());
+	}
+	return ULONG(thread.Cpu);
+}
+
+inline KIRQL KeGetCurrentIrql() { return ShimCurrentThread.Irql; }
+
+inline void KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql)
+{
+	auto& thread = ShimCurrentThread;
+	*OldIrql = thread.Irql;
+	if (thread.Irql < DISPATCH_LEVEL && NewIrql >= DISPATCH_LEVEL)
+		ShimSpinAcquire(&ShimCpus()[ShimCpuOfThread()].Lock);
+	thread.Irql = NewIrql;
+}
+
+inline void KeLowerIrql(KIRQL NewIrql)
+{
+	auto& thread = ShimCurrentThread;
+	if (thread.Irql >= DISPATCH_LEVEL && NewIrql < DISPATCH_LEVEL)
+		ShimSpinRelease(&ShimCpus()[ShimCpuOfThread()].Lock);
+	thread.Irql = NewIrql;
+}
+
+inline KIRQL KeRaiseIrqlToDpcLevel()
+{
+	KIRQL irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	return irql;
+}
+
+inline ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+	auto cpu = ShimCpuOfThread();
+	if (ProcNumber)
+		*ProcNumber = { 0, UCHAR(cpu), 0 };
+	return cpu;
+}
+
+inline ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
+{
+	UNREFERENCED_PARAMETER(GroupNumber);
+	return ShimCpuCount();
+}
+
+inline ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber)
+{
+	UNREFERENCED_PARAMETER(GroupNumber);
+	return ShimCpuCount();
+}
+
+inline void KeEnterCriticalRegion() {}
+inline void KeLeaveCriticalRegion() {}
+
+
+/*
+	Locks
+*/
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+inline void KeInitializeSpinLock(PKSPIN_LOCK SpinLock) { *SpinLock = 0; }
+
+inline void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock) { ShimSpinAcquire(SpinLock); }
+inline void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock) { ShimSpinRelease(SpinLock); }
+
+inline void KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+	KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+	KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+inline void KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+	KeReleaseSpinLockFromDpcLevel(SpinLock);
+	KeLowerIrql(NewIrql);
+}
+
+typedef struct _FAST_MUTEX
+{
+	pthread_mutex_t Mutex;
+	KIRQL OldIrql;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+inline void ExInitializeFastMutex(PFAST_MUTEX FastMutex)
+{
+	pthread_mutex_init(&FastMutex->Mutex, nullptr);
+}
+
+inline void ExAcquireFastMutex(PFAST_MUTEX FastMutex)
+{
+	pthread_mutex_lock(&FastMutex->Mutex);
+	FastMutex->OldIrql = KeGetCurrentIrql();
+	ShimCurrentThread.Irql = APC_LEVEL;
+}
+
+inline void ExReleaseFastMutex(PFAST_MUTEX FastMutex)
+{
+	ShimCurrentThread.Irql = FastMutex->OldIrql;
+	pthread_mutex_unlock(&FastMutex->Mutex);
+}
+
+typedef pthread_rwlock_t EX_PUSH_LOCK, *PEX_PUSH_LOCK;
+#define EX_DEFAULT_PUSH_LOCK_FLAGS 0
+
+inline void ExInitializePushLock(PEX_PUSH_LOCK PushLock) { pthread_rwlock_init(PushLock, nullptr); }
+inline void ExAcquirePushLockExclusiveEx(PEX_PUSH_LOCK PushLock, ULONG Flags) { UNREFERENCED_PARAMETER(Flags); pthread_rwlock_wrlock(PushLock); }
+inline void ExReleasePushLockExclusiveEx(PEX_PUSH_LOCK PushLock, ULONG Flags) { UNREFERENCED_PARAMETER(Flags); pthread_rwlock_unlock(PushLock); }
+inline void ExAcquirePushLockSharedEx(PEX_PUSH_LOCK PushLock, ULONG Flags) { UNREFERENCED_PARAMETER(Flags); pthread_rwlock_rdlock(PushLock); }
+inline void ExReleasePushLockSharedEx(PEX_PUSH_LOCK PushLock, ULONG Flags) { UNREFERENCED_PARAMETER(Flags); pthread_rwlock_unlock(PushLock); }
+
+
+/*
+	Interlocked and bit intrinsics
+*/
+
+#define InterlockedIncrement(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Addend) __atomic_sub_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(Addend) __atomic_sub_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd(Addend, Value) __atomic_add_fetch((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(Addend, Value) __atomic_add_fetch((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+
+inline PVOID InterlockedExchangePointer(PVOID volatile* Target, PVOID Value)
+{
+	return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(LONG volatile* Destination, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+inline LONG64 InterlockedCompareExchange64(LONG64 volatile* Destination, LONG64 Exchange, LONG64 Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* Destination, PVOID Exchange, PVOID Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+inline BOOLEAN InterlockedBitTestAndSet64(LONG64 volatile* Base, LONG64 Offset)
+{
+	return (__atomic_fetch_or(Base, LONG64(1) << Offset, __ATOMIC_SEQ_CST) >> Offset) & 1;
+}
+
+inline BOOLEAN InterlockedBitTestAndReset64(LONG64 volatile* Base, LONG64 Offset)
+{
+	return (__atomic_fetch_and(Base, ~(LONG64(1) << Offset), __ATOMIC_SEQ_CST) >> Offset) & 1;
+}
+
+#define ReadNoFence(Source) __atomic_load_n((Source), __ATOMIC_RELAXED)
+#define ReadNoFence64(Source) __atomic_load_n((Source), __ATOMIC_RELAXED)
+#define ReadAcquire(Source) __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(Source) __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define ReadPointerAcquire(Source) __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define WriteRelease(Destination, Value) __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define WriteRelease64(Destination, Value) __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define WritePointerRelease(Destination, Value) __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrier() MemoryBarrier()
+#define YieldProcessor() sched_yield()
+
+inline BOOLEAN _bittest64(const LONG64* Base, LONG64 Offset) { return (*Base >> Offset) & 1; }
+
+inline BOOLEAN _bittestandset64(LONG64* Base, LONG64 Offset)
+{
+	BOOLEAN old = (*Base >> Offset) & 1;
+	*Base |= LONG64(1) << Offset;
+	return old;
+}
+
+inline BOOLEAN _bittestandreset64(LONG64* Base, LONG64 Offset)
+{
+	BOOLEAN old = (*Base >> Offset) & 1;
+	*Base &= ~(LONG64(1) << Offset);
+	return old;
+}
+
+inline BOOLEAN _BitScanForward(ULONG* Index, ULONG Mask)
+{
+	if (!Mask)
+		return FALSE;
+	*Index = __builtin_ctz(Mask);
+	return TRUE;
+}
+
+inline BOOLEAN _BitScanReverse(ULONG* Index, ULONG Mask)
+{
+	if (!Mask)
+		return FALSE;
+	*Index = 31 - __builtin_clz(Mask);
+	return TRUE;
+}
+
+inline BOOLEAN _BitScanForward64(ULONG* Index, ULONG64 Mask)
+{
+	if (!Mask)
+		return FALSE;
+	*Index = __builtin_ctzll(Mask);
+	return TRUE;
+}
+
+inline BOOLEAN _BitScanReverse64(ULONG* Index, ULONG64 Mask)
+{
+	if (!Mask)
+		return FALSE;
+	*Index = 63 - __builtin_clzll(Mask);
+	return TRUE;
+}
+
+
+/*
+	Lists
+*/
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY* Flink;
+	struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+inline void InitializeListHead(PLIST_ENTRY ListHead) { ListHead->Flink = ListHead->Blink = ListHead; }
+inline BOOLEAN IsListEmpty(const LIST_ENTRY* ListHead) { return ListHead->Flink == ListHead; }
+
+inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+	auto blink = Entry->Blink;
+	auto flink = Entry->Flink;
+	blink->Flink = flink;
+	flink->Blink = blink;
+	return flink == blink;
+}
+
+inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+	auto entry = ListHead->Flink;
+	RemoveEntryList(entry);
+	return entry;
+}
+
+inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead)
+{
+	auto entry = ListHead->Blink;
+	RemoveEntryList(entry);
+	return entry;
+}
+
+inline void InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	auto flink = ListHead->Flink;
+	Entry->Flink = flink;
+	Entry->Blink = ListHead;
+	flink->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+
+inline void InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	auto blink = ListHead->Blink;
+	Entry->Flink = ListHead;
+	Entry->Blink = blink;
+	blink->Flink = Entry;
+	ListHead->Blink = Entry;
+}
+
+// The header carries a spin lock instead of the ABA counter, same size
+typedef struct _SLIST_ENTRY
+{
+	struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(16) _SLIST_HEADER
+{
+	PSLIST_ENTRY Next;
+	KSPIN_LOCK Lock;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+inline void InitializeSListHead(PSLIST_HEADER ListHead)
+{
+	ListHead->Next = nullptr;
+	ListHead->Lock = 0;
+}
+
+inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY ListEntry)
+{
+	KeAcquireSpinLockAtDpcLevel(&ListHead->Lock);
+	auto first = ListHead->Next;
+	ListEntry->Next = first;
+	ListHead->Next = ListEntry;
+	KeReleaseSpinLockFromDpcLevel(&ListHead->Lock);
+	return first;
+}
+
+inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER ListHead)
+{
+	KeAcquireSpinLockAtDpcLevel(&ListHead->Lock);
+	auto first = ListHead->Next;
+	if (first)
+		ListHead->Next = first->Next;
+	KeReleaseSpinLockFromDpcLevel(&ListHead->Lock);
+	return first;
+}
+
+inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER ListHead)
+{
+	KeAcquireSpinLockAtDpcLevel(&ListHead->Lock);
+	auto first = ListHead->Next;
+	ListHead->Next = nullptr;
+	KeReleaseSpinLockFromDpcLevel(&ListHead->Lock);
+	return first;
+}
+
+
+/*
+	Lookaside lists
+*/
+
+typedef struct _LOOKASIDE_LIST_EX
+{
+	SIZE_T Size;
+	ULONG64 Flags;
+	SLIST_HEADER Free;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+inline NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Allocate, PVOID Free,
+	POOL_TYPE PoolType, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth)
+{
+	UNREFERENCED_PARAMETER(Allocate);
+	UNREFERENCED_PARAMETER(Free);
+	UNREFERENCED_PARAMETER(Flags);
+	UNREFERENCED_PARAMETER(Tag);
+	UNREFERENCED_PARAMETER(Depth);
+	Lookaside->Size = Size < sizeof(SLIST_ENTRY) ? sizeof(SLIST_ENTRY) : Size;
+	Lookaside->Flags = PoolType == PagedPool ? POOL_FLAG_PAGED : POOL_FLAG_NON_PAGED;
+	InitializeSListHead(&Lookaside->Free);
+	return STATUS_SUCCESS;
+}
+
+inline void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+	for (auto entry = InterlockedFlushSList(&Lookaside->Free); entry;)
+	{
+		auto next = entry->Next;
+		ShimFree(entry);
+		entry = next;
+	}
+}
+
+// Blocks come back the way the last user left them, like the real list
+inline PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+	if (auto entry = InterlockedPopEntrySList(&Lookaside->Free))
+		return entry;
+	return ShimAllocate(Lookaside->Size, Lookaside->Flags | POOL_FLAG_UNINITIALIZED);
+}
+
+inline void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry)
+{
+	InterlockedPushEntrySList(&Lookaside->Free, (PSLIST_ENTRY)Entry);
+}
+
+
+/*
+	Strings
+*/
+
+// libc's are for 32 bit wchar_t
+inline size_t wcslen(PCWSTR str)
+{
+	auto end = str;
+	while (*end)
+		++end;
+	return size_t(end - str);
+}
+
+inline int wcscmp(PCWSTR a, PCWSTR b)
+{
+	for (; *a && *a == *b; ++a, ++b);
+	return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+typedef struct _UNICODE_STRING
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+typedef struct _STRING
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	PCHAR Buffer;
+} STRING, ANSI_STRING, *PANSI_STRING;
+typedef const STRING CANSI_STRING;
+typedef const STRING* PCANSI_STRING;
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), (decltype(+(s)))(s) }
+
+inline void RtlInitUnicodeString(PUNICODE_STRING DestinationString, PCWSTR SourceString)
+{
+	auto length = SourceString ? wcslen(SourceString) * sizeof(WCHAR) : 0;
+	DestinationString->Length = USHORT(length);
+	DestinationString->MaximumLength = USHORT(SourceString ? length + sizeof(WCHAR) : 0);
+	DestinationString->Buffer = (PWCH)SourceString;
+}
+
+inline void RtlInitAnsiString(PANSI_STRING DestinationString, PCSTR SourceString)
+{
+	auto length = SourceString ? strlen(SourceString) : 0;
+	DestinationString->Length = USHORT(length);
+	DestinationString->MaximumLength = USHORT(SourceString ? length + 1 : 0);
+	DestinationString->Buffer = (PCHAR)SourceString;
+}
+
+inline WCHAR RtlUpcaseUnicodeChar(WCHAR SourceCharacter)
+{
+	return SourceCharacter >= u'a' && SourceCharacter <= u'z' ? WCHAR(SourceCharacter - (u'a' - u'A')) : SourceCharacter;
+}
+
+inline LONG RtlCompareUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive)
+{
+	auto len1 = String1->Length / sizeof(WCHAR), len2 = String2->Length / sizeof(WCHAR);
+	for (size_t i = 0; i < len1 && i < len2; ++i)
+	{
+		auto a = String1->Buffer[i], b = String2->Buffer[i];
+		if (CaseInSensitive)
+		{
+			a = RtlUpcaseUnicodeChar(a);
+			b = RtlUpcaseUnicodeChar(b);
+		}
+		if (a != b)
+			return a < b ? -1 : 1;
+	}
+	return LONG(len1) - LONG(len2);
+}
+
+inline BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive)
+{
+	return String1->Length == String2->Length && !RtlCompareUnicodeString(String1, String2, CaseInSensitive);
+}
+
+inline void RtlCopyUnicodeString(PUNICODE_STRING DestinationString, PCUNICODE_STRING SourceString)
+{
+	if (!SourceString)
+	{
+		DestinationString->Length = 0;
+		return;
+	}
+
+	auto length = SourceString->Length < DestinationString->MaximumLength ? SourceString->Length : DestinationString->MaximumLength;
+	memmove(DestinationString->Buffer, SourceString->Buffer, length);
+	DestinationString->Length = length;
+	if (length + sizeof(WCHAR) <= DestinationString->MaximumLength)
+		DestinationString->Buffer[length / sizeof(WCHAR)] = 0;
+}
+
+// Only the AllocateDestinationString == FALSE forms, which is all CustomFuncs uses.
+// Code pages are Latin-1, every CHAR is one WCHAR and back.
+inline NTSTATUS RtlAnsiStringToUnicodeString(PUNICODE_STRING DestinationString, PCANSI_STRING SourceString, BOOLEAN AllocateDestinationString)
+{
+	if (AllocateDestinationString)
+		return STATUS_INVALID_PARAMETER;
+
+	ULONG length = SourceString->Length * sizeof(WCHAR);
+	if (length > MAXUSHORT)
+		return STATUS_INVALID_PARAMETER_2;
+	if (length > DestinationString->MaximumLength)
+		return STATUS_BUFFER_OVERFLOW;
+
+	for (USHORT i = 0; i < SourceString->Length; ++i)
+		DestinationString->Buffer[i] = (UCHAR)SourceString->Buffer[i];
+	DestinationString->Length = USHORT(length);
+	if (length + sizeof(WCHAR) <= DestinationString->MaximumLength)
+		DestinationString->Buffer[SourceString->Length] = 0;
+	return STATUS_SUCCESS;
+}
+
+inline NTSTATUS RtlUnicodeStringToAnsiString(PANSI_STRING DestinationString, PCUNICODE_STRING SourceString, BOOLEAN AllocateDestinationString)
+{
+	if (AllocateDestinationString)
+		return STATUS_INVALID_PARAMETER;
+
+	USHORT length = USHORT(SourceString->Length / sizeof(WCHAR));
+	auto status = STATUS_SUCCESS;
+	if (length >= DestinationString->MaximumLength)
+	{
+		if (!DestinationString->MaximumLength)
+			return STATUS_BUFFER_OVERFLOW;
+		length = DestinationString->MaximumLength - 1;
+		status = STATUS_BUFFER_OVERFLOW;
+	}
+
+	for (USHORT i = 0; i < length; ++i)
+	{
+		auto c = SourceString->Buffer[i];
+		DestinationString->Buffer[i] = c < 0x100 ? CHAR(c) : '?';
+	}
+	DestinationString->Length = length;
+	DestinationString->Buffer[length] = 0;
+	return status;
+}
+
+// Plain scalar decoder, what Transcode.h is measured against
+inline NTSTATUS RtlUTF8ToUnicodeN(PWSTR UnicodeStringDestination, ULONG UnicodeStringMaxByteCount,
+	PULONG UnicodeStringActualByteCount, PCSTR UTF8StringSource, ULONG UTF8StringByteCount)
+{
+	auto src = (const UCHAR*)UTF8StringSource;
+	auto end = src + UTF8StringByteCount;
+	ULONG written{ 0 };
+	auto status = STATUS_SUCCESS;
+
+	while (src < end)
+	{
+		auto lead = *src++;
+		ULONG cp, extra;
+		if (lead < 0x80) { cp = lead; extra = 0; }
+		else if (lead >= 0xC2 && lead <= 0xDF) { cp = lead & 0x1F; extra = 1; }
+		else if (lead >= 0xE0 && lead <= 0xEF) { cp = lead & 0x0F; extra = 2; }
+		else if (lead >= 0xF0 && lead <= 0xF4) { cp = lead & 0x07; extra = 3; }
+		else { cp = 0xFFFD; extra = 0; status = STATUS_SOME_NOT_MAPPED; }
+
+		ULONG i{ 0 };
+		for (; i < extra && src + i < end && (src[i] & 0xC0) == 0x80; ++i)
+			cp = (cp << 6) | (src[i] & 0x3F);
+		src += i;
+
+		// Truncated, overlong, a surrogate or past U+10FFFF
+		if (i < extra || (extra == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (extra == 3 && (cp < 0x10000 || cp > 0x10FFFF)))
+		{
+			cp = 0xFFFD;
+			status = STATUS_SOME_NOT_MAPPED;
+		}
+
+		WCHAR units[2]{ WCHAR(cp), 0 };
+		ULONG count{ 1 };
+		if (cp >= 0x10000)
+		{
+			cp -= 0x10000;
+			units[0] = WCHAR(0xD800 + (cp >> 10));
+			units[1] = WCHAR(0xDC00 + (cp & 0x3FF));
+			count = 2;
+		}
+
+		if (UnicodeStringDestination)
+		{
+			if ((written + count) * sizeof(WCHAR) > UnicodeStringMaxByteCount)
+			{
+				*UnicodeStringActualByteCount = written * sizeof(WCHAR);
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+			for (ULONG i = 0; i < count; ++i)
+				UnicodeStringDestination[written + i] = units[i];
+		}
+		written += count;
+	}
+
+	*UnicodeStringActualByteCount = written * sizeof(WCHAR);
+	return status;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "ntddk.h"
+
+
+
+/*
+	The two ntstrsafe.h routines WString.h uses. There is no printf for
+	char16_t, so the format is narrowed, run through vsnprintf and widened
+	again: numbers, %c and narrow %s work, wide string arguments (%ws, %ls,
+	%wZ) don't. Anything outside ASCII in the format becomes '?'. On overflow
+	the buffer holds as much as fit, zero terminated, like the real ones.
+*/
+
+inline NTSTATUS RtlStringCbVPrintfW(PWSTR pszDest, size_t cbDest, PCWSTR pszFormat, va_list argList)
+{
+	auto count = cbDest / sizeof(WCHAR);
+	if (!count)
+		return STATUS_INVALID_PARAMETER;
+
+	char format[256];
+	auto len = wcslen(pszFormat);
+	if (len >= sizeof(format))
+		return STATUS_INVALID_PARAMETER;
+	for (size_t i = 0; i <= len; ++i)
+		format[i] = pszFormat[i] < 0x80 ? char(pszFormat[i]) : '?';
+
+	char narrow[1024];
+	auto room = count < sizeof(narrow) ? count : sizeof(narrow);
+	auto needed = vsnprintf(narrow, room, format, argList);
+	if (needed < 0)
+	{
+		pszDest[0] = 0;
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	size_t i{ 0 };
+	for (; narrow[i]; ++i)
+		pszDest[i] = (UCHAR)narrow[i];
+	pszDest[i] = 0;
+	return size_t(needed) < room ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+inline NTSTATUS RtlStringCbPrintfW(PWSTR pszDest, size_t cbDest, PCWSTR pszFormat, ...)
+{
+	va_list args;
+	va_start(args, pszFormat);
+	auto status = RtlStringCbVPrintfW(pszDest, cbDest, pszFormat, args);
+	va_end(args);
+	return status;
+}
@@ -0,0 +1,237 @@
+#include <ntddk.h>
+#include <vector>
+#include "Bench.h"
+#include "Transcode.h"
+
+
+
+/*
+	Transcode.h throughput against scalar one-character-at-a-time conversion
+	(the shim's RtlUTF8ToUnicodeN, RtlAnsiStringToUnicodeString and
+	RtlUnicodeStringToAnsiString, loops like the ones WString went through).
+
+	Inputs are an image path (ASCII, ~100 characters), a command line (ASCII,
+	4 KB) and 4 KB of mixed text (ASCII runs, Cyrillic, CJK and characters
+	outside the BMP). Times are per input character, a UTF-8 byte or a WCHAR.
+	Before timing, every conversion is checked against the scalar one and the
+	program fails if they disagree.
+*/
+
+static void AppendUtf8(std::vector<CHAR>& out, ULONG cp)
+{
+	if (cp < 0x80)
+		out.push_back(CHAR(cp));
+	else if (cp < 0x800)
+	{
+		out.push_back(CHAR(0xC0 | cp >> 6));
+		out.push_back(CHAR(0x80 | (cp & 0x3F)));
+	}
+	else if (cp < 0x10000)
+	{
+		out.push_back(CHAR(0xE0 | cp >> 12));
+		out.push_back(CHAR(0x80 | (cp >> 6 & 0x3F)));
+		out.push_back(CHAR(0x80 | (cp & 0x3F)));
+	}
+	else
+	{
+		out.push_back(CHAR(0xF0 | cp >> 18));
+		out.push_back(CHAR(0x80 | (cp >> 12 & 0x3F)));
+		out.push_back(CHAR(0x80 | (cp >> 6 & 0x3F)));
+		out.push_back(CHAR(0x80 | (cp & 0x3F)));
+	}
+}
+
+struct Input
+{
+	const char* Name;
+	std::vector<CHAR> Utf8;
+	std::vector<WCHAR> Utf16;
+	bool Ascii;
+};
+
+static Input Ascii(const char* name, const char* text, size_t bytes)
+{
+	Input input{ name, {}, {}, true };
+	for (size_t i = 0; input.Utf8.size() < bytes; ++i)
+		input.Utf8.push_back(text[i % strlen(text)]);
+	for (auto c : input.Utf8)
+		input.Utf16.push_back(WCHAR(c));
+	return input;
+}
+
+static Input Mixed(size_t bytes)
+{
+	// Words of ASCII, Cyrillic, CJK and an emoji
+	static constexpr ULONG words[][6]
+	{
+		{ 'p', 'a', 't', 'h', ' ', 0 },
+		{ 0x41F, 0x440, 0x438, 0x432, 0x435, 0x442 },
+		{ ' ', 0x65E5, 0x672C, 0x8A9E, ' ', 0 },
+		{ 'l', 'o', 'g', 0x1F600, ' ', 0 },
+	};
+
+	Input input{ "mixed text 4 KB", {}, {}, false };
+	for (size_t i = 0; input.Utf8.size() < bytes; ++i)
+	{
+		for (auto cp : words[i % 4])
+		{
+			if (!cp)
+				break;
+			AppendUtf8(input.Utf8, cp);
+			if (cp > 0xFFFF)
+			{
+				input.Utf16.push_back(WCHAR(0xD800 + ((cp - 0x10000) >> 10)));
+				input.Utf16.push_back(WCHAR(0xDC00 + (cp & 0x3FF)));
+			}
+			else
+				input.Utf16.push_back(WCHAR(cp));
+		}
+	}
+	return input;
+}
+
+
+// Transcode.h has to give exactly what the scalar conversion gives
+static bool Check(const Input& input)
+{
+	std::vector<WCHAR> wide(input.Utf8.size() + 16);
+	size_t chars{};
+	if (!NT_SUCCESS(Utf8ToUtf16(input.Utf8.data(), input.Utf8.size(), wide.data(), wide.size(), &chars))
+		|| chars != input.Utf16.size() || memcmp(wide.data(), input.Utf16.data(), chars * sizeof(WCHAR)))
+	{
+		printf("Utf8ToUtf16 doesn't match on %s\n", input.Name);
+		return false;
+	}
+
+	ULONG bytes{};
+	if (!NT_SUCCESS(RtlUTF8ToUnicodeN(wide.data(), ULONG(wide.size() * sizeof(WCHAR)), &bytes, input.Utf8.data(), ULONG(input.Utf8.size())))
+		|| bytes != input.Utf16.size() * sizeof(WCHAR) || memcmp(wide.data(), input.Utf16.data(), bytes))
+	{
+		printf("RtlUTF8ToUnicodeN doesn't match on %s\n", input.Name);
+		return false;
+	}
+
+	std::vector<CHAR> narrow(input.Utf8.size() + 16);
+	size_t written{};
+	if (!NT_SUCCESS(Utf16ToUtf8(input.Utf16.data(), input.Utf16.size(), narrow.data(), narrow.size(), &written))
+		|| written != input.Utf8.size() || memcmp(narrow.data(), input.Utf8.data(), written))
+	{
+		printf("Utf16ToUtf8 doesn't match on %s\n", input.Name);
+		return false;
+	}
+
+	return true;
+}
+
+
+static void Benchmarks(Bench& bench, const Input& input)
+{
+	bench.Section(input.Name);
+
+	auto utf8 = input.Utf8.data();
+	auto utf8Bytes = input.Utf8.size();
+	auto utf16 = input.Utf16.data();
+	auto utf16Chars = input.Utf16.size();
+
+	bench.Run("Utf8ToUtf16", 100'000'000 / utf8Bytes, [&](Bench::Timing& t, ULONG64 ops)
+	{
+		std::vector<WCHAR> dst(utf8Bytes);
+		size_t written{};
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			Utf8ToUtf16(utf8, utf8Bytes, dst.data(), dst.size(), &written);
+			Bench::Keep(dst[0]);
+		}
+		t.Stop();
+		t.Items(utf8Bytes);
+	});
+
+	bench.Run("RtlUTF8ToUnicodeN (scalar)", 100'000'000 / utf8Bytes, [&](Bench::Timing& t, ULONG64 ops)
+	{
+		std::vector<WCHAR> dst(utf8Bytes);
+		ULONG written{};
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			RtlUTF8ToUnicodeN(dst.data(), ULONG(dst.size() * sizeof(WCHAR)), &written, utf8, ULONG(utf8Bytes));
+			Bench::Keep(dst[0]);
+		}
+		t.Stop();
+		t.Items(utf8Bytes);
+	});
+
+	if (input.Ascii)
+	{
+		bench.Run("RtlAnsiStringToUnicodeString (scalar)", 100'000'000 / utf8Bytes, [&](Bench::Timing& t, ULONG64 ops)
+		{
+			std::vector<WCHAR> dst(utf8Bytes);
+			ANSI_STRING src{ USHORT(utf8Bytes), USHORT(utf8Bytes), (PCHAR)utf8 };
+			UNICODE_STRING unicode{ 0, USHORT(dst.size() * sizeof(WCHAR)), dst.data() };
+			t.Start();
+			for (ULONG64 i = 0; i < ops; ++i)
+			{
+				RtlAnsiStringToUnicodeString(&unicode, &src, FALSE);
+				Bench::Keep(dst[0]);
+			}
+			t.Stop();
+			t.Items(utf8Bytes);
+		});
+	}
+
+	bench.Run("Utf16ToUtf8", 100'000'000 / utf16Chars, [&](Bench::Timing& t, ULONG64 ops)
+	{
+		std::vector<CHAR> dst(utf8Bytes);
+		size_t written{};
+		t.Start();
+		for (ULONG64 i = 0; i < ops; ++i)
+		{
+			Utf16ToUtf8(utf16, utf16Chars, dst.data(), dst.size(), &written);
+			Bench::Keep(dst[0]);
+		}
+		t.Stop();
+		t.Items(utf16Chars);
+	});
+
+	if (input.Ascii)
+	{
+		bench.Run("RtlUnicodeStringToAnsiString (scalar)", 100'000'000 / utf16Chars, [&](Bench::Timing& t, ULONG64 ops)
+		{
+			std::vector<CHAR> dst(utf16Chars + 1);
+			UNICODE_STRING src{ USHORT(utf16Chars * sizeof(WCHAR)), USHORT(utf16Chars * sizeof(WCHAR)), (PWCH)utf16 };
+			ANSI_STRING ansi{ 0, USHORT(dst.size()), dst.data() };
+			t.Start();
+			for (ULONG64 i = 0; i < ops; ++i)
+			{
+				RtlUnicodeStringToAnsiString(&ansi, &src, FALSE);
+				Bench::Keep(dst[0]);
+			}
+			t.Stop();
+			t.Items(utf16Chars);
+		});
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	Bench bench(argc, argv);
+
+	const Input inputs[]
+	{
+		Ascii("image path ~100 B", "\\Device\\HarddiskVolume3\\Program Files\\Vendor\\Product\\bin\\x64\\service-host.exe", 100),
+		Ascii("command line 4 KB", "\"C:\\Windows\\System32\\svchost.exe\" -k netsvcs -p -s Schedule /flag:value ", 4096),
+		Mixed(4096),
+	};
+
+	for (auto& input : inputs)
+	{
+		if (!Check(input))
+			return 1;
+	}
+
+	for (auto& input : inputs)
+		Benchmarks(bench, input);
+
+	return 0;
+}